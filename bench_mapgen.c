@@ -0,0 +1,198 @@
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "map.h"
+
+/*
+ * Generates maps of various sizes from a range of seeds, and reports
+ * how long each phase of map_new_seeded() took.  The checksum covers all
+ * the maps generated for a given size; if it changes after an optimization,
+ * the optimization broke something.
+ */
+
+#define	MAX_PHASES	16
+#define	MAX_SIZES	16
+
+struct phase_timing {
+	const char	*pt_name;
+	double		pt_seconds;
+};
+
+struct bench {
+	struct phase_timing	b_phases[MAX_PHASES];
+	unsigned int		b_nphases;
+	int			b_current;
+	struct timespec		b_started;
+};
+
+static double
+timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+
+	return ((b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9);
+}
+
+static void
+bench_phase_callback(const char *phase, void *arg)
+{
+	struct bench *b;
+	struct timespec now;
+	unsigned int i;
+
+	b = arg;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+		err(1, "clock_gettime");
+
+	if (b->b_current >= 0)
+		b->b_phases[b->b_current].pt_seconds += timespec_diff(&b->b_started, &now);
+
+	if (phase == NULL) {
+		b->b_current = -1;
+		return;
+	}
+
+	for (i = 0; i < b->b_nphases; i++) {
+		if (strcmp(b->b_phases[i].pt_name, phase) == 0)
+			break;
+	}
+	if (i == b->b_nphases) {
+		if (b->b_nphases == MAX_PHASES)
+			errx(1, "too many phases");
+		b->b_phases[i].pt_name = phase;
+		b->b_nphases++;
+	}
+	b->b_current = i;
+
+	/*
+	 * Take the time again, so that our own overhead doesn't count.
+	 */
+	if (clock_gettime(CLOCK_MONOTONIC, &b->b_started) != 0)
+		err(1, "clock_gettime");
+}
+
+/*
+ * FNV-1a over the cells.
+ */
+static unsigned long long
+map_checksum(struct map *m, unsigned long long hash)
+{
+	unsigned int x, y;
+
+	for (y = 0; y < map_get_height(m); y++) {
+		for (x = 0; x < map_get_width(m); x++) {
+			hash ^= (unsigned char)map_get(m, x, y);
+			hash *= 1099511628211ULL;
+		}
+	}
+
+	return (hash);
+}
+
+static long
+peak_memory_kb(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		err(1, "getrusage");
+
+	return (ru.ru_maxrss);
+}
+
+static void
+bench_size(unsigned int w, unsigned int h, unsigned int first_seed, unsigned int seeds)
+{
+	struct bench b;
+	struct map *m;
+	struct timespec started, finished;
+	unsigned long long hash = 14695981039346656037ULL;
+	unsigned int seed, i;
+	double cells, total;
+
+	memset(&b, 0, sizeof(b));
+	b.b_current = -1;
+	cells = (double)w * h * seeds;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &started) != 0)
+		err(1, "clock_gettime");
+	for (seed = first_seed; seed < first_seed + seeds; seed++) {
+		m = map_new_seeded(w, h, seed, bench_phase_callback, &b);
+		hash = map_checksum(m, hash);
+		map_delete(m);
+	}
+	if (clock_gettime(CLOCK_MONOTONIC, &finished) != 0)
+		err(1, "clock_gettime");
+	total = timespec_diff(&started, &finished);
+
+	printf("%ux%u, %u seeds from %u:\n", w, h, seeds, first_seed);
+	for (i = 0; i < b.b_nphases; i++) {
+		printf("  %-24s %10.3f ms/map %12.0f cells/s\n", b.b_phases[i].pt_name,
+		    b.b_phases[i].pt_seconds * 1000 / seeds,
+		    b.b_phases[i].pt_seconds > 0 ? cells / b.b_phases[i].pt_seconds : 0);
+	}
+	printf("  %-24s %10.3f ms/map %12.0f cells/s\n", "total",
+	    total * 1000 / seeds, total > 0 ? cells / total : 0);
+	printf("  peak memory %ld kB, checksum %016llx\n", peak_memory_kb(), hash);
+}
+
+static void
+usage(void)
+{
+
+	printf("usage: bench_mapgen [-f first-seed] [-n seeds] [-s widthxheight ...]\n");
+	exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int widths[MAX_SIZES], heights[MAX_SIZES];
+	unsigned int nsizes = 0, first_seed = 1, seeds = 5, i;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "f:n:s:")) != -1) {
+		switch (ch) {
+		case 'f':
+			first_seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			seeds = strtoul(optarg, NULL, 10);
+			if (seeds == 0)
+				errx(1, "invalid number of seeds");
+			break;
+		case 's':
+			if (nsizes == MAX_SIZES)
+				errx(1, "too many sizes");
+			if (sscanf(optarg, "%ux%u", &widths[nsizes], &heights[nsizes]) != 2 ||
+			    widths[nsizes] < 5 || heights[nsizes] < 5)
+				errx(1, "invalid size '%s'", optarg);
+			nsizes++;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	if (nsizes == 0) {
+		for (i = 0; i < 5; i++) {
+			widths[i] = 100 << i;
+			heights[i] = 30 << i;
+		}
+		nsizes = i;
+	}
+
+	for (i = 0; i < nsizes; i++)
+		bench_size(widths[i], heights[i], first_seed, seeds);
+
+	return (0);
+}
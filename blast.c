@@ -0,0 +1,168 @@
+#include <assert.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blast.h"
+#include "map.h"
+
+/*
+ * Area effects.  The footprint of a blast is everything within the radius
+ * that can be seen from its center, walls included; the footprints
+ * of any number of blasts get merged into a single mask, a byte per cell
+ * of the map, and then applied to the map in one go.  The edges of the map
+ * are never touched, so that nothing can get out.
+ *
+ * The footprints are all computed against the map as it was before
+ * any of them got applied.
+ */
+
+struct blast {
+	struct map	*b_map;
+	unsigned int	b_width;
+	unsigned int	b_height;
+	unsigned char	*b_mask;
+	unsigned int	b_x0;		/* bounding rectangle, inclusive */
+	unsigned int	b_y0;
+	unsigned int	b_x1;
+	unsigned int	b_y1;
+	struct map_fov	*b_fov;
+	unsigned int	b_fov_radius;
+};
+
+struct blast *
+blast_new(struct map *m)
+{
+	struct blast *b;
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		err(1, "calloc");
+
+	b->b_map = m;
+	b->b_width = map_get_width(m);
+	b->b_height = map_get_height(m);
+	b->b_mask = calloc((size_t)b->b_width * b->b_height, 1);
+	if (b->b_mask == NULL)
+		err(1, "calloc");
+	b->b_x0 = b->b_width;
+	b->b_y0 = b->b_height;
+
+	return (b);
+}
+
+void
+blast_delete(struct blast *b)
+{
+
+	if (b->b_fov != NULL)
+		map_fov_delete(b->b_fov);
+	free(b->b_mask);
+	free(b);
+}
+
+void
+blast_add(struct blast *b, unsigned int x, unsigned int y, unsigned int radius)
+{
+	unsigned int cx, cy, x0, y0, x1, y1;
+	unsigned char *row;
+
+	assert(x < b->b_width && y < b->b_height);
+
+	if (b->b_width < 3 || b->b_height < 3)
+		return;
+
+	if (b->b_fov == NULL || b->b_fov_radius != radius) {
+		if (b->b_fov != NULL)
+			map_fov_delete(b->b_fov);
+		b->b_fov = map_fov_new(radius);
+		b->b_fov_radius = radius;
+	}
+	map_fov_update(b->b_map, b->b_fov, x, y);
+
+	x0 = x > radius ? x - radius : 1;
+	y0 = y > radius ? y - radius : 1;
+	x1 = x + radius < b->b_width - 1 ? x + radius : b->b_width - 2;
+	y1 = y + radius < b->b_height - 1 ? y + radius : b->b_height - 2;
+	if (x0 > x1 || y0 > y1)
+		return;
+
+	for (cy = y0; cy <= y1; cy++) {
+		row = b->b_mask + (size_t)b->b_width * cy;
+		for (cx = x0; cx <= x1; cx++)
+			row[cx] |= map_fov_visible(b->b_fov, cx, cy);
+	}
+
+	/*
+	 * When empty, the rectangle is inside out, with the far corner at zero;
+	 * the edges being excluded, x1 and y1 are always greater than that.
+	 */
+	if (x0 < b->b_x0)
+		b->b_x0 = x0;
+	if (y0 < b->b_y0)
+		b->b_y0 = y0;
+	if (x1 > b->b_x1)
+		b->b_x1 = x1;
+	if (y1 > b->b_y1)
+		b->b_y1 = y1;
+}
+
+bool
+blast_contains(struct blast *b, unsigned int x, unsigned int y)
+{
+
+	if (x >= b->b_width || y >= b->b_height)
+		return (false);
+
+	return (b->b_mask[(size_t)b->b_width * y + x] != 0);
+}
+
+/*
+ * Returns false if the blast is empty; otherwise sets the rectangle
+ * that covers all of it.
+ */
+bool
+blast_get_rect(struct blast *b, unsigned int *x, unsigned int *y, unsigned int *w, unsigned int *h)
+{
+
+	if (b->b_x0 > b->b_x1 || b->b_y0 > b->b_y1)
+		return (false);
+
+	*x = b->b_x0;
+	*y = b->b_y0;
+	*w = b->b_x1 - b->b_x0 + 1;
+	*h = b->b_y1 - b->b_y0 + 1;
+	return (true);
+}
+
+/*
+ * Turn every cell within the blast into "c"; returns how many changed.
+ */
+unsigned int
+blast_apply(struct blast *b, char c)
+{
+	unsigned int x, y, w, h;
+
+	if (!blast_get_rect(b, &x, &y, &w, &h))
+		return (0);
+
+	return (map_set_masked(b->b_map, x, y, w, h,
+	    b->b_mask + (size_t)b->b_width * y + x, b->b_width, c));
+}
+
+void
+blast_clear(struct blast *b)
+{
+	unsigned int x, y, w, h, cy;
+
+	if (!blast_get_rect(b, &x, &y, &w, &h))
+		return;
+
+	for (cy = y; cy < y + h; cy++)
+		memset(b->b_mask + (size_t)b->b_width * cy + x, 0, w);
+	b->b_x0 = b->b_width;
+	b->b_y0 = b->b_height;
+	b->b_x1 = 0;
+	b->b_y1 = 0;
+}
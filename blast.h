@@ -0,0 +1,17 @@
+#ifndef BLAST_H
+#define	BLAST_H
+
+#include <stdbool.h>
+
+struct map;
+struct blast;
+
+struct blast	*blast_new(struct map *m);
+void		blast_delete(struct blast *b);
+void		blast_add(struct blast *b, unsigned int x, unsigned int y, unsigned int radius);
+bool		blast_contains(struct blast *b, unsigned int x, unsigned int y);
+bool		blast_get_rect(struct blast *b, unsigned int *x, unsigned int *y, unsigned int *w, unsigned int *h);
+unsigned int	blast_apply(struct blast *b, char c);
+void		blast_clear(struct blast *b);
+
+#endif /* !BLAST_H */
@@ -0,0 +1,385 @@
+#include <assert.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "components.h"
+#include "slotmap.h"
+
+/*
+ * Per-actor state kept outside of the actors themselves, one component type
+ * at a time.  Every type has its values packed together in a dense array,
+ * with the matching actor IDs in another one, so that going through all
+ * the actors that have a component only touches contiguous memory.
+ * To find a given actor's value, there's a sparse array indexed with
+ * the slot map index of the actor ID, pointing into the dense ones.
+ *
+ * Removing a value moves the last one into its place; nothing else moves,
+ * and the dense arrays never shrink.  Types are registered by name; names
+ * are interned, so that looking them up is a single hash table probe.
+ */
+
+#define	COMPONENTS_NONE		0
+
+struct component_type {
+	char		*ct_name;
+	size_t		ct_size;
+	unsigned int	*ct_sparse;	/* dense index + 1, or COMPONENTS_NONE */
+	unsigned int	ct_sparse_len;
+	unsigned int	*ct_ids;
+	unsigned char	*ct_values;
+	unsigned int	ct_len;
+	unsigned int	ct_alloc;
+};
+
+struct components {
+	struct component_type	*cs_types;
+	unsigned int		cs_ntypes;
+	unsigned int		cs_types_size;
+	int			*cs_names;	/* hash table of type numbers */
+	unsigned int		cs_names_size;
+};
+
+struct components *
+components_new(void)
+{
+	struct components *cs;
+
+	cs = calloc(1, sizeof(*cs));
+	if (cs == NULL)
+		err(1, "calloc");
+
+	return (cs);
+}
+
+void
+components_delete(struct components *cs)
+{
+	struct component_type *ct;
+	unsigned int i;
+
+	for (i = 0; i < cs->cs_ntypes; i++) {
+		ct = &cs->cs_types[i];
+		free(ct->ct_name);
+		free(ct->ct_sparse);
+		free(ct->ct_ids);
+		free(ct->ct_values);
+	}
+	free(cs->cs_types);
+	free(cs->cs_names);
+	free(cs);
+}
+
+static unsigned int
+components_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	for (; *name != '\0'; name++)
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+
+	return (hash);
+}
+
+/*
+ * Returns the hash table slot holding the name, or the empty one
+ * where it would go.
+ */
+static unsigned int
+components_probe(struct components *cs, const char *name)
+{
+	unsigned int i, mask;
+
+	mask = cs->cs_names_size - 1;
+	for (i = components_hash(name) & mask; cs->cs_names[i] >= 0; i = (i + 1) & mask) {
+		if (strcmp(cs->cs_types[cs->cs_names[i]].ct_name, name) == 0)
+			break;
+	}
+
+	return (i);
+}
+
+static void
+components_rehash(struct components *cs)
+{
+	unsigned int i;
+
+	free(cs->cs_names);
+	cs->cs_names_size = cs->cs_names_size > 0 ? cs->cs_names_size * 2 : 64;
+	cs->cs_names = malloc(cs->cs_names_size * sizeof(*cs->cs_names));
+	if (cs->cs_names == NULL)
+		err(1, "malloc");
+	for (i = 0; i < cs->cs_names_size; i++)
+		cs->cs_names[i] = -1;
+
+	for (i = 0; i < cs->cs_ntypes; i++)
+		cs->cs_names[components_probe(cs, cs->cs_types[i].ct_name)] = i;
+}
+
+int
+components_lookup(struct components *cs, const char *name)
+{
+
+	if (cs->cs_ntypes == 0)
+		return (-1);
+
+	return (cs->cs_names[components_probe(cs, name)]);
+}
+
+/*
+ * Returns the type number for the name, registering it if it's new,
+ * or -1 if it's already registered with a different size.
+ */
+int
+components_register(struct components *cs, const char *name, size_t size)
+{
+	struct component_type *ct;
+	int type;
+
+	assert(size > 0);
+
+	type = components_lookup(cs, name);
+	if (type >= 0)
+		return (cs->cs_types[type].ct_size == size ? type : -1);
+
+	if (cs->cs_ntypes == cs->cs_types_size) {
+		cs->cs_types_size = cs->cs_types_size > 0 ? cs->cs_types_size * 2 : 16;
+		cs->cs_types = realloc(cs->cs_types, cs->cs_types_size * sizeof(*cs->cs_types));
+		if (cs->cs_types == NULL)
+			err(1, "realloc");
+	}
+
+	type = cs->cs_ntypes++;
+	ct = &cs->cs_types[type];
+	memset(ct, 0, sizeof(*ct));
+	ct->ct_name = strdup(name);
+	if (ct->ct_name == NULL)
+		err(1, "strdup");
+	ct->ct_size = size;
+
+	/*
+	 * Keep the hash table at most half full.
+	 */
+	if (cs->cs_ntypes * 2 > cs->cs_names_size)
+		components_rehash(cs);
+	else
+		cs->cs_names[components_probe(cs, name)] = type;
+
+	return (type);
+}
+
+const char *
+components_name(struct components *cs, unsigned int type)
+{
+
+	assert(type < cs->cs_ntypes);
+	return (cs->cs_types[type].ct_name);
+}
+
+unsigned int
+components_ntypes(struct components *cs)
+{
+
+	return (cs->cs_ntypes);
+}
+
+/*
+ * Returns the dense index of the actor's value, or -1 if it has none.
+ */
+static int
+component_find(struct component_type *ct, unsigned int id)
+{
+	unsigned int index, dense;
+
+	index = slotmap_index(id);
+	if (index >= ct->ct_sparse_len || ct->ct_sparse[index] == COMPONENTS_NONE)
+		return (-1);
+
+	/*
+	 * The slot might have been reused by another actor since.
+	 */
+	dense = ct->ct_sparse[index] - 1;
+	if (ct->ct_ids[dense] != id)
+		return (-1);
+
+	return (dense);
+}
+
+/*
+ * Returns a pointer to the actor's value, or NULL if it doesn't have one.
+ * Valid until the next components_set() or components_remove() for the type.
+ */
+void *
+components_get(struct components *cs, unsigned int type, unsigned int id)
+{
+	struct component_type *ct;
+	int dense;
+
+	assert(type < cs->cs_ntypes);
+	ct = &cs->cs_types[type];
+	dense = component_find(ct, id);
+	if (dense < 0)
+		return (NULL);
+
+	return (ct->ct_values + (size_t)dense * ct->ct_size);
+}
+
+/*
+ * Like components_get(), except that actors without a value get a new one,
+ * zero-filled.
+ */
+void *
+components_set(struct components *cs, unsigned int type, unsigned int id)
+{
+	struct component_type *ct;
+	unsigned int index, n;
+	int dense;
+
+	assert(type < cs->cs_ntypes);
+	ct = &cs->cs_types[type];
+	dense = component_find(ct, id);
+	if (dense >= 0)
+		return (ct->ct_values + (size_t)dense * ct->ct_size);
+
+	index = slotmap_index(id);
+	if (index >= ct->ct_sparse_len) {
+		n = ct->ct_sparse_len > 0 ? ct->ct_sparse_len : 64;
+		while (n <= index)
+			n *= 2;
+		ct->ct_sparse = realloc(ct->ct_sparse, n * sizeof(*ct->ct_sparse));
+		if (ct->ct_sparse == NULL)
+			err(1, "realloc");
+		memset(ct->ct_sparse + ct->ct_sparse_len, 0, (n - ct->ct_sparse_len) * sizeof(*ct->ct_sparse));
+		ct->ct_sparse_len = n;
+	}
+
+	if (ct->ct_len == ct->ct_alloc) {
+		ct->ct_alloc = ct->ct_alloc > 0 ? ct->ct_alloc * 2 : 64;
+		ct->ct_ids = realloc(ct->ct_ids, ct->ct_alloc * sizeof(*ct->ct_ids));
+		ct->ct_values = realloc(ct->ct_values, ct->ct_alloc * ct->ct_size);
+		if (ct->ct_ids == NULL || ct->ct_values == NULL)
+			err(1, "realloc");
+	}
+
+	dense = ct->ct_len++;
+	ct->ct_sparse[index] = dense + 1;
+	ct->ct_ids[dense] = id;
+	memset(ct->ct_values + (size_t)dense * ct->ct_size, 0, ct->ct_size);
+
+	return (ct->ct_values + (size_t)dense * ct->ct_size);
+}
+
+/*
+ * Returns false if the actor didn't have the component.
+ */
+bool
+components_remove(struct components *cs, unsigned int type, unsigned int id)
+{
+	struct component_type *ct;
+	unsigned int last;
+	int dense;
+
+	assert(type < cs->cs_ntypes);
+	ct = &cs->cs_types[type];
+	dense = component_find(ct, id);
+	if (dense < 0)
+		return (false);
+
+	ct->ct_sparse[slotmap_index(id)] = COMPONENTS_NONE;
+	last = --ct->ct_len;
+	if ((unsigned int)dense != last) {
+		ct->ct_ids[dense] = ct->ct_ids[last];
+		memcpy(ct->ct_values + (size_t)dense * ct->ct_size,
+		    ct->ct_values + (size_t)last * ct->ct_size, ct->ct_size);
+		ct->ct_sparse[slotmap_index(ct->ct_ids[dense])] = dense + 1;
+	}
+
+	return (true);
+}
+
+/*
+ * To be called when the actor goes away.
+ */
+void
+components_remove_all(struct components *cs, unsigned int id)
+{
+	unsigned int type;
+
+	for (type = 0; type < cs->cs_ntypes; type++)
+		components_remove(cs, type, id);
+}
+
+unsigned int
+components_count(struct components *cs, unsigned int type)
+{
+
+	assert(type < cs->cs_ntypes);
+	return (cs->cs_types[type].ct_len);
+}
+
+/*
+ * The dense arrays, components_count() elements long, in the same order.
+ */
+const unsigned int *
+components_ids(struct components *cs, unsigned int type)
+{
+
+	assert(type < cs->cs_ntypes);
+	return (cs->cs_types[type].ct_ids);
+}
+
+void *
+components_values(struct components *cs, unsigned int type)
+{
+
+	assert(type < cs->cs_ntypes);
+	return (cs->cs_types[type].ct_values);
+}
+
+/*
+ * Call "cb" for every actor that has both components, with pointers
+ * to both values; "a" and "b" may be the same, to go through everyone
+ * with just the one.  Walks the dense arrays of the smaller type, looking
+ * the other one up.  The callback must not add or remove components
+ * of either type.  Returns the number of actors.
+ */
+unsigned int
+components_join(struct components *cs, unsigned int a, unsigned int b,
+    void (*cb)(unsigned int id, void *va, void *vb, void *arg), void *arg)
+{
+	struct component_type *cta, *ctb, *ct, *other;
+	unsigned int i, n = 0;
+	unsigned char *v, *ov;
+	int dense;
+
+	assert(a < cs->cs_ntypes && b < cs->cs_ntypes);
+	cta = &cs->cs_types[a];
+	ctb = &cs->cs_types[b];
+	if (cta->ct_len <= ctb->ct_len) {
+		ct = cta;
+		other = ctb;
+	} else {
+		ct = ctb;
+		other = cta;
+	}
+
+	for (i = 0; i < ct->ct_len; i++) {
+		v = ct->ct_values + (size_t)i * ct->ct_size;
+		if (other == ct) {
+			ov = v;
+		} else {
+			dense = component_find(other, ct->ct_ids[i]);
+			if (dense < 0)
+				continue;
+			ov = other->ct_values + (size_t)dense * other->ct_size;
+		}
+		if (ct == cta)
+			cb(ct->ct_ids[i], v, ov, arg);
+		else
+			cb(ct->ct_ids[i], ov, v, arg);
+		n++;
+	}
+
+	return (n);
+}
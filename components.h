@@ -0,0 +1,25 @@
+#ifndef COMPONENTS_H
+#define	COMPONENTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct components;
+
+struct components	*components_new(void);
+void			components_delete(struct components *cs);
+int			components_register(struct components *cs, const char *name, size_t size);
+int			components_lookup(struct components *cs, const char *name);
+const char		*components_name(struct components *cs, unsigned int type);
+unsigned int		components_ntypes(struct components *cs);
+void			*components_get(struct components *cs, unsigned int type, unsigned int id);
+void			*components_set(struct components *cs, unsigned int type, unsigned int id);
+bool			components_remove(struct components *cs, unsigned int type, unsigned int id);
+void			components_remove_all(struct components *cs, unsigned int id);
+unsigned int		components_count(struct components *cs, unsigned int type);
+const unsigned int	*components_ids(struct components *cs, unsigned int type);
+void			*components_values(struct components *cs, unsigned int type);
+unsigned int		components_join(struct components *cs, unsigned int a, unsigned int b,
+			    void (*cb)(unsigned int id, void *va, void *vb, void *arg), void *arg);
+
+#endif /* !COMPONENTS_H */
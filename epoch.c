@@ -0,0 +1,164 @@
+#include <sys/queue.h>
+#include <err.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+/*
+ * Epoch-based reclamation, for data shared between a single writer
+ * and any number of reader threads, without locks.  The writer replaces
+ * what it publishes, and retires the old version instead of freeing it;
+ * readers access published data only between epoch_enter() and epoch_exit(),
+ * which just store the current epoch into the reader's slot, and clear it.
+ *
+ * Every epoch_reclaim() advances the epoch.  Anything retired in an epoch
+ * older than the one of every reader still inside gets freed: a reader
+ * that entered after that couldn't have seen it anymore.  Readers never
+ * wait; the writer never waits either, it just keeps things around longer.
+ *
+ * Reader threads register to get a slot, one out of EPOCH_SLOTS.  Retiring
+ * and reclaiming is for the writer only.
+ */
+
+#define	EPOCH_SLOTS	64
+
+#define	EPOCH_QUIESCENT	0
+
+struct epoch_retired {
+	STAILQ_ENTRY(epoch_retired)	er_next;
+	uint64_t			er_epoch;
+	void				(*er_fn)(void *arg);
+	void				*er_arg;
+};
+
+struct epoch {
+	_Atomic uint64_t		e_epoch;
+	_Atomic uint64_t		e_slots[EPOCH_SLOTS];
+	atomic_bool			e_used[EPOCH_SLOTS];
+	STAILQ_HEAD(, epoch_retired)	e_retired;
+};
+
+struct epoch *
+epoch_new(void)
+{
+	struct epoch *e;
+	unsigned int i;
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
+		err(1, "calloc");
+
+	atomic_init(&e->e_epoch, 1);
+	for (i = 0; i < EPOCH_SLOTS; i++) {
+		atomic_init(&e->e_slots[i], EPOCH_QUIESCENT);
+		atomic_init(&e->e_used[i], false);
+	}
+	STAILQ_INIT(&e->e_retired);
+
+	return (e);
+}
+
+/*
+ * There must be no readers left.  Whatever was retired gets freed.
+ */
+void
+epoch_delete(struct epoch *e)
+{
+	struct epoch_retired *er;
+
+	while ((er = STAILQ_FIRST(&e->e_retired)) != NULL) {
+		STAILQ_REMOVE_HEAD(&e->e_retired, er_next);
+		er->er_fn(er->er_arg);
+		free(er);
+	}
+	free(e);
+}
+
+/*
+ * Returns the slot for the calling reader thread, or -1 if there are
+ * already EPOCH_SLOTS of them.
+ */
+int
+epoch_register(struct epoch *e)
+{
+	unsigned int i;
+	bool expected;
+
+	for (i = 0; i < EPOCH_SLOTS; i++) {
+		expected = false;
+		if (atomic_compare_exchange_strong(&e->e_used[i], &expected, true))
+			return (i);
+	}
+
+	return (-1);
+}
+
+void
+epoch_unregister(struct epoch *e, int slot)
+{
+
+	atomic_store(&e->e_slots[slot], EPOCH_QUIESCENT);
+	atomic_store(&e->e_used[slot], false);
+}
+
+void
+epoch_enter(struct epoch *e, int slot)
+{
+
+	atomic_store(&e->e_slots[slot], atomic_load(&e->e_epoch));
+}
+
+void
+epoch_exit(struct epoch *e, int slot)
+{
+
+	atomic_store(&e->e_slots[slot], EPOCH_QUIESCENT);
+}
+
+/*
+ * Have "fn" called with "arg" once no reader can be using it anymore.
+ * The writer must have unpublished it already.
+ */
+void
+epoch_retire(struct epoch *e, void (*fn)(void *arg), void *arg)
+{
+	struct epoch_retired *er;
+
+	er = calloc(1, sizeof(*er));
+	if (er == NULL)
+		err(1, "calloc");
+	er->er_epoch = atomic_load(&e->e_epoch);
+	er->er_fn = fn;
+	er->er_arg = arg;
+	STAILQ_INSERT_TAIL(&e->e_retired, er, er_next);
+}
+
+void
+epoch_reclaim(struct epoch *e)
+{
+	struct epoch_retired *er;
+	uint64_t oldest, epoch;
+	unsigned int i;
+
+	if (STAILQ_EMPTY(&e->e_retired))
+		return;
+
+	oldest = atomic_fetch_add(&e->e_epoch, 1) + 1;
+	for (i = 0; i < EPOCH_SLOTS; i++) {
+		epoch = atomic_load(&e->e_slots[i]);
+		if (epoch != EPOCH_QUIESCENT && epoch < oldest)
+			oldest = epoch;
+	}
+
+	/*
+	 * They are in the order they were retired in, so the epochs only go up.
+	 */
+	while ((er = STAILQ_FIRST(&e->e_retired)) != NULL && er->er_epoch < oldest) {
+		STAILQ_REMOVE_HEAD(&e->e_retired, er_next);
+		er->er_fn(er->er_arg);
+		free(er);
+	}
+}
@@ -0,0 +1,15 @@
+#ifndef EPOCH_H
+#define	EPOCH_H
+
+struct epoch;
+
+struct epoch	*epoch_new(void);
+void		epoch_delete(struct epoch *e);
+int		epoch_register(struct epoch *e);
+void		epoch_unregister(struct epoch *e, int slot);
+void		epoch_enter(struct epoch *e, int slot);
+void		epoch_exit(struct epoch *e, int slot);
+void		epoch_retire(struct epoch *e, void (*fn)(void *arg), void *arg);
+void		epoch_reclaim(struct epoch *e);
+
+#endif /* !EPOCH_H */
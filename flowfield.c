@@ -0,0 +1,478 @@
+#include <assert.h>
+#include <err.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flowfield.h"
+#include "map.h"
+
+/*
+ * A flow field holds, for every floor cell, the number of steps to the nearest
+ * of its sources.  An actor following it only needs to look at the four
+ * neighbours of the cell it's in, no matter how many other actors use
+ * the same field.
+ *
+ * The field gets repaired rather than recomputed when sources move, or when
+ * the map changes.  Adding sources or floor can only make distances shorter,
+ * which is just a breadth-first search from the new cells.  Removing them
+ * is done in two passes: first, cells whose distance depended on what's
+ * gone get invalidated, going outwards in the order of their old distance;
+ * then they get their distances back from the valid cells around them.
+ * Both passes only touch the cells affected.
+ */
+
+#define	FF_SOURCE	0x01
+#define	FF_NEW		0x02
+#define	FF_INVALID	0x04
+
+static const int ff_dx[] = { 0, 0, -1, 1 };
+static const int ff_dy[] = { -1, 1, 0, 0 };
+
+struct ff_entry {
+	unsigned int	fe_dist;
+	unsigned int	fe_cell;
+};
+
+struct ff_list {
+	struct ff_entry	*fl_entries;
+	unsigned int	fl_len;
+	unsigned int	fl_head;
+	unsigned int	fl_size;
+};
+
+struct flowfield {
+	struct map	*ff_map;
+	unsigned int	ff_width;
+	unsigned int	ff_height;
+	unsigned long	ff_version;
+	bool		ff_computed;
+	unsigned int	*ff_dist;
+	unsigned char	*ff_floor;
+	unsigned char	*ff_flags;
+	unsigned int	*ff_sources;
+	unsigned int	ff_nsources;
+	unsigned int	ff_sources_size;
+	struct ff_list	ff_removed;	/* cells that stopped being sources */
+	struct ff_list	ff_added;	/* cells that became sources */
+	struct ff_list	ff_walled;	/* floor that turned into walls */
+	struct ff_list	ff_opened;	/* walls that turned into floor */
+	struct ff_list	ff_invalid;
+	struct ff_list	ff_seeds;
+	struct ff_list	ff_queue;
+};
+
+static void
+ff_list_add(struct ff_list *fl, unsigned int dist, unsigned int cell)
+{
+
+	if (fl->fl_len == fl->fl_size) {
+		fl->fl_size = fl->fl_size > 0 ? fl->fl_size * 2 : 256;
+		fl->fl_entries = realloc(fl->fl_entries, fl->fl_size * sizeof(*fl->fl_entries));
+		if (fl->fl_entries == NULL)
+			err(1, "realloc");
+	}
+
+	fl->fl_entries[fl->fl_len].fe_dist = dist;
+	fl->fl_entries[fl->fl_len].fe_cell = cell;
+	fl->fl_len++;
+}
+
+static void
+ff_list_clear(struct ff_list *fl)
+{
+
+	fl->fl_len = fl->fl_head = 0;
+}
+
+static int
+ff_entry_compare(const void *a, const void *b)
+{
+	const struct ff_entry *ea = a, *eb = b;
+
+	if (ea->fe_dist != eb->fe_dist)
+		return (ea->fe_dist < eb->fe_dist ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Returns the next entry in the order of distance, from either the sorted
+ * seeds or the queue; the queue is in that order by construction.
+ */
+static bool
+ff_next(struct flowfield *ff, struct ff_entry *fe)
+{
+	struct ff_list *seeds, *queue;
+
+	seeds = &ff->ff_seeds;
+	queue = &ff->ff_queue;
+
+	if (seeds->fl_head == seeds->fl_len && queue->fl_head == queue->fl_len)
+		return (false);
+
+	if (queue->fl_head == queue->fl_len || (seeds->fl_head < seeds->fl_len &&
+	    seeds->fl_entries[seeds->fl_head].fe_dist <= queue->fl_entries[queue->fl_head].fe_dist))
+		*fe = seeds->fl_entries[seeds->fl_head++];
+	else
+		*fe = queue->fl_entries[queue->fl_head++];
+
+	return (true);
+}
+
+struct flowfield *
+flowfield_new(struct map *m)
+{
+	struct flowfield *ff;
+	unsigned int cells;
+
+	ff = calloc(1, sizeof(*ff));
+	if (ff == NULL)
+		err(1, "calloc");
+
+	ff->ff_map = m;
+	ff->ff_width = map_get_width(m);
+	ff->ff_height = map_get_height(m);
+	cells = ff->ff_width * ff->ff_height;
+	ff->ff_dist = malloc(cells * sizeof(*ff->ff_dist));
+	ff->ff_floor = malloc(cells);
+	ff->ff_flags = calloc(cells, 1);
+	if (ff->ff_dist == NULL || ff->ff_floor == NULL || ff->ff_flags == NULL)
+		err(1, "malloc");
+
+	return (ff);
+}
+
+void
+flowfield_delete(struct flowfield *ff)
+{
+
+	free(ff->ff_removed.fl_entries);
+	free(ff->ff_added.fl_entries);
+	free(ff->ff_walled.fl_entries);
+	free(ff->ff_opened.fl_entries);
+	free(ff->ff_invalid.fl_entries);
+	free(ff->ff_seeds.fl_entries);
+	free(ff->ff_queue.fl_entries);
+	free(ff->ff_sources);
+	free(ff->ff_dist);
+	free(ff->ff_floor);
+	free(ff->ff_flags);
+	free(ff);
+}
+
+/*
+ * Replace the sources with the given ones; the distances get updated
+ * on the next flowfield_update().
+ */
+void
+flowfield_set_sources(struct flowfield *ff, const unsigned int *xs, const unsigned int *ys, unsigned int n)
+{
+	unsigned int i, cell, nsources = 0;
+
+	for (i = 0; i < n; i++) {
+		if (xs[i] >= ff->ff_width || ys[i] >= ff->ff_height)
+			continue;
+		ff->ff_flags[ys[i] * ff->ff_width + xs[i]] |= FF_NEW;
+	}
+
+	for (i = 0; i < ff->ff_nsources; i++) {
+		cell = ff->ff_sources[i];
+		if (ff->ff_flags[cell] & FF_NEW)
+			continue;
+		ff->ff_flags[cell] &= ~FF_SOURCE;
+		ff_list_add(&ff->ff_removed, ff->ff_dist[cell], cell);
+	}
+
+	if (n > ff->ff_sources_size) {
+		ff->ff_sources_size = n;
+		ff->ff_sources = realloc(ff->ff_sources, n * sizeof(*ff->ff_sources));
+		if (ff->ff_sources == NULL)
+			err(1, "realloc");
+	}
+
+	for (i = 0; i < n; i++) {
+		if (xs[i] >= ff->ff_width || ys[i] >= ff->ff_height)
+			continue;
+		cell = ys[i] * ff->ff_width + xs[i];
+		/*
+		 * Already seen, if it's listed twice.
+		 */
+		if ((ff->ff_flags[cell] & FF_NEW) == 0)
+			continue;
+		ff->ff_flags[cell] &= ~FF_NEW;
+		if ((ff->ff_flags[cell] & FF_SOURCE) == 0) {
+			ff->ff_flags[cell] |= FF_SOURCE;
+			ff_list_add(&ff->ff_added, 0, cell);
+		}
+		ff->ff_sources[nsources++] = cell;
+	}
+	ff->ff_nsources = nsources;
+}
+
+/*
+ * Compare the cached floor against the rows that changed since last time.
+ */
+static void
+flowfield_check_map(struct flowfield *ff)
+{
+	unsigned int x, y, cell;
+	unsigned char floor;
+
+	if (map_get_version(ff->ff_map) == ff->ff_version)
+		return;
+
+	for (y = 0; y < ff->ff_height; y++) {
+		if (map_get_row_version(ff->ff_map, y) <= ff->ff_version)
+			continue;
+		for (x = 0; x < ff->ff_width; x++) {
+			cell = y * ff->ff_width + x;
+			floor = map_get(ff->ff_map, x, y) == ' ';
+			if (floor == ff->ff_floor[cell])
+				continue;
+			ff->ff_floor[cell] = floor;
+			if (floor)
+				ff_list_add(&ff->ff_opened, 0, cell);
+			else
+				ff_list_add(&ff->ff_walled, ff->ff_dist[cell], cell);
+		}
+	}
+
+	ff->ff_version = map_get_version(ff->ff_map);
+}
+
+static bool
+flowfield_neighbour(struct flowfield *ff, unsigned int cell, unsigned int d, unsigned int *ncell)
+{
+	unsigned int x, y;
+
+	x = cell % ff->ff_width + ff_dx[d];
+	y = cell / ff->ff_width + ff_dy[d];
+	if (x >= ff->ff_width || y >= ff->ff_height)
+		return (false);
+
+	*ncell = y * ff->ff_width + x;
+	return (ff->ff_floor[*ncell]);
+}
+
+static void
+flowfield_invalidate(struct flowfield *ff, unsigned int cell)
+{
+
+	ff->ff_flags[cell] |= FF_INVALID;
+	ff_list_add(&ff->ff_invalid, ff->ff_dist[cell], cell);
+}
+
+/*
+ * First pass: find every cell that no longer has a neighbour one step closer
+ * to a source.
+ */
+static void
+flowfield_invalidate_affected(struct flowfield *ff)
+{
+	struct ff_entry fe;
+	unsigned int i, d, d2, ncell, n2cell;
+	bool supported;
+
+	ff_list_clear(&ff->ff_seeds);
+	ff_list_clear(&ff->ff_queue);
+
+	for (i = 0; i < ff->ff_removed.fl_len; i++) {
+		fe = ff->ff_removed.fl_entries[i];
+		if (ff->ff_dist[fe.fe_cell] == FLOWFIELD_UNREACHABLE)
+			continue;
+		flowfield_invalidate(ff, fe.fe_cell);
+		ff_list_add(&ff->ff_seeds, fe.fe_dist, fe.fe_cell);
+	}
+	for (i = 0; i < ff->ff_walled.fl_len; i++) {
+		fe = ff->ff_walled.fl_entries[i];
+		if (ff->ff_dist[fe.fe_cell] == FLOWFIELD_UNREACHABLE)
+			continue;
+		flowfield_invalidate(ff, fe.fe_cell);
+		ff_list_add(&ff->ff_seeds, fe.fe_dist, fe.fe_cell);
+	}
+	qsort(ff->ff_seeds.fl_entries, ff->ff_seeds.fl_len, sizeof(struct ff_entry), ff_entry_compare);
+
+	while (ff_next(ff, &fe)) {
+		for (d = 0; d < 4; d++) {
+			if (!flowfield_neighbour(ff, fe.fe_cell, d, &ncell))
+				continue;
+			if (ff->ff_flags[ncell] & (FF_INVALID | FF_SOURCE))
+				continue;
+			if (ff->ff_dist[ncell] != fe.fe_dist + 1)
+				continue;
+
+			supported = false;
+			for (d2 = 0; d2 < 4; d2++) {
+				if (!flowfield_neighbour(ff, ncell, d2, &n2cell))
+					continue;
+				if (ff->ff_flags[n2cell] & FF_INVALID)
+					continue;
+				if (ff->ff_dist[n2cell] == fe.fe_dist) {
+					supported = true;
+					break;
+				}
+			}
+			if (supported)
+				continue;
+
+			flowfield_invalidate(ff, ncell);
+			ff_list_add(&ff->ff_queue, fe.fe_dist + 1, ncell);
+		}
+	}
+}
+
+static void
+flowfield_seed(struct flowfield *ff, unsigned int cell)
+{
+	unsigned int d, ncell, best = FLOWFIELD_UNREACHABLE;
+
+	if (!ff->ff_floor[cell])
+		return;
+
+	if (ff->ff_flags[cell] & FF_SOURCE) {
+		best = 0;
+	} else {
+		for (d = 0; d < 4; d++) {
+			if (!flowfield_neighbour(ff, cell, d, &ncell))
+				continue;
+			if (ff->ff_dist[ncell] != FLOWFIELD_UNREACHABLE && ff->ff_dist[ncell] + 1 < best)
+				best = ff->ff_dist[ncell] + 1;
+		}
+	}
+
+	if (best == FLOWFIELD_UNREACHABLE || best >= ff->ff_dist[cell])
+		return;
+
+	ff->ff_dist[cell] = best;
+	ff_list_add(&ff->ff_seeds, best, cell);
+}
+
+/*
+ * Second pass: give the invalidated cells their distances back, and spread
+ * the shorter distances from the new sources and floor.
+ */
+static void
+flowfield_propagate(struct flowfield *ff)
+{
+	struct ff_entry fe;
+	unsigned int i, d, ncell;
+
+	ff_list_clear(&ff->ff_seeds);
+	ff_list_clear(&ff->ff_queue);
+
+	for (i = 0; i < ff->ff_invalid.fl_len; i++) {
+		ff->ff_dist[ff->ff_invalid.fl_entries[i].fe_cell] = FLOWFIELD_UNREACHABLE;
+		ff->ff_flags[ff->ff_invalid.fl_entries[i].fe_cell] &= ~FF_INVALID;
+	}
+	for (i = 0; i < ff->ff_opened.fl_len; i++)
+		ff->ff_dist[ff->ff_opened.fl_entries[i].fe_cell] = FLOWFIELD_UNREACHABLE;
+
+	for (i = 0; i < ff->ff_invalid.fl_len; i++)
+		flowfield_seed(ff, ff->ff_invalid.fl_entries[i].fe_cell);
+	for (i = 0; i < ff->ff_opened.fl_len; i++)
+		flowfield_seed(ff, ff->ff_opened.fl_entries[i].fe_cell);
+	for (i = 0; i < ff->ff_added.fl_len; i++)
+		flowfield_seed(ff, ff->ff_added.fl_entries[i].fe_cell);
+	qsort(ff->ff_seeds.fl_entries, ff->ff_seeds.fl_len, sizeof(struct ff_entry), ff_entry_compare);
+
+	while (ff_next(ff, &fe)) {
+		if (ff->ff_dist[fe.fe_cell] != fe.fe_dist)
+			continue;
+		for (d = 0; d < 4; d++) {
+			if (!flowfield_neighbour(ff, fe.fe_cell, d, &ncell))
+				continue;
+			if (ff->ff_dist[ncell] <= fe.fe_dist + 1)
+				continue;
+			ff->ff_dist[ncell] = fe.fe_dist + 1;
+			ff_list_add(&ff->ff_queue, fe.fe_dist + 1, ncell);
+		}
+	}
+}
+
+static void
+flowfield_compute(struct flowfield *ff)
+{
+	unsigned int x, y, i;
+
+	for (y = 0; y < ff->ff_height; y++) {
+		for (x = 0; x < ff->ff_width; x++) {
+			ff->ff_floor[y * ff->ff_width + x] = map_get(ff->ff_map, x, y) == ' ';
+			ff->ff_dist[y * ff->ff_width + x] = FLOWFIELD_UNREACHABLE;
+		}
+	}
+	ff->ff_version = map_get_version(ff->ff_map);
+	ff->ff_computed = true;
+
+	ff_list_clear(&ff->ff_added);
+	for (i = 0; i < ff->ff_nsources; i++)
+		ff_list_add(&ff->ff_added, 0, ff->ff_sources[i]);
+	flowfield_propagate(ff);
+}
+
+/*
+ * Bring the distances up to date with the sources and the map.
+ */
+void
+flowfield_update(struct flowfield *ff)
+{
+
+	if (!ff->ff_computed) {
+		flowfield_compute(ff);
+	} else {
+		flowfield_check_map(ff);
+		if (ff->ff_removed.fl_len > 0 || ff->ff_walled.fl_len > 0)
+			flowfield_invalidate_affected(ff);
+		flowfield_propagate(ff);
+	}
+
+	ff_list_clear(&ff->ff_removed);
+	ff_list_clear(&ff->ff_added);
+	ff_list_clear(&ff->ff_walled);
+	ff_list_clear(&ff->ff_opened);
+	ff_list_clear(&ff->ff_invalid);
+}
+
+unsigned int
+flowfield_get_distance(struct flowfield *ff, unsigned int x, unsigned int y)
+{
+
+	if (x >= ff->ff_width || y >= ff->ff_height)
+		return (FLOWFIELD_UNREACHABLE);
+
+	return (ff->ff_dist[y * ff->ff_width + x]);
+}
+
+/*
+ * Returns the direction, as in PATH_NORTH and friends, that leads closer
+ * to the nearest source, or further away from it; -1 if there is nowhere
+ * better to go.  Running away greedily can end up in a dead end.
+ */
+int
+flowfield_next_step(struct flowfield *ff, unsigned int x, unsigned int y, bool away)
+{
+	unsigned int cell, ncell, d, dist, best;
+	int step = -1;
+
+	if (x >= ff->ff_width || y >= ff->ff_height)
+		return (-1);
+
+	cell = y * ff->ff_width + x;
+	best = ff->ff_dist[cell];
+	if (best == FLOWFIELD_UNREACHABLE)
+		return (-1);
+
+	for (d = 0; d < 4; d++) {
+		if (!flowfield_neighbour(ff, cell, d, &ncell))
+			continue;
+		dist = ff->ff_dist[ncell];
+		if (dist == FLOWFIELD_UNREACHABLE)
+			continue;
+		if (away ? dist > best : dist < best) {
+			best = dist;
+			step = d;
+		}
+	}
+
+	return (step);
+}
@@ -0,0 +1,18 @@
+#ifndef FLOWFIELD_H
+#define	FLOWFIELD_H
+
+#include <stdbool.h>
+
+struct map;
+struct flowfield;
+
+struct flowfield	*flowfield_new(struct map *m);
+void			flowfield_delete(struct flowfield *ff);
+void			flowfield_set_sources(struct flowfield *ff, const unsigned int *xs, const unsigned int *ys, unsigned int n);
+void			flowfield_update(struct flowfield *ff);
+unsigned int		flowfield_get_distance(struct flowfield *ff, unsigned int x, unsigned int y);
+int			flowfield_next_step(struct flowfield *ff, unsigned int x, unsigned int y, bool away);
+
+#define	FLOWFIELD_UNREACHABLE	((unsigned int)-1)
+
+#endif /* !FLOWFIELD_H */
@@ -5,18 +5,33 @@
 #include <assert.h>
 #include <curses.h>
 #include <err.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "window.h"
 #include "remote.h"
+#include "rle.h"
 
 #define	FAWORKEN_PORT	1981
 
+/*
+ * Running means walking until something's in the way; the hub won't take
+ * more than that many steps at once anyway.
+ */
+#define	RUN_STEPS	1000
+
 struct remote		*hub;
+const char		*hub_ip;
 struct window		*map_window;
+struct window		*character_window;
 unsigned int		actor_id;
+unsigned long		map_version;
+int			redirect_port;
+char			redirect_token[17];
+bool			map_moved;
+bool			map_catching_up;
 
 //static unsigned int console_height = 10;
 static unsigned int console_height = 0;
@@ -30,6 +45,8 @@ struct actor {
 
 static TAILQ_HEAD(, actor)	actors;
 
+static void	character_at(unsigned int x, unsigned int y);
+
 static int
 server_callback(struct remote *r, char *str, char **uptr)
 {
@@ -47,7 +64,7 @@ server_callback(struct remote *r, char *str, char **uptr)
 }
 
 static void
-server_map_get_size(unsigned int *width, unsigned int *height)
+server_map_get_size(unsigned int *width, unsigned int *height, unsigned long *version)
 {
 	char *reply = NULL;
 	int assigned;
@@ -57,12 +74,35 @@ server_map_get_size(unsigned int *width, unsigned int *height)
 	while (reply == NULL)
 		remote_process_sync(hub);
 
-	assigned = sscanf(reply, "ok, %d %d", width, height);
-	if (assigned != 2)
+	assigned = sscanf(reply, "ok, %d %d %lu", width, height, version);
+	if (assigned != 3)
 		errx(1, "invalid reply to map-get-size: %s", reply);
 	free(reply);
 }
 
+/*
+ * The changed rows arrive as map-delta lines, handled by map_delta_callback(),
+ * before the reply.
+ */
+static void
+server_map_changes_since(unsigned long version)
+{
+	char *reply = NULL;
+	int assigned;
+
+	remote_expect(hub, "ok", server_callback, &reply);
+	remote_send(hub, "map-changes-since %lu\r\n", version);
+	while (reply == NULL)
+		remote_process_sync(hub);
+
+	assigned = sscanf(reply, "ok, %lu", &version);
+	if (assigned != 1)
+		errx(1, "invalid reply to map-changes-since: %s", reply);
+	if (version > map_version)
+		map_version = version;
+	free(reply);
+}
+
 static char *
 server_map_get_line(unsigned int y)
 {
@@ -97,6 +137,20 @@ server_move(const char *dir)
 	return (error);
 }
 
+static void
+server_walk(const char *dir, unsigned int steps)
+{
+	char *reply = NULL;
+
+	remote_expect(hub, "ok", server_callback, &reply);
+	remote_expect(hub, "sorry", server_callback, &reply);
+	remote_send(hub, "actor-walk %d %s %d\r\n", actor_id, dir, steps);
+	while (reply == NULL)
+		remote_process_sync(hub);
+
+	free(reply);
+}
+
 static void
 server_actor_new(void)
 {
@@ -118,6 +172,26 @@ server_actor_new(void)
 	free(reply);
 }
 
+/*
+ * Watch without an actor of our own; the actors that are already there
+ * arrive as actor-at, like everything later.
+ */
+static void
+server_subscribe(void)
+{
+	char *reply = NULL;
+
+	remote_expect(hub, "ok", server_callback, &reply);
+	remote_expect(hub, "sorry", server_callback, &reply);
+	remote_send(hub, "subscribe\r\n");
+	while (reply == NULL)
+		remote_process_sync(hub);
+
+	if (strncmp(reply, "ok", strlen("ok")) != 0)
+		errx(1, "invalid reply to subscribe: %s", reply);
+	free(reply);
+}
+
 static void
 server_whereami(unsigned int *x, unsigned int *y)
 {
@@ -164,15 +238,14 @@ actor_new(unsigned int actor_id)
 	return (a);
 }
 
-#if 0
 static void
 actor_delete(struct actor *a)
 {
 
 	TAILQ_REMOVE(&actors, a, a_next);
+	window_delete(a->a_window);
 	free(a);
 }
-#endif
 
 static struct actor *
 actor_find(unsigned int actor_id)
@@ -189,13 +262,21 @@ actor_find(unsigned int actor_id)
 }
 
 static void
-actor_at(unsigned int actor_id, unsigned int x, unsigned int y, char ch)
+actor_at(unsigned int id, unsigned int x, unsigned int y, char ch)
 {
 	struct actor *a;
 
-	a = actor_find(actor_id);
+	/*
+	 * The hub tells us about our own actor when it's walking.
+	 */
+	if (id == actor_id) {
+		character_at(x, y);
+		return;
+	}
+
+	a = actor_find(id);
 	if (a == NULL) {
-		a = actor_new(actor_id);
+		a = actor_new(id);
 		a->a_window = window_new(map_window);
 		window_resize(a->a_window, 1, 1);
 	}
@@ -222,29 +303,192 @@ actor_at_callback(struct remote *r, char *str, char **uptr)
 	return (0);
 }
 
+static int
+actor_gone_callback(struct remote *r, char *str, char **uptr)
+{
+	struct actor *a;
+	unsigned int actor_id;
+	int assigned;
+
+	assigned = sscanf(str, "actor-gone %d", &actor_id);
+	if (assigned != 1)
+		errx(1, "invalid actor-gone: %s", str);
+
+	a = actor_find(actor_id);
+	if (a == NULL)
+		return (0);
+
+	actor_delete(a);
+	window_redraw(window_get_root(map_window));
+
+	return (0);
+}
+
+static int
+actor_stopped_callback(struct remote *r, char *str, char **uptr)
+{
+	unsigned int id, x, y;
+	int assigned;
+
+	assigned = sscanf(str, "actor-stopped %d %d %d", &id, &x, &y);
+	if (assigned != 3)
+		errx(1, "invalid actor-stopped: %s", str);
+
+	if (id == actor_id)
+		character_at(x, y);
+
+	return (0);
+}
+
+/*
+ * In tick mode, the hub sends all the updates at once:
+ * "frame TICK at ID X Y 'C' gone ID ...".
+ */
+static int
+frame_callback(struct remote *r, char *str, char **uptr)
+{
+	struct actor *a;
+	unsigned int actor_id, x, y;
+	unsigned long tick;
+	int assigned, off;
+	char ch;
+
+	assigned = sscanf(str, "frame %lu%n", &tick, &off);
+	if (assigned != 1)
+		errx(1, "invalid frame: %s", str);
+	str += off;
+
+	while (*str != '\0') {
+		off = 0;
+		assigned = sscanf(str, " at %u %u %u '%c'%n", &actor_id, &x, &y, &ch, &off);
+		if (assigned == 4 && off > 0) {
+			actor_at(actor_id, x, y, ch);
+			str += off;
+			continue;
+		}
+
+		off = 0;
+		assigned = sscanf(str, " gone %u%n", &actor_id, &off);
+		if (assigned == 1 && off > 0) {
+			a = actor_find(actor_id);
+			if (a != NULL)
+				actor_delete(a);
+			str += off;
+			continue;
+		}
+
+		errx(1, "invalid frame entry: %s", str);
+	}
+
+	window_redraw(window_get_root(map_window));
+
+	return (0);
+}
+
+static int
+map_delta_callback(struct remote *r, char *str, char **uptr)
+{
+	unsigned long version;
+	unsigned int x, y;
+	int assigned, off = 0;
+
+	assigned = sscanf(str, "map-delta %lu %d %d%n", &version, &x, &y, &off);
+	if (assigned != 3 || str[off] != ' ')
+		errx(1, "invalid map-delta: %s", str);
+
+	/*
+	 * Rows not downloaded yet will arrive up to date anyway.
+	 */
+	if (map_window == NULL)
+		return (0);
+
+	window_putstr(map_window, x, y, str + off + 1);
+	window_redraw(window_get_root(map_window));
+
+	return (0);
+}
+
+static int
+map_region_callback(struct remote *r, char *str, char **uptr)
+{
+	unsigned long version;
+	unsigned int x, y, w, h, cy;
+	int assigned, off = 0;
+	char *cells, *line;
+
+	assigned = sscanf(str, "map-region %lu %d %d %d %d%n", &version, &x, &y, &w, &h, &off);
+	if (assigned != 5 || str[off] != ' ')
+		errx(1, "invalid map-region: %s", str);
+
+	if (map_window == NULL)
+		return (0);
+
+	cells = rle_decode(str + off + 1, (size_t)w * h);
+	if (cells == NULL)
+		errx(1, "invalid map-region data: %s", str);
+
+	line = calloc(1, w + 1);
+	if (line == NULL)
+		err(1, "calloc");
+	for (cy = 0; cy < h; cy++) {
+		memcpy(line, cells + (size_t)w * cy, w);
+		window_putstr(map_window, x, y + cy, line);
+	}
+	free(line);
+	free(cells);
+
+	window_redraw(window_get_root(map_window));
+
+	return (0);
+}
+
+/*
+ * Our actor has walked into another region, served by another hub;
+ * we'll go there once we're done with this one.  See hub_redirect().
+ */
+static int
+region_redirect_callback(struct remote *r, char *str, char **uptr)
+{
+	unsigned int id;
+	int assigned, port;
+	char token[17];
+
+	assigned = sscanf(str, "region-redirect %d %d %16s", &id, &port, token);
+	if (assigned != 3 || port <= 0 || port > 65535)
+		errx(1, "invalid region-redirect: %s", str);
+
+	if (id != actor_id)
+		return (0);
+
+	redirect_port = port;
+	strlcpy(redirect_token, token, sizeof(redirect_token));
+
+	return (0);
+}
+
 static void
 expect_stuff(void)
 {
 
 	TAILQ_INIT(&actors);
 	remote_expect(hub, "actor-at", actor_at_callback, NULL);
+	remote_expect(hub, "actor-gone", actor_gone_callback, NULL);
+	remote_expect(hub, "actor-stopped", actor_stopped_callback, NULL);
+	remote_expect(hub, "frame", frame_callback, NULL);
+	remote_expect(hub, "map-delta", map_delta_callback, NULL);
+	remote_expect(hub, "map-region", map_region_callback, NULL);
+	remote_expect(hub, "region-redirect", region_redirect_callback, NULL);
 }
 
-static struct window *
-prepare_map_window(struct window *root)
+static void
+map_download(struct window *w)
 {
-	struct window *w;
 	unsigned int y, width, height;
 	char *line;
 
-	w = window_new(root);
-	server_map_get_size(&width, &height);
+	server_map_get_size(&width, &height, &map_version);
 	window_resize(w, width, height);
 
-	line = calloc(1, width + 1);
-	if (line == NULL)
-		err(1, "calloc");
-
 	for (y = 0; y < height; y++) {
 		line = server_map_get_line(y);
 		if (strlen(line) != width)
@@ -258,6 +502,26 @@ prepare_map_window(struct window *root)
 #endif
 	}
 
+	/*
+	 * Make sure nothing changed since map-get-size got lost in between.
+	 */
+	server_map_changes_since(map_version);
+}
+
+static struct window *
+prepare_map_window(struct window *root)
+{
+	struct window *w;
+
+	w = window_new(root);
+
+	/*
+	 * Set it right away, so that the map-delta updates sent
+	 * while we're downloading get applied.
+	 */
+	map_window = w;
+	map_download(w);
+
 	return (w);
 }
 
@@ -362,6 +626,18 @@ character_callback(struct window *w, int key)
 		error = server_move("south");
 		y = 1;
 		break;
+	case 'H':
+		server_walk("west", RUN_STEPS);
+		return;
+	case 'L':
+		server_walk("east", RUN_STEPS);
+		return;
+	case 'K':
+		server_walk("north", RUN_STEPS);
+		return;
+	case 'J':
+		server_walk("south", RUN_STEPS);
+		return;
 	default:
 		errx(1, "unknown key %d", key);
 	}
@@ -371,6 +647,57 @@ character_callback(struct window *w, int key)
 
 	window_move_by(w, x, y);
 	scroll_map(w);
+	map_moved = true;
+}
+
+static int
+map_caught_up_callback(struct remote *r, char *str, char **uptr)
+{
+	unsigned long version;
+
+	if (sscanf(str, "ok, %lu", &version) != 1)
+		errx(1, "invalid reply to map-changes-since: %s", str);
+	if (version > map_version)
+		map_version = version;
+	map_catching_up = false;
+
+	return (1);
+}
+
+/*
+ * The hub only pushes the map changes within our view, so once that moves,
+ * ask for the ones we missed.  Not waiting for the reply, so that it doesn't
+ * hold up walking; map_version only moves once it's there.
+ */
+static void
+map_catch_up(void)
+{
+
+	map_moved = false;
+	map_catching_up = true;
+	remote_expect(hub, "ok", map_caught_up_callback, NULL);
+	remote_send(hub, "map-changes-since %lu\r\n", map_version);
+}
+
+static void
+character_at(unsigned int x, unsigned int y)
+{
+	int dx, dy;
+
+	dx = x - window_get_x(character_window);
+	dy = y - window_get_y(character_window);
+	window_move(character_window, x, y);
+
+	/*
+	 * Scrolling is one cell at a time, which is fine when walking;
+	 * for anything further, just center the map.
+	 */
+	if (dx * dx + dy * dy > 1)
+		center_map(character_window);
+	else
+		scroll_map(character_window);
+	window_redraw(window_get_root(character_window));
+	map_moved = true;
 }
 
 static struct window *
@@ -383,6 +710,7 @@ prepare_character_window(struct window *map_window)
 	server_whereami(&x, &y);
 
 	w = window_new(map_window);
+	character_window = w;
 	window_resize(w, 1, 1);
 	window_move(w, x, y);
 	window_move_cursor(w, 0, 0);
@@ -398,11 +726,80 @@ prepare_character_window(struct window *map_window)
 	window_bind(w, KEY_LEFT, character_callback);
 	window_bind(w, 'l', character_callback);
 	window_bind(w, KEY_RIGHT, character_callback);
+	window_bind(w, 'J', character_callback);
+	window_bind(w, 'K', character_callback);
+	window_bind(w, 'H', character_callback);
+	window_bind(w, 'L', character_callback);
 	window_bind(w, '?', character_callback);
 
 	return (w);
 }
 
+/*
+ * Spectators just look around.
+ */
+static void
+camera_callback(struct window *w, int key)
+{
+	int x = 0, y = 0;
+
+	switch (key) {
+	case 'h':
+	case KEY_LEFT:
+		x = -1;
+		break;
+	case 'l':
+	case KEY_RIGHT:
+		x = 1;
+		break;
+	case 'k':
+	case KEY_UP:
+		y = -1;
+		break;
+	case 'j':
+	case KEY_DOWN:
+		y = 1;
+		break;
+	default:
+		errx(1, "unknown key %d", key);
+	}
+
+	x += window_get_x(w);
+	y += window_get_y(w);
+	if (x < 0 || y < 0 || x >= window_get_width(map_window) || y >= window_get_height(map_window))
+		return;
+
+	window_move(w, x, y);
+	scroll_map(w);
+}
+
+static struct window *
+prepare_camera_window(struct window *map_window)
+{
+	struct window *w;
+
+	server_subscribe();
+
+	w = window_new(map_window);
+	window_resize(w, 1, 1);
+	window_move(w, window_get_width(map_window) / 2, window_get_height(map_window) / 2);
+	window_move_cursor(w, 0, 0);
+	window_putstr(w, 0, 0, "+");
+
+	center_map(w);
+
+	window_bind(w, 'j', camera_callback);
+	window_bind(w, KEY_DOWN, camera_callback);
+	window_bind(w, 'k', camera_callback);
+	window_bind(w, KEY_UP, camera_callback);
+	window_bind(w, 'h', camera_callback);
+	window_bind(w, KEY_LEFT, camera_callback);
+	window_bind(w, 'l', camera_callback);
+	window_bind(w, KEY_RIGHT, camera_callback);
+
+	return (w);
+}
+
 static int
 connect_to(const char *ip, int port)
 {
@@ -427,6 +824,46 @@ connect_to(const char *ip, int port)
 	return (sock);
 }
 
+/*
+ * Switch over to the hub our actor got handed off to, and claim it there.
+ * Returns the new descriptor.
+ */
+static int
+hub_redirect(void)
+{
+	struct actor *a;
+	char *reply = NULL;
+	unsigned int x, y;
+	int hub_fd, assigned;
+
+	remote_delete(hub);
+	map_catching_up = false;
+	while ((a = TAILQ_FIRST(&actors)) != NULL)
+		actor_delete(a);
+
+	hub_fd = connect_to(hub_ip, redirect_port);
+	hub = remote_new(hub_fd);
+	expect_stuff();
+	redirect_port = 0;
+
+	remote_expect(hub, "ok", server_callback, &reply);
+	remote_expect(hub, "sorry", server_callback, &reply);
+	remote_send(hub, "region-join %s\r\n", redirect_token);
+	while (reply == NULL)
+		remote_process_sync(hub);
+
+	assigned = sscanf(reply, "ok, your ID is %d", &actor_id);
+	if (assigned != 1)
+		errx(1, "invalid reply to region-join: %s", reply);
+	free(reply);
+
+	map_download(map_window);
+	server_whereami(&x, &y);
+	character_at(x, y);
+
+	return (hub_fd);
+}
+
 static int
 invalid_ip(const char *ip)
 {
@@ -453,7 +890,7 @@ static void
 usage(void)
 {
 
-	printf("usage: fwk hub-ip [hub-port]\n");
+	printf("usage: fwk [-s] hub-ip [hub-port]\n");
 	exit(0);
 }
 
@@ -461,21 +898,32 @@ int
 main(int argc, char **argv)
 {
 	struct window *root, *character;
-	int input_fd, hub_fd, hub_port, error, nfds;
-	const char *hub_ip;
+	int input_fd, hub_fd, hub_port, error, nfds, ch;
+	bool spectate = false;
 	fd_set fdset;
 
-	if (argc < 2 || argc > 3)
+	while ((ch = getopt(argc, argv, "s")) != -1) {
+		switch (ch) {
+		case 's':
+			spectate = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1 || argc > 2)
 		usage();
 
 	/*
 	 * XXX: Rewrite using getaddrinfo(3).
 	 */
-	hub_ip = argv[1];
+	hub_ip = argv[0];
 	if (invalid_ip(hub_ip))
 		errx(1, "invalid ip address");
-	if (argc == 3) {
-		hub_port = atoi(argv[2]);
+	if (argc == 2) {
+		hub_port = atoi(argv[1]);
 		if (hub_port <= 0 || hub_port > 65535)
 			errx(1, "invalid port number");
 	} else
@@ -492,12 +940,20 @@ main(int argc, char **argv)
 	chat = prepare_chat_window(root);
 #endif
 	map_window = prepare_map_window(root);
-	character = prepare_character_window(map_window);
+	if (spectate)
+		character = prepare_camera_window(map_window);
+	else
+		character = prepare_character_window(map_window);
 
 	input_fd = window_get_input_fd(root);
 	window_redraw(root);
 
 	for (;;) {
+		if (redirect_port != 0)
+			hub_fd = hub_redirect();
+		if (map_moved && !map_catching_up)
+			map_catch_up();
+
 		FD_ZERO(&fdset);
 		nfds = 0;
 		nfds = fd_add(input_fd, &fdset, nfds);
@@ -512,7 +968,8 @@ main(int argc, char **argv)
 			continue;
 		}
 		if (FD_ISSET(hub_fd, &fdset)) {
-			remote_process(hub);
+			if (!remote_process(hub))
+				errx(1, "hub sent too long a line");
 			continue;
 		}
 		err(1, "select returned unknown fd");
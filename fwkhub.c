@@ -7,412 +7,4619 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "blast.h"
+#include "components.h"
+#include "epoch.h"
+#include "flowfield.h"
+#include "items.h"
+#include "jobpool.h"
+#include "journal.h"
 #include "map.h"
+#include "path.h"
 #include "remote.h"
+#include "rle.h"
+#include "slotmap.h"
+#include "snaptable.h"
+#include "timerwheel.h"
 
 #define	FAWORKEN_PORT		1981
 
+#define	WORLD_WIDTH		200
+#define	WORLD_HEIGHT		60
+#define	TEMPLATE_WIDTH		80
+#define	TEMPLATE_HEIGHT		40
+
+#define	MAP_BATCH_CELLS_MAX	(16 * 1024 * 1024)
+
+/*
+ * Every map lives in an instance.  There is the world, which is persistent,
+ * read-only templates, and private instances cloned from the templates;
+ * those go away when the last client leaves them.
+ */
+struct instance {
+	TAILQ_ENTRY(instance)		i_next;
+	unsigned int			i_id;
+	struct map			*i_map;
+	unsigned int			i_clients;
+	bool				i_template;
+	unsigned int			i_npcs;
+	struct flowfield		*i_players;
+	struct item_floor		*i_items;
+	TAILQ_HEAD(, bomb)		i_bombs;
+	unsigned int			i_nbombs;
+	struct blast			*i_blast;
+	struct instance_snapshot	*i_snapshot;
+};
+
+/*
+ * Actors walking with "actor-walk" or "actor-walk-path" take one step
+ * every ACTOR_STEP_INTERVAL milliseconds.
+ */
+#define	ACTOR_STEP_INTERVAL	100
+#define	ACTOR_WALK_MAX		1000
+
+#define	ACTOR_SIGHT_RADIUS	10
+
+/*
+ * Every client gets a session token, which it can learn with "session".
+ * Actors are journaled along with the token of their owner's session,
+ * and those restored from the journal after a crash belong to no one,
+ * until a client reconnects with "session-resume TOKEN".  The ones nobody
+ * claims within SESSION_RESUME_TIMEOUT milliseconds get removed.
+ */
+#define	SESSION_TOKEN_LEN	16
+#define	SESSION_RESUME_TIMEOUT	60000
+
+/*
+ * NPCs are actors run by the hub itself.  NPC_UPDATE_HZ times a second,
+ * every one of them decides where to go, all in parallel on the job pool;
+ * the moves are then made one after another, in the main thread.  Those
+ * within NPC_CHASE_RADIUS steps of a player head towards it, following
+ * the instance flow field; the rest wander around.  They are not journaled.
+ */
+#define	NPC_UPDATE_HZ		10
+#define	NPC_CHASE_RADIUS	20
+#define	NPC_BATCH		1024
+#define	NPC_CELLS_MIN		4
+#define	NPC_DEFAULT_CHAR	'm'
+
 struct client_actor {
 	TAILQ_ENTRY(client_actor)	ca_next;
+	TAILQ_ENTRY(client_actor)	ca_client_next;
 	unsigned int			ca_id;
 	struct actor			*ca_actor;
+	struct instance			*ca_instance;
 	struct client			*ca_client;
 	char				ca_char;
 	char				*ca_name;
+	unsigned char			*ca_walk;
+	unsigned int			ca_walk_len;
+	unsigned int			ca_walk_pos;
+	struct timer			ca_walk_timer;
+	struct map_fov			*ca_fov;
+	bool				ca_npc;
+	bool				ca_restored;
+	char				ca_session[SESSION_TOKEN_LEN + 1];
+	bool				ca_ghost;
+	bool				ca_leaving;
+	struct region_departure		*ca_departure;	/* handoff awaiting an answer */
+	unsigned int			ca_mirrored;
+};
+
+/*
+ * The "npc" component; the NPCs are updated by walking its dense array.
+ */
+struct npc {
+	struct client_actor		*n_ca;
+	unsigned int			n_rng;
+	int				n_move;
+};
+
+/*
+ * Named properties that clients set on their actors with "actor-set" are
+ * components too, all of them holding a long.  The store is limited
+ * to PROPERTIES_MAX names, hub components included.
+ */
+#define	PROPERTIES_MAX	256
+
+/*
+ * Every actor's inventory is a container item, made when it first picks
+ * something up, and found through the "inventory" component.  When the
+ * actor goes away, its things get dropped where it stood.  Items are
+ * not journaled.
+ */
+#define	ITEMS_MAX	(512 * 1024)
+
+/*
+ * Bombs go off once their fuse burns down, turning everything within
+ * the radius that can be seen from where they lie into floor.  NPCs caught
+ * in the blast die, items get destroyed, and other bombs go off too, right
+ * away.  However many bombs go off together, the map gets changed just once,
+ * so the clients get a single update.  Bombs themselves are not journaled,
+ * the damage is.  Player actors are not hurt; there is no such thing yet.
+ */
+#define	BOMB_RADIUS_MAX		16
+#define	BOMB_FUSE_MAX		60000
+#define	BOMBS_MAX		4096
+
+struct bomb {
+	TAILQ_ENTRY(bomb)		b_next;
+	struct instance			*b_instance;
+	unsigned int			b_x;
+	unsigned int			b_y;
+	unsigned int			b_radius;
+	struct timer			b_timer;
+};
+
+/*
+ * In the same order as PATH_NORTH and friends.
+ */
+static const struct {
+	const char	*d_name;
+	int		d_dx;
+	int		d_dy;
+} directions[] = {
+	{ "north", 0, -1 },
+	{ "south", 0, 1 },
+	{ "west", -1, 0 },
+	{ "east", 1, 0 },
+};
+
+/*
+ * Map edit queued between map-batch-begin and map-batch-end.
+ */
+struct map_edit {
+	STAILQ_ENTRY(map_edit)		me_next;
+	unsigned int			me_x;
+	unsigned int			me_y;
+	unsigned int			me_w;
+	unsigned int			me_h;
+	char				*me_cells;
+};
+
+/*
+ * Clients only get told about actors within their view: either the rectangle
+ * they asked for with "viewport", or the area around their first actor.
+ * A client with neither sees the whole instance.  Views are kept as map
+ * watches, so that broadcasts only look at the clients whose views are near.
+ */
+#define	VIEW_RADIUS_X	80
+#define	VIEW_RADIUS_Y	40
+
+struct client_view {
+	unsigned int			v_x;
+	unsigned int			v_y;
+	unsigned int			v_w;
+	unsigned int			v_h;
+};
+
+/*
+ * In tick mode, actor updates are not sent right away; instead, they are
+ * queued and sent once per tick, as a single "frame" line per client,
+ * with only the latest update for every actor.
+ */
+#define	TICK_HZ_MAX	1000
+
+/*
+ * When the hub gets busy, updates about actors far from the center
+ * of a client's view are held back and coalesced, the way tick mode does:
+ * they go out every 2^level ticks, or, without ticks, every LOAD_PERIOD
+ * * 2^(level - 1) milliseconds.  Actors near the center, the client's own
+ * actors, and replies to commands still go out right away.  Every LOAD_WINDOW
+ * milliseconds, the level goes up if the hub spent more than LOAD_HIGH
+ * percent of the time working instead of waiting in select(2), and down
+ * if it spent less than LOAD_LOW.
+ */
+#define	LOAD_WINDOW		500
+#define	LOAD_HIGH		75
+#define	LOAD_LOW		30
+#define	LOAD_LEVEL_MAX		4
+#define	LOAD_PERIOD		100
+#define	LOAD_NEAR_RADIUS	16
+
+struct frame_entry {
+	unsigned int			fe_id;
+	unsigned int			fe_seq;
+	bool				fe_gone;
+	bool				fe_near;
+	unsigned int			fe_x;
+	unsigned int			fe_y;
+	char				fe_char;
+};
+
+struct client {
+	TAILQ_ENTRY(client)		c_next;
+	struct remote			*c_remote;
+	struct instance			*c_instance;
+	TAILQ_HEAD(, client_actor)	c_actors;
+	bool				c_view_explicit;
+	struct client_view		c_view;
+	struct map_watch		*c_watch;
+	struct frame_entry		*c_frame;
+	unsigned int			c_frame_len;
+	unsigned int			c_frame_size;
+	int				c_fd;
+	bool				c_batching;
+	unsigned int			c_batch_errors;
+	size_t				c_batch_cells;
+	STAILQ_HEAD(, map_edit)		c_batch;
+	char				*c_out;
+	size_t				c_out_len;
+	char				c_session[SESSION_TOKEN_LEN + 1];
 };
 
-struct client {
-	TAILQ_ENTRY(client)		c_next;
-	struct remote			*c_remote;
-	int				c_fd;
-};
+/*
+ * Queued updates get encoded for CLIENTS_BATCH clients at a time
+ * on the job pool.
+ */
+#define	CLIENTS_BATCH	16
+
+struct clients_fanout {
+	struct client			**cf_clients;
+	unsigned int			(*cf_encode)(struct client *c, FILE *fp);
+};
+
+/*
+ * Read-only clients, connecting to the port given with -r, get served
+ * by threads of their own, one per client, which never touch the hub state.
+ * Instead, after every iteration that changed something, the main thread
+ * publishes an immutable snapshot of the world: the maps of all the instances,
+ * and the positions of all the actors.  Snapshots share unchanged map chunks
+ * and actor table chunks with the live state, and maps of instances that
+ * haven't changed at all with each other.  Replaced snapshots get freed once
+ * no reader can be looking at them anymore.  Readers see the world the way
+ * it was at the end of some recent iteration; never half-changed.
+ */
+struct instance_snapshot {
+	unsigned int			is_id;
+	unsigned int			is_refcount;
+	struct map_snapshot		*is_map;
+};
+
+struct world_snapshot {
+	unsigned int			ws_ninstances;
+	struct instance_snapshot	**ws_instances;
+	struct snaptable_view		*ws_actors;
+};
+
+/*
+ * Indexed with the slot map index of the actor ID.
+ */
+struct actor_position {
+	unsigned int			ap_id;
+	unsigned int			ap_instance;
+	unsigned int			ap_x;
+	unsigned int			ap_y;
+	char				ap_char;
+};
+
+struct reader {
+	struct remote			*rd_remote;
+	int				rd_slot;
+	unsigned int			rd_instance;
+};
+
+/*
+ * With -g, the world is split into vertical strips, REGION_WIDTH wide,
+ * each one served by a hub process of its own; "-g 1/3" is the middle one
+ * out of three.  They listen for clients on FAWORKEN_PORT plus the region
+ * number, and for their neighbours on REGION_PEER_PORT plus the region number;
+ * neighbours are expected to run on the same host.
+ *
+ * Every hub owns the actors within its strip, and hands out actor IDs from
+ * a range of its own.  Actors within REGION_MARGIN columns of a border get
+ * mirrored to the neighbour on the other side, which shows these "ghosts"
+ * to its clients like any other actor, and doesn't let anyone walk into
+ * them.  Map edits get passed along to all the regions; on connecting,
+ * a hub sends its neighbour the whole of its strip, so that they all end up
+ * with the same world, whether or not it was generated from the same -s seed.
+ *
+ * A player actor stepping over the border gets offered to the neighbour,
+ * along with its properties and its inventory, one "region-item" line
+ * per item.  It stays put until the neighbour answers.  On
+ * "region-handoff-ok TOKEN", it reappears there with a new ID, and its
+ * owner gets "region-redirect ID PORT TOKEN"; it has REGION_JOIN_TIMEOUT
+ * milliseconds to connect there and claim the actor with "region-join TOKEN".
+ * On "region-handoff-refused TOKEN", say with no room left over there,
+ * the actor stays where it was, and so it does if the neighbour goes away
+ * before answering.  NPCs stay within
+ * their region, and so does everyone else while the neighbour is unreachable.
+ * Other instances, items lying around, and bombs are local to each hub;
+ * the journal can't be used.
+ */
+#define	REGIONS_MAX		16
+#define	REGION_WIDTH		WORLD_WIDTH
+#define	REGION_MARGIN		VIEW_RADIUS_X
+#define	REGION_PEER_PORT	(FAWORKEN_PORT + 100)
+#define	REGION_IDS		((1 << 20) / REGIONS_MAX)
+#define	REGION_RETRY		1000
+#define	REGION_JOIN_TIMEOUT	10000
+#define	REGION_TOKEN_LEN	16
+
+#define	REGION_WEST		0
+#define	REGION_EAST		1
+#define	REGION_SIDES		2
+
+/*
+ * Connection to a neighbour, for sending; what it sends comes in over
+ * a region_link.  The only replies are the answers to handoffs.
+ */
+struct region_peer {
+	int				rp_region;	/* -1 if there's none */
+	int				rp_fd;
+	struct remote			*rp_remote;	/* NULL when not connected */
+	struct timer			rp_timer;
+};
+
+struct region_link {
+	TAILQ_ENTRY(region_link)	rl_next;
+	int				rl_fd;
+	struct remote			*rl_remote;
+	int				rl_side;	/* -1 until "region-hello" */
+	int				rl_handoff;	/* actor of the last "region-handoff" */
+};
+
+/*
+ * Actor offered to the neighbour, waiting for it to answer.
+ */
+struct region_departure {
+	TAILQ_ENTRY(region_departure)	rd_next;
+	char				rd_token[REGION_TOKEN_LEN + 1];
+	struct client_actor		*rd_ca;
+	int				rd_side;
+};
+
+/*
+ * Actor handed off to this region, waiting for its owner to show up.
+ */
+struct region_arrival {
+	TAILQ_ENTRY(region_arrival)	ra_next;
+	char				ra_token[REGION_TOKEN_LEN + 1];
+	unsigned int			ra_id;
+	struct timer			ra_timer;
+};
+
+static TAILQ_HEAD(, client)		clients;
+static TAILQ_HEAD(, client_actor)	actors;
+static struct slotmap			*actor_ids;
+static TAILQ_HEAD(, instance)		instances;
+static struct instance			*world;
+static unsigned int			next_instance_id;
+static struct journal			*journal;
+static struct timer			journal_timer;
+static struct timer			restore_timer;
+static struct pathfinder		*pathfinder;
+static unsigned int			tick_hz;
+static unsigned long			tick;
+static struct timer			tick_timer;
+static uint64_t				tick_epoch;
+static unsigned long			tick_epoch_tick;
+static struct timerwheel		*timers;
+static struct components		*components;
+static unsigned int			npc_component;
+static unsigned int			inventory_component;
+static struct items			*items;
+static struct timer			npc_timer;
+static struct jobpool			*jobpool;
+static unsigned int			load_level;
+static unsigned int			load_percent;
+static uint64_t				load_busy;
+static uint64_t				load_window_start;
+static struct timer			load_timer;
+static struct epoch			*epoch;
+static struct snaptable			*actor_positions;
+static _Atomic(struct world_snapshot *)	published;
+static bool				world_changed;
+static unsigned int			regions;
+static unsigned int			region;
+static unsigned int			region_x0;
+static unsigned int			region_x1;
+static struct region_peer		region_peers[REGION_SIDES];
+static TAILQ_HEAD(, region_link)	region_links;
+static TAILQ_HEAD(, client_actor)	region_ghosts;
+static TAILQ_HEAD(, client_actor)	region_leaving;
+static TAILQ_HEAD(, region_departure)	region_departures;
+static TAILQ_HEAD(, region_arrival)	region_arrivals;
+static int				region_socket = -1;
+
+/*
+ * Microseconds of CLOCK_MONOTONIC.
+ */
+static uint64_t
+clock_us(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		err(1, "clock_gettime");
+
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * Milliseconds; that's what the timer wheel runs on.
+ */
+static uint64_t
+clock_ms(void)
+{
+
+	return (clock_us() / 1000);
+}
+
+static void
+instance_snapshot_release(struct instance_snapshot *is)
+{
+
+	assert(is->is_refcount > 0);
+	if (--is->is_refcount > 0)
+		return;
+
+	map_snapshot_delete(is->is_map);
+	free(is);
+}
+
+static struct instance *
+instance_new(struct map *m, bool template)
+{
+	struct instance *i;
+
+	i = calloc(1, sizeof(*i));
+	if (i == NULL)
+		err(1, "calloc");
+
+	i->i_id = next_instance_id++;
+	i->i_map = m;
+	i->i_items = item_floor_new(map_get_width(m), map_get_height(m));
+	TAILQ_INIT(&i->i_bombs);
+	i->i_template = template;
+	TAILQ_INSERT_TAIL(&instances, i, i_next);
+
+	return (i);
+}
+
+static struct instance *
+instance_find(unsigned int id)
+{
+	struct instance *i;
+
+	TAILQ_FOREACH(i, &instances, i_next) {
+		if (i->i_id == id)
+			return (i);
+	}
+
+	return (NULL);
+}
+
+static struct instance *
+instance_find_template(void)
+{
+	struct instance *i;
+
+	TAILQ_FOREACH(i, &instances, i_next) {
+		if (i->i_template)
+			return (i);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Returns the cells from x0 to x1, inclusive, as a string.
+ */
+static char *
+map_line(struct map *map, unsigned int y, unsigned int x0, unsigned int x1)
+{
+	unsigned int x;
+	char *line;
+
+	line = calloc(1, x1 - x0 + 2);
+	if (line == NULL)
+		err(1, "calloc");
+	for (x = x0; x <= x1; x++)
+		line[x - x0] = map_get(map, x, y);
+
+	return (line);
+}
+
+/*
+ * Whether the world cell belongs to this hub; in a world that's not split,
+ * they all do.
+ */
+static bool
+region_owns(unsigned int x)
+{
+
+	return (regions == 0 || (x >= region_x0 && x < region_x1));
+}
+
+/*
+ * Pass a row of world cells along to the neighbours, except for the one
+ * on the "from" side.
+ */
+static void
+region_map_put(unsigned int x, unsigned int y, const char *cells, size_t len, int from)
+{
+	struct region_peer *rp;
+	int side;
+
+	for (side = 0; side < REGION_SIDES; side++) {
+		rp = &region_peers[side];
+		if (side == from || rp->rp_remote == NULL)
+			continue;
+		remote_send(rp->rp_remote, "region-map-put %d %d %.*s\r\n", x, y, (int)len, cells);
+	}
+}
+
+/*
+ * World mutations are recorded in the journal, if there is one, in the same
+ * format the snapshots use; see world_dump() and world_replay().
+ */
+static void
+record_map_put(struct instance *i, unsigned int x, unsigned int y, const char *cells, size_t len)
+{
+
+	if (i != world)
+		return;
+	region_map_put(x, y, cells, len, -1);
+	if (journal == NULL)
+		return;
+	journal_append(journal, "map-put %d %d %.*s\n", x, y, (int)len, cells);
+}
+
+/*
+ * The token of the session the actor belongs to, for the journal.
+ */
+static const char *
+client_actor_session(const struct client_actor *ca)
+{
+
+	if (ca->ca_client != NULL)
+		return (ca->ca_client->c_session);
+	return (ca->ca_session);
+}
+
+static void
+record_actor_new(struct client_actor *ca)
+{
+
+	if (journal == NULL || ca->ca_instance != world || ca->ca_npc)
+		return;
+	journal_append(journal, "actor-new %d %d %d '%c' %s %s\n", ca->ca_id,
+	    map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor), ca->ca_char, ca->ca_name,
+	    client_actor_session(ca));
+}
+
+static void
+record_actor_move(struct client_actor *ca)
+{
+
+	if (journal == NULL || ca->ca_instance != world || ca->ca_npc)
+		return;
+	journal_append(journal, "actor-move %d %d %d\n", ca->ca_id,
+	    map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor));
+}
+
+static void
+record_actor_remove(struct client_actor *ca)
+{
+
+	if (journal == NULL || ca->ca_instance != world || ca->ca_npc)
+		return;
+	journal_append(journal, "actor-remove %d\n", ca->ca_id);
+}
+
+static void
+record_actor_set(struct client_actor *ca, const char *name, long value)
+{
+
+	if (journal == NULL || ca->ca_instance != world || ca->ca_npc)
+		return;
+	journal_append(journal, "actor-set %d %s %ld\n", ca->ca_id, name, value);
+}
+
+static void
+record_actor_unset(struct client_actor *ca, const char *name)
+{
+
+	if (journal == NULL || ca->ca_instance != world || ca->ca_npc)
+		return;
+	journal_append(journal, "actor-unset %d %s\n", ca->ca_id, name);
+}
+
+/*
+ * Components used by the hub itself are off limits for "actor-set".
+ */
+static bool
+component_is_property(unsigned int type)
+{
+
+	return (type != npc_component && type != inventory_component);
+}
+
+/*
+ * Returns the component for the property, or -1 if there's no such property.
+ */
+static int
+property_find(const char *name)
+{
+	int type;
+
+	type = components_lookup(components, name);
+	if (type < 0 || !component_is_property(type))
+		return (-1);
+
+	return (type);
+}
+
+/*
+ * Like property_find(), except that new names get registered; returns -1
+ * if there's no room for more, or the name is taken by a hub component.
+ */
+static int
+property_register(const char *name)
+{
+	int type;
+
+	type = components_lookup(components, name);
+	if (type < 0 && components_ntypes(components) >= PROPERTIES_MAX)
+		return (-1);
+	type = components_register(components, name, sizeof(long));
+	if (type < 0 || !component_is_property(type))
+		return (-1);
+
+	return (type);
+}
+
+static void
+record_actor_properties(struct client_actor *ca)
+{
+	unsigned int type;
+	long *value;
+
+	for (type = 0; type < components_ntypes(components); type++) {
+		if (!component_is_property(type))
+			continue;
+		value = components_get(components, type, ca->ca_id);
+		if (value != NULL)
+			record_actor_set(ca, components_name(components, type), *value);
+	}
+}
+
+/*
+ * In a split world, new actors land within this hub's region.  Returns NULL
+ * if there's no room left.
+ */
+static struct actor *
+instance_actor_new(struct instance *i)
+{
+
+	if (regions > 0 && i == world)
+		return (map_actor_new_within(i->i_map, region_x0, 0, region_x1 - region_x0, map_get_height(i->i_map)));
+
+	return (map_actor_new(i->i_map));
+}
+
+/*
+ * Whether the neighbour on that side should know about an actor at x.
+ */
+static bool
+region_near(int side, unsigned int x)
+{
+
+	if (side == REGION_WEST)
+		return (x < region_x0 + REGION_MARGIN);
+	return (x + REGION_MARGIN >= region_x1);
+}
+
+/*
+ * Let the neighbours know where the actor is, if it's close enough
+ * to their border, or that it's gone, if they knew about it before;
+ * to be called whenever it appears, moves, or changes instances.
+ */
+static void
+region_mirror(struct client_actor *ca)
+{
+	struct region_peer *rp;
+	unsigned int x, y;
+	int side;
+
+	if (regions == 0 || ca->ca_ghost)
+		return;
+
+	x = map_actor_get_x(ca->ca_actor);
+	y = map_actor_get_y(ca->ca_actor);
+	for (side = 0; side < REGION_SIDES; side++) {
+		rp = &region_peers[side];
+		if (rp->rp_remote == NULL)
+			continue;
+		if (ca->ca_instance == world && !ca->ca_leaving && region_near(side, x)) {
+			remote_send(rp->rp_remote, "region-actor-at %d %d %d '%c'\r\n", ca->ca_id, x, y, ca->ca_char);
+			ca->ca_mirrored |= 1 << side;
+		} else if (ca->ca_mirrored & (1 << side)) {
+			remote_send(rp->rp_remote, "region-actor-gone %d\r\n", ca->ca_id);
+			ca->ca_mirrored &= ~(1 << side);
+		}
+	}
+}
+
+/*
+ * Update the actor in the table the world snapshots get made from;
+ * to be called whenever it appears, moves, or changes instances.
+ */
+static void
+client_actor_publish(struct client_actor *ca)
+{
+	struct actor_position *ap;
+
+	if (actor_positions == NULL)
+		return;
+
+	ap = snaptable_set(actor_positions, slotmap_index(ca->ca_id));
+	ap->ap_id = ca->ca_id;
+	ap->ap_instance = ca->ca_instance->i_id;
+	ap->ap_x = map_actor_get_x(ca->ca_actor);
+	ap->ap_y = map_actor_get_y(ca->ca_actor);
+	ap->ap_char = ca->ca_char;
+	world_changed = true;
+}
+
+static void
+client_actor_unpublish(struct client_actor *ca)
+{
+
+	if (actor_positions == NULL)
+		return;
+
+	snaptable_clear(actor_positions, slotmap_index(ca->ca_id));
+	world_changed = true;
+}
+
+/*
+ * Returns NULL if there's no room left in the client's instance.
+ */
+static struct client_actor *
+client_actor_add(struct client *c, char ch, const char *name)
+{
+	struct client_actor *ca;
+	struct actor *a;
+
+	a = instance_actor_new(c->c_instance);
+	if (a == NULL)
+		return (NULL);
+
+	ca = calloc(1, sizeof(*ca));
+	if (ca == NULL)
+		err(1, "calloc");
+
+	ca->ca_id = slotmap_alloc(actor_ids, ca);
+	ca->ca_actor = a;
+	map_actor_set_uptr(ca->ca_actor, ca);
+	ca->ca_instance = c->c_instance;
+	ca->ca_client = c;
+	ca->ca_char = ch;
+	ca->ca_name = strdup(name);
+	if (ca->ca_name == NULL)
+		err(1, "strdup");
+
+	TAILQ_INSERT_TAIL(&actors, ca, ca_next);
+	TAILQ_INSERT_TAIL(&c->c_actors, ca, ca_client_next);
+	record_actor_new(ca);
+	client_actor_publish(ca);
+	region_mirror(ca);
+
+	return (ca);
+}
+
+/*
+ * Recreate an actor from the journal.  Its client is long gone,
+ * so the actor belongs to no one, until someone resumes the session.
+ */
+static void
+client_actor_restore(unsigned int id, unsigned int x, unsigned int y, char ch, const char *name,
+    const char *session)
+{
+	struct client_actor *ca;
+
+	ca = calloc(1, sizeof(*ca));
+	if (ca == NULL)
+		err(1, "calloc");
+
+	if (!slotmap_claim(actor_ids, id, ca))
+		errx(1, "journal: actor %d created twice", id);
+	ca->ca_id = id;
+	ca->ca_actor = map_actor_new_at(world->i_map, x, y);
+	map_actor_set_uptr(ca->ca_actor, ca);
+	ca->ca_instance = world;
+	ca->ca_char = ch;
+	ca->ca_name = strdup(name);
+	if (ca->ca_name == NULL)
+		err(1, "strdup");
+	ca->ca_restored = true;
+	strlcpy(ca->ca_session, session, sizeof(ca->ca_session));
+
+	TAILQ_INSERT_TAIL(&actors, ca, ca_next);
+	client_actor_publish(ca);
+}
+
+/*
+ * How many more NPCs fit in the instance; they may take up at most
+ * one in every NPC_CELLS_MIN floor cells of where they'd land.
+ */
+static unsigned int
+npc_room(struct instance *i)
+{
+	unsigned int max;
+
+	if (regions > 0 && i == world)
+		max = map_count_floor(i->i_map, region_x0, 0, region_x1 - region_x0, map_get_height(i->i_map));
+	else
+		max = map_count_floor(i->i_map, 0, 0, map_get_width(i->i_map), map_get_height(i->i_map));
+	max /= NPC_CELLS_MIN;
+	if (i->i_npcs >= max)
+		return (0);
+	return (max - i->i_npcs);
+}
+
+/*
+ * Returns NULL if there's no room left in the instance.
+ */
+static struct client_actor *
+npc_add(struct instance *i, char ch)
+{
+	struct client_actor *ca;
+	struct actor *a;
+	struct npc *npc;
+
+	assert(npc_room(i) > 0);
+
+	a = instance_actor_new(i);
+	if (a == NULL)
+		return (NULL);
+
+	ca = calloc(1, sizeof(*ca));
+	if (ca == NULL)
+		err(1, "calloc");
+
+	ca->ca_id = slotmap_alloc(actor_ids, ca);
+	ca->ca_actor = a;
+	map_actor_set_uptr(ca->ca_actor, ca);
+	ca->ca_instance = i;
+	ca->ca_char = ch;
+	ca->ca_name = strdup("npc");
+	if (ca->ca_name == NULL)
+		err(1, "strdup");
+	ca->ca_npc = true;
+	npc = components_set(components, npc_component, ca->ca_id);
+	npc->n_ca = ca;
+	/*
+	 * Any nonzero seed will do.
+	 */
+	npc->n_rng = ca->ca_id * 2654435761u | 1;
+	i->i_npcs++;
+
+	TAILQ_INSERT_TAIL(&actors, ca, ca_next);
+	client_actor_publish(ca);
+	region_mirror(ca);
+	if (!timerwheel_pending(&npc_timer))
+		timerwheel_schedule(timers, &npc_timer, clock_ms());
+
+	return (ca);
+}
+
+static struct client_actor *
+client_actor_find_by_id(unsigned int id)
+{
+
+	return (slotmap_get(actor_ids, id));
+}
+
+/*
+ * Returns NULL if the actor has never had an inventory, and "create"
+ * is false.
+ */
+static struct item *
+client_actor_inventory(struct client_actor *ca, bool create)
+{
+	unsigned int *idp;
+	struct item *inventory;
+
+	idp = components_get(components, inventory_component, ca->ca_id);
+	if (idp != NULL)
+		return (items_find(items, *idp));
+	if (!create)
+		return (NULL);
+
+	inventory = items_create(items, '&', ca->ca_name, true);
+	idp = components_set(components, inventory_component, ca->ca_id);
+	*idp = item_get_id(inventory);
+
+	return (inventory);
+}
+
+static void
+client_get_view(struct client *c, struct client_view *v)
+{
+	struct client_actor *ca;
+	struct map *map;
+	unsigned int x, y;
+
+	if (c->c_view_explicit) {
+		*v = c->c_view;
+		return;
+	}
+
+	map = c->c_instance->i_map;
+	ca = TAILQ_FIRST(&c->c_actors);
+	if (ca == NULL) {
+		v->v_x = v->v_y = 0;
+		v->v_w = map_get_width(map);
+		v->v_h = map_get_height(map);
+		return;
+	}
+
+	x = map_actor_get_x(ca->ca_actor);
+	y = map_actor_get_y(ca->ca_actor);
+	v->v_x = x > VIEW_RADIUS_X ? x - VIEW_RADIUS_X : 0;
+	v->v_y = y > VIEW_RADIUS_Y ? y - VIEW_RADIUS_Y : 0;
+	v->v_w = x + VIEW_RADIUS_X + 1 - v->v_x;
+	v->v_h = y + VIEW_RADIUS_Y + 1 - v->v_y;
+}
+
+/*
+ * Called whenever the client's view might have changed.
+ */
+static void
+client_watch_update(struct client *c)
+{
+	struct client_view v;
+
+	client_get_view(c, &v);
+	map_watch_set(c->c_watch, v.v_x, v.v_y, v.v_w, v.v_h);
+}
+
+static void
+client_actor_free(struct client_actor *ca)
+{
+	struct item *inventory, *it;
+
+	client_actor_unpublish(ca);
+	ca->ca_leaving = true;
+	region_mirror(ca);
+	if (ca->ca_departure != NULL) {
+		TAILQ_REMOVE(&region_departures, ca->ca_departure, rd_next);
+		free(ca->ca_departure);
+	}
+	slotmap_free(actor_ids, ca->ca_id);
+	TAILQ_REMOVE(&actors, ca, ca_next);
+	if (ca->ca_walk != NULL) {
+		timerwheel_cancel(timers, &ca->ca_walk_timer);
+		free(ca->ca_walk);
+	}
+	if (ca->ca_client != NULL) {
+		TAILQ_REMOVE(&ca->ca_client->c_actors, ca, ca_client_next);
+		client_watch_update(ca->ca_client);
+	}
+	inventory = client_actor_inventory(ca, false);
+	if (inventory != NULL) {
+		while ((it = item_first(inventory)) != NULL) {
+			item_drop(it, ca->ca_instance->i_items,
+			    map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor));
+		}
+		items_destroy(items, inventory);
+	}
+	components_remove_all(components, ca->ca_id);
+	if (ca->ca_npc)
+		ca->ca_instance->i_npcs--;
+	map_actor_delete(ca->ca_actor);
+	if (ca->ca_fov != NULL)
+		map_fov_delete(ca->ca_fov);
+	free(ca->ca_name);
+	free(ca);
+}
+
+static void
+instance_release(struct instance *i)
+{
+	struct npc *npcs;
+	struct bomb *b;
+	unsigned int n;
+
+	assert(i->i_clients > 0);
+	i->i_clients--;
+	if (i->i_clients > 0 || i == world || i->i_template)
+		return;
+
+	/*
+	 * Going backwards, so that the NPCs moved into the freed places
+	 * have already been looked at.  Removing components doesn't move
+	 * the arrays.
+	 */
+	npcs = components_values(components, npc_component);
+	for (n = components_count(components, npc_component); n > 0 && i->i_npcs > 0; n--) {
+		if (npcs[n - 1].n_ca->ca_instance == i)
+			client_actor_free(npcs[n - 1].n_ca);
+	}
+	if (i->i_players != NULL)
+		flowfield_delete(i->i_players);
+	item_floor_delete(items, i->i_items);
+	while ((b = TAILQ_FIRST(&i->i_bombs)) != NULL) {
+		TAILQ_REMOVE(&i->i_bombs, b, b_next);
+		timerwheel_cancel(timers, &b->b_timer);
+		free(b);
+	}
+	if (i->i_blast != NULL)
+		blast_delete(i->i_blast);
+	if (i->i_snapshot != NULL) {
+		instance_snapshot_release(i->i_snapshot);
+		world_changed = true;
+	}
+
+	TAILQ_REMOVE(&instances, i, i_next);
+	pathfinder_forget_map(pathfinder, i->i_map);
+	map_delete(i->i_map);
+	free(i);
+}
+
+static void
+client_actor_remove(struct client_actor *ca)
+{
+
+	record_actor_remove(ca);
+	client_actor_free(ca);
+}
+
+/*
+ * Returns NULL if there is no such actor, or it belongs to some other client.
+ */
+static struct client_actor *
+client_actor_find(struct client *c, unsigned int id)
+{
+	struct client_actor *ca;
+
+	ca = client_actor_find_by_id(id);
+	if (ca == NULL || ca->ca_client != c)
+		return (NULL);
+
+	return (ca);
+}
+
+static bool
+view_contains(const struct client_view *v, unsigned int x, unsigned int y)
+{
+
+	if (x < v->v_x || x - v->v_x >= v->v_w)
+		return (false);
+	if (y < v->v_y || y - v->v_y >= v->v_h)
+		return (false);
+	return (true);
+}
+
+static struct frame_entry *
+client_frame_add(struct client *c, unsigned int id)
+{
+	struct frame_entry *fe;
+
+	if (c->c_frame_len == c->c_frame_size) {
+		c->c_frame_size = c->c_frame_size > 0 ? c->c_frame_size * 2 : 16;
+		c->c_frame = realloc(c->c_frame, c->c_frame_size * sizeof(*c->c_frame));
+		if (c->c_frame == NULL)
+			err(1, "realloc");
+	}
+
+	fe = &c->c_frame[c->c_frame_len];
+	fe->fe_id = id;
+	fe->fe_seq = c->c_frame_len;
+	fe->fe_near = true;
+	c->c_frame_len++;
+
+	return (fe);
+}
+
+static bool
+client_is_near(struct client *c, unsigned int x, unsigned int y)
+{
+	struct client_view v;
+	unsigned int cx, cy;
+
+	client_get_view(c, &v);
+	cx = v.v_x + v.v_w / 2;
+	cy = v.v_y + v.v_h / 2;
+
+	return ((x > cx ? x - cx : cx - x) <= LOAD_NEAR_RADIUS &&
+	    (y > cy ? y - cy : cy - y) <= LOAD_NEAR_RADIUS);
+}
+
+/*
+ * Without ticks, updates that go out right away don't get queued; those
+ * held back are only reminders to send whatever is current by the time
+ * they go out, see client_encode_deferred().
+ */
+static void
+send_actor_at(struct client *c, struct client_actor *ca)
+{
+	struct frame_entry *fe;
+	unsigned int x, y;
+	bool near;
+
+	x = map_actor_get_x(ca->ca_actor);
+	y = map_actor_get_y(ca->ca_actor);
+	near = load_level == 0 || ca->ca_client == c || client_is_near(c, x, y);
+
+	if (tick_hz == 0 && near) {
+		remote_send(c->c_remote, "actor-at %d %d %d '%c'\r\n", ca->ca_id,
+		    x, y, ca->ca_char);
+		return;
+	}
+
+	fe = client_frame_add(c, ca->ca_id);
+	fe->fe_gone = false;
+	fe->fe_near = near;
+	fe->fe_x = x;
+	fe->fe_y = y;
+	fe->fe_char = ca->ca_char;
+}
+
+static void
+send_actor_gone(struct client *c, unsigned int id)
+{
+	struct frame_entry *fe;
+
+	if (tick_hz == 0) {
+		remote_send(c->c_remote, "actor-gone %d\r\n", id);
+		return;
+	}
+
+	fe = client_frame_add(c, id);
+	fe->fe_gone = true;
+}
+
+static int
+frame_entry_compare(const void *a, const void *b)
+{
+	const struct frame_entry *fa = a, *fb = b;
+
+	if (fa->fe_id != fb->fe_id)
+		return (fa->fe_id < fb->fe_id ? -1 : 1);
+	if (fa->fe_seq != fb->fe_seq)
+		return (fa->fe_seq < fb->fe_seq ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Encode everything queued since the last tick, as a single line:
+ * "frame TICK at ID X Y 'C' gone ID ...".  Nothing gets encoded if nothing
+ * has changed.  When the hub is busy, distant actors are left out of most
+ * frames; their latest entries stay queued for a later one.  Returns
+ * the number of updates encoded.
+ */
+static unsigned int
+client_encode_frame(struct client *c, FILE *fp)
+{
+	struct frame_entry *fe;
+	unsigned int i, kept = 0, sent = 0;
+	bool full;
+
+	qsort(c->c_frame, c->c_frame_len, sizeof(*c->c_frame), frame_entry_compare);
+	full = (tick & ((1ul << load_level) - 1)) == 0;
+
+	fprintf(fp, "frame %lu", tick);
+	for (i = 0; i < c->c_frame_len; i++) {
+		fe = &c->c_frame[i];
+		/*
+		 * Only the latest entry for any given actor counts.
+		 */
+		if (i + 1 < c->c_frame_len && c->c_frame[i + 1].fe_id == fe->fe_id)
+			continue;
+		if (!full && !fe->fe_near && !fe->fe_gone) {
+			fe->fe_seq = kept;
+			c->c_frame[kept++] = *fe;
+			continue;
+		}
+		if (fe->fe_gone)
+			fprintf(fp, " gone %d", fe->fe_id);
+		else
+			fprintf(fp, " at %d %d %d '%c'", fe->fe_id, fe->fe_x, fe->fe_y, fe->fe_char);
+		sent++;
+	}
+	fputs("\r\n", fp);
+	fputc('\0', fp);
+	c->c_frame_len = kept;
+
+	return (sent);
+}
+
+/*
+ * Without ticks, send the current position of every actor with updates
+ * held back, unless it's not there to be seen anymore; whatever happened
+ * to it since then has already gone out.
+ */
+static unsigned int
+client_encode_deferred(struct client *c, FILE *fp)
+{
+	struct client_view v;
+	struct client_actor *ca;
+	struct frame_entry *fe;
+	unsigned int i, x, y, sent = 0;
+
+	qsort(c->c_frame, c->c_frame_len, sizeof(*c->c_frame), frame_entry_compare);
+	client_get_view(c, &v);
+
+	for (i = 0; i < c->c_frame_len; i++) {
+		fe = &c->c_frame[i];
+		if (i + 1 < c->c_frame_len && c->c_frame[i + 1].fe_id == fe->fe_id)
+			continue;
+		ca = client_actor_find_by_id(fe->fe_id);
+		if (ca == NULL || ca->ca_leaving || ca->ca_instance != c->c_instance)
+			continue;
+		x = map_actor_get_x(ca->ca_actor);
+		y = map_actor_get_y(ca->ca_actor);
+		if (!view_contains(&v, x, y))
+			continue;
+		fprintf(fp, "actor-at %d %d %d '%c'\r\n", fe->fe_id, x, y, ca->ca_char);
+		fputc('\0', fp);
+		sent++;
+	}
+	c->c_frame_len = 0;
+
+	return (sent);
+}
+
+static void
+clients_encode_job(void *arg, unsigned int begin, unsigned int end)
+{
+	struct clients_fanout *cf;
+	struct client *c;
+	unsigned int n, sent;
+	FILE *fp;
+
+	cf = arg;
+	for (n = begin; n < end; n++) {
+		c = cf->cf_clients[n];
+		fp = open_memstream(&c->c_out, &c->c_out_len);
+		if (fp == NULL)
+			err(1, "open_memstream");
+		sent = cf->cf_encode(c, fp);
+		if (fclose(fp) != 0)
+			err(1, "open_memstream");
+		if (sent == 0)
+			c->c_out_len = 0;
+	}
+}
+
+/*
+ * Encode the updates queued for all the clients, in parallel on the job
+ * pool, and then send them out, one client after another.  Encoders must
+ * only change the client they're given.
+ */
+static void
+clients_flush(unsigned int (*encode)(struct client *c, FILE *fp))
+{
+	struct clients_fanout cf;
+	struct client *c;
+	unsigned int i, n = 0;
+
+	TAILQ_FOREACH(c, &clients, c_next) {
+		if (c->c_frame_len > 0)
+			n++;
+	}
+	if (n == 0)
+		return;
+
+	cf.cf_clients = calloc(n, sizeof(*cf.cf_clients));
+	if (cf.cf_clients == NULL)
+		err(1, "calloc");
+	cf.cf_encode = encode;
+	n = 0;
+	TAILQ_FOREACH(c, &clients, c_next) {
+		if (c->c_frame_len > 0)
+			cf.cf_clients[n++] = c;
+	}
+
+	jobpool_run(jobpool, clients_encode_job, &cf, n, CLIENTS_BATCH);
+
+	for (i = 0; i < n; i++) {
+		c = cf.cf_clients[i];
+		if (c->c_out_len > 0)
+			remote_send_raw(c->c_remote, c->c_out, c->c_out_len);
+		free(c->c_out);
+		c->c_out = NULL;
+	}
+	free(cf.cf_clients);
+}
+
+struct actor_broadcast {
+	struct client_actor	*ab_ca;
+	bool			ab_moved;
+};
+
+static void
+broadcast_at_callback(void *uptr, void *arg)
+{
+	struct actor_broadcast *ab;
+	struct client *c2;
+
+	c2 = uptr;
+	ab = arg;
+	if (c2 != ab->ab_ca->ca_client)
+		send_actor_at(c2, ab->ab_ca);
+}
+
+static void
+broadcast_gone_callback(void *uptr, void *arg)
+{
+	struct actor_broadcast *ab;
+	struct client *c2;
+
+	c2 = uptr;
+	ab = arg;
+	if (c2 == ab->ab_ca->ca_client)
+		return;
+	/*
+	 * Those who can still see it have been told where it went.
+	 */
+	if (ab->ab_moved && map_watch_contains(c2->c_watch,
+	    map_actor_get_x(ab->ab_ca->ca_actor), map_actor_get_y(ab->ab_ca->ca_actor)))
+		return;
+
+	send_actor_gone(c2, ab->ab_ca->ca_id);
+}
+
+/*
+ * Tell the other clients in the instance that the actor has appeared, or moved
+ * from (old_x, old_y).  Those who saw it leave their view get "actor-gone".
+ */
+static void
+broadcast_actor_at(struct client_actor *ca, bool moved, unsigned int old_x, unsigned int old_y)
+{
+	struct actor_broadcast ab;
+	struct map *map;
+
+	ab.ab_ca = ca;
+	ab.ab_moved = moved;
+	map = ca->ca_instance->i_map;
+	map_watches_at(map, map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor),
+	    broadcast_at_callback, &ab);
+	if (moved)
+		map_watches_at(map, old_x, old_y, broadcast_gone_callback, &ab);
+}
+
+/*
+ * Tell the other clients in the instance that the actor is about to disappear.
+ */
+static void
+broadcast_actor_gone(struct client_actor *ca)
+{
+	struct actor_broadcast ab;
+
+	ab.ab_ca = ca;
+	ab.ab_moved = false;
+	map_watches_at(ca->ca_instance->i_map, map_actor_get_x(ca->ca_actor),
+	    map_actor_get_y(ca->ca_actor), broadcast_gone_callback, &ab);
+}
+
+struct view_change {
+	struct client		*vc_client;
+	const struct client_view *vc_other;
+	bool			vc_gone;
+};
+
+static void
+view_change_callback(struct actor *a, void *arg)
+{
+	struct view_change *vc;
+	struct client_actor *ca;
+
+	vc = arg;
+	ca = map_actor_get_uptr(a);
+	if (ca->ca_client == vc->vc_client)
+		return;
+	if (vc->vc_other != NULL && view_contains(vc->vc_other,
+	    map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor)))
+		return;
+
+	if (vc->vc_gone)
+		send_actor_gone(vc->vc_client, ca->ca_id);
+	else
+		send_actor_at(vc->vc_client, ca);
+}
+
+/*
+ * The client's view has changed from "old"; tell it about actors that came
+ * into view, and the ones that went out of it.  With "old" being NULL,
+ * the client gets told about every actor it can see.
+ */
+static void
+client_view_changed(struct client *c, const struct client_view *old)
+{
+	struct client_view new;
+	struct view_change vc;
+	struct map *map;
+
+	client_get_view(c, &new);
+	map_watch_set(c->c_watch, new.v_x, new.v_y, new.v_w, new.v_h);
+	map = c->c_instance->i_map;
+	vc.vc_client = c;
+
+	vc.vc_other = old;
+	vc.vc_gone = false;
+	map_actors_in_rect(map, new.v_x, new.v_y, new.v_w, new.v_h, view_change_callback, &vc);
+
+	if (old == NULL)
+		return;
+	vc.vc_other = &new;
+	vc.vc_gone = true;
+	map_actors_in_rect(map, old->v_x, old->v_y, old->v_w, old->v_h, view_change_callback, &vc);
+}
+
+static int
+action_actor_new(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	struct client_view old_view;
+	int assigned;
+	char ch;
+	char name[32];
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "actor-new '%c' %31s", &ch, name);
+	if (assigned != 2) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-new 'X' name'\r\n");
+		return (0);
+	}
+
+	client_get_view(c, &old_view);
+	ca = client_actor_add(c, ch, name);
+	if (ca == NULL) {
+		remote_send(r, "sorry, no room left\r\n");
+		return (0);
+	}
+	remote_send(r, "ok, your ID is %d\r\n", ca->ca_id);
+
+	broadcast_actor_at(ca, false, 0, 0);
+
+	/*
+	 * The first actor is what the view is centered on.
+	 */
+	if (!c->c_view_explicit && ca == TAILQ_FIRST(&c->c_actors))
+		client_view_changed(c, &old_view);
+
+	return (0);
+}
+
+static int
+action_actor_locate(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	unsigned int actor_id;
+	int assigned;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "actor-locate %d", &actor_id);
+	if (assigned != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-locate actor-id'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	remote_send(r, "ok, %d %d\r\n", map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor));
+	return (0);
+}
+
+/*
+ * Returns the index into directions[], or -1 if there's no such direction.
+ */
+static int
+direction_parse(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(directions) / sizeof(directions[0]); i++) {
+		if (strcmp(name, directions[i].d_name) == 0)
+			return (i);
+	}
+
+	return (-1);
+}
+
+/*
+ * Send the neighbour a "region-item DEPTH 'C' NAME [container]" line for
+ * everything in the inventory, depth first; the items right in it are
+ * at depth 1.
+ */
+static void
+region_send_items(struct remote *r, struct item *inventory)
+{
+	struct item *it, *next;
+	unsigned int depth = 1;
+
+	it = item_first(inventory);
+	while (it != NULL) {
+		remote_send(r, "region-item %u '%c' %s%s\r\n", depth, item_get_char(it),
+		    item_get_name(it), item_is_container(it) ? " container" : "");
+		if ((next = item_first(it)) != NULL) {
+			depth++;
+			it = next;
+			continue;
+		}
+		while ((next = item_next(it)) == NULL && depth > 1) {
+			it = item_get_container(it);
+			depth--;
+		}
+		it = next;
+	}
+}
+
+/*
+ * Offer the actor to the neighbour on that side, into (x, y).  It stays
+ * where it is, hidden from the neighbour, until the answer comes; see
+ * action_region_handoff_ok().  Returns -1, or the same errors
+ * as map_actor_move_by() if it can't go there.
+ */
+static int
+region_handoff(struct client_actor *ca, int side, unsigned int x, unsigned int y)
+{
+	struct region_peer *rp;
+	struct region_departure *rd;
+	struct item *inventory;
+	unsigned int type;
+	long *value;
+	char token[REGION_TOKEN_LEN + 1], *msg;
+	size_t msg_len;
+	FILE *fp;
+
+	rp = &region_peers[side];
+	if (ca->ca_npc || ca->ca_client == NULL || rp->rp_remote == NULL)
+		return (1);
+	if (map_get(world->i_map, x, y) != ' ')
+		return (1);
+	if (map_actor_at(world->i_map, x, y) != NULL)
+		return (2);
+
+	/*
+	 * Make sure the ghost is gone before the actor shows up.
+	 */
+	ca->ca_leaving = true;
+	region_mirror(ca);
+
+	snprintf(token, sizeof(token), "%08x%08x", arc4random(), arc4random());
+	fp = open_memstream(&msg, &msg_len);
+	if (fp == NULL)
+		err(1, "open_memstream");
+	fprintf(fp, "region-handoff %s %d %d '%c' %s", token, x, y, ca->ca_char, ca->ca_name);
+	for (type = 0; type < components_ntypes(components); type++) {
+		if (!component_is_property(type))
+			continue;
+		value = components_get(components, type, ca->ca_id);
+		if (value != NULL)
+			fprintf(fp, " %s %ld", components_name(components, type), *value);
+	}
+	if (fclose(fp) != 0)
+		err(1, "open_memstream");
+	remote_send(rp->rp_remote, "%s\r\n", msg);
+	free(msg);
+
+	inventory = client_actor_inventory(ca, false);
+	if (inventory != NULL)
+		region_send_items(rp->rp_remote, inventory);
+
+	rd = calloc(1, sizeof(*rd));
+	if (rd == NULL)
+		err(1, "calloc");
+	strlcpy(rd->rd_token, token, sizeof(rd->rd_token));
+	rd->rd_ca = ca;
+	rd->rd_side = side;
+	TAILQ_INSERT_TAIL(&region_departures, rd, rd_next);
+	ca->ca_departure = rd;
+
+	return (-1);
+}
+
+/*
+ * The neighbour won't take the actor after all; it stays ours.
+ */
+static void
+region_departure_cancel(struct region_departure *rd)
+{
+	struct client_actor *ca;
+
+	ca = rd->rd_ca;
+	TAILQ_REMOVE(&region_departures, rd, rd_next);
+	free(rd);
+	ca->ca_departure = NULL;
+	ca->ca_leaving = false;
+	region_mirror(ca);
+}
+
+/*
+ * Move the actor one step and let everyone concerned know; returns
+ * the map_actor_move_by() error, or -1 if the actor stepped into another
+ * region.  It can't go anywhere while the neighbour makes up its mind.
+ */
+static int
+client_actor_step(struct client_actor *ca, int direction)
+{
+	struct client *c;
+	struct client_view old_view;
+	unsigned int old_x, old_y;
+	int dx, dy, error;
+
+	if (ca->ca_departure != NULL)
+		return (1);
+
+	old_x = map_actor_get_x(ca->ca_actor);
+	old_y = map_actor_get_y(ca->ca_actor);
+	dx = directions[direction].d_dx;
+	dy = directions[direction].d_dy;
+	if (ca->ca_instance == world && !region_owns(old_x + dx))
+		return (region_handoff(ca, dx < 0 ? REGION_WEST : REGION_EAST, old_x + dx, old_y + dy));
+
+	c = ca->ca_client;
+	if (c != NULL)
+		client_get_view(c, &old_view);
+
+	error = map_actor_move_by(ca->ca_actor, dx, dy);
+	if (error != 0)
+		return (error);
+
+	record_actor_move(ca);
+	client_actor_publish(ca);
+	region_mirror(ca);
+	broadcast_actor_at(ca, true, old_x, old_y);
+	if (c != NULL && !c->c_view_explicit && ca == TAILQ_FIRST(&c->c_actors))
+		client_view_changed(c, &old_view);
+
+	return (0);
+}
+
+/*
+ * Stop the walk, telling the owner where the actor ended up.
+ */
+static void
+client_actor_walk_stop(struct client_actor *ca, const char *why)
+{
+
+	if (ca->ca_walk == NULL)
+		return;
+
+	timerwheel_cancel(timers, &ca->ca_walk_timer);
+	free(ca->ca_walk);
+	ca->ca_walk = NULL;
+
+	if (ca->ca_client != NULL) {
+		remote_send(ca->ca_client->c_remote, "actor-stopped %d %d %d %s\r\n", ca->ca_id,
+		    map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor), why);
+	}
+}
+
+/*
+ * Take the next step of the walk.
+ */
+static void
+client_actor_walk_timer(void *arg)
+{
+	struct client_actor *ca;
+	uint64_t due;
+	int error;
+
+	ca = arg;
+	error = client_actor_step(ca, ca->ca_walk[ca->ca_walk_pos]);
+	if (error != 0) {
+		client_actor_walk_stop(ca, "blocked");
+		return;
+	}
+	/*
+	 * The owner doesn't normally get told about its own moves,
+	 * but this time it didn't ask for this particular one.
+	 */
+	if (ca->ca_client != NULL)
+		send_actor_at(ca->ca_client, ca);
+
+	ca->ca_walk_pos++;
+	if (ca->ca_walk_pos == ca->ca_walk_len) {
+		client_actor_walk_stop(ca, "done");
+		return;
+	}
+
+	due = timerwheel_due(&ca->ca_walk_timer) + ACTOR_STEP_INTERVAL;
+	if (due < timerwheel_now(timers))
+		due = timerwheel_now(timers);
+	timerwheel_schedule(timers, &ca->ca_walk_timer, due);
+}
+
+static void
+client_actor_walk_start(struct client_actor *ca, unsigned char *walk, unsigned int len)
+{
+
+	client_actor_walk_stop(ca, "interrupted");
+
+	ca->ca_walk = walk;
+	ca->ca_walk_len = len;
+	ca->ca_walk_pos = 0;
+	timerwheel_init(&ca->ca_walk_timer, client_actor_walk_timer, ca);
+	timerwheel_schedule(timers, &ca->ca_walk_timer, clock_ms());
+}
+
+static int
+action_actor_move(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	unsigned int actor_id;
+	int assigned, direction, error;
+	char name[10];
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "actor-move %d %9s", &actor_id, name);
+	if (assigned != 2) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-move actor-id north|south|east|west'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	direction = direction_parse(name);
+	if (direction < 0) {
+		remote_send(r, "sorry, no idea where's that\r\n");
+		return (0);
+	}
+
+	client_actor_walk_stop(ca, "interrupted");
+	error = client_actor_step(ca, direction);
+	if (error <= 0)
+		remote_send(r, "ok\r\n");
+	else if (error == 2)
+		remote_send(r, "sorry, someone's in the way\r\n");
+	else
+		remote_send(r, "sorry, can't go that way\r\n");
+	return (0);
+}
+
+struct actors_move {
+	unsigned int			am_id;
+	int				am_direction;
+};
+
+/*
+ * "actors-move ID:DIRECTION ID:DIRECTION ...", for clients running lots
+ * of actors: moves them one after another, in the given order, and replies
+ * with a single line: "ok, N moved", followed by "ID:REASON" for every move
+ * that failed, REASON being "unknown", "occupied" or "blocked".  If any
+ * of the moves can't be parsed, none of them are made.
+ */
+static int
+action_actors_move(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	struct actors_move *moves;
+	unsigned int i, nmoves = 0, moved = 0;
+	int off, error;
+	char name[10], *reply, *p;
+	size_t reply_len;
+	FILE *fp;
+
+	c = (struct client *)uptr;
+
+	p = str + strlen("actors-move");
+	moves = calloc(strlen(p) / 4 + 1, sizeof(*moves));
+	if (moves == NULL)
+		err(1, "calloc");
+	for (;;) {
+		while (*p == ' ')
+			p++;
+		if (*p == '\0')
+			break;
+		off = 0;
+		if (sscanf(p, "%u:%9[a-z]%n", &moves[nmoves].am_id, name, &off) != 2 ||
+		    (p[off] != ' ' && p[off] != '\0') ||
+		    (moves[nmoves].am_direction = direction_parse(name)) < 0) {
+			free(moves);
+			remote_send(r, "sorry, invalid usage; should be 'actors-move actor-id:direction ...'\r\n");
+			return (0);
+		}
+		nmoves++;
+		p += off;
+	}
+
+	fp = open_memstream(&reply, &reply_len);
+	if (fp == NULL)
+		err(1, "open_memstream");
+	for (i = 0; i < nmoves; i++) {
+		ca = client_actor_find(c, moves[i].am_id);
+		if (ca == NULL) {
+			fprintf(fp, " %d:unknown", moves[i].am_id);
+			continue;
+		}
+
+		client_actor_walk_stop(ca, "interrupted");
+		error = client_actor_step(ca, moves[i].am_direction);
+		if (error <= 0)
+			moved++;
+		else if (error == 2)
+			fprintf(fp, " %d:occupied", moves[i].am_id);
+		else
+			fprintf(fp, " %d:blocked", moves[i].am_id);
+	}
+	if (fclose(fp) != 0)
+		err(1, "open_memstream");
+	free(moves);
+
+	remote_send(r, "ok, %d moved%s\r\n", moved, reply);
+	free(reply);
+	return (0);
+}
+
+/*
+ * "actor-walk ID DIRECTION STEPS"; the reply comes right away, and once
+ * the actor stops, for whatever reason, the client gets
+ * "actor-stopped ID X Y done|blocked|interrupted".
+ */
+static int
+action_actor_walk(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	unsigned char *walk;
+	unsigned int actor_id, steps, i;
+	int assigned, direction;
+	char name[10];
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "actor-walk %d %9s %u", &actor_id, name, &steps);
+	if (assigned != 3) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-walk actor-id north|south|east|west steps'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	direction = direction_parse(name);
+	if (direction < 0) {
+		remote_send(r, "sorry, no idea where's that\r\n");
+		return (0);
+	}
+
+	if (steps < 1 || steps > ACTOR_WALK_MAX) {
+		remote_send(r, "sorry, can walk between 1 and %d steps\r\n", ACTOR_WALK_MAX);
+		return (0);
+	}
+
+	walk = malloc(steps);
+	if (walk == NULL)
+		err(1, "malloc");
+	for (i = 0; i < steps; i++)
+		walk[i] = direction;
+
+	remote_send(r, "ok\r\n");
+	client_actor_walk_start(ca, walk, steps);
+	return (0);
+}
+
+/*
+ * "actor-goto ID X Y"; like actor-walk, except the hub finds the way.
+ */
+static int
+action_actor_goto(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	const unsigned char *path;
+	unsigned char *walk;
+	unsigned int actor_id, x, y;
+	int assigned, len;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "actor-goto %d %d %d", &actor_id, &x, &y);
+	if (assigned != 3) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-goto actor-id x y'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	len = pathfinder_find(pathfinder, ca->ca_instance->i_map,
+	    map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor), x, y, &path);
+	if (len < 0) {
+		remote_send(r, "sorry, can't get there\r\n");
+		return (0);
+	}
+
+	remote_send(r, "ok, %d steps\r\n", len);
+	if (len == 0) {
+		client_actor_walk_stop(ca, "interrupted");
+		remote_send(r, "actor-stopped %d %d %d done\r\n", ca->ca_id,
+		    map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor));
+		return (0);
+	}
+
+	walk = malloc(len);
+	if (walk == NULL)
+		err(1, "malloc");
+	memcpy(walk, path, len);
+	client_actor_walk_start(ca, walk, len);
+	return (0);
+}
+
+/*
+ * "actor-walk-path ID DIRECTION...".
+ */
+static int
+action_actor_walk_path(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	unsigned char *walk;
+	unsigned int actor_id, steps = 0;
+	int assigned, direction, off;
+	char name[10];
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "actor-walk-path %d%n", &actor_id, &off);
+	if (assigned != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-walk-path actor-id direction...'\r\n");
+		return (0);
+	}
+	str += off;
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	walk = malloc(ACTOR_WALK_MAX);
+	if (walk == NULL)
+		err(1, "malloc");
+
+	while (sscanf(str, " %9s%n", name, &off) == 1) {
+		str += off;
+		direction = direction_parse(name);
+		if (direction < 0) {
+			remote_send(r, "sorry, no idea where's %s\r\n", name);
+			free(walk);
+			return (0);
+		}
+		if (steps == ACTOR_WALK_MAX) {
+			remote_send(r, "sorry, can walk at most %d steps\r\n", ACTOR_WALK_MAX);
+			free(walk);
+			return (0);
+		}
+		walk[steps++] = direction;
+	}
+
+	if (steps == 0) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-walk-path actor-id direction...'\r\n");
+		free(walk);
+		return (0);
+	}
+
+	remote_send(r, "ok\r\n");
+	client_actor_walk_start(ca, walk, steps);
+	return (0);
+}
+
+struct look {
+	struct client_actor	*l_viewer;
+	struct remote		*l_remote;
+	unsigned int		l_seen;
+};
+
+static void
+look_callback(struct actor *a, void *arg)
+{
+	struct look *l;
+	struct client_actor *ca;
+
+	l = arg;
+	ca = map_actor_get_uptr(a);
+	if (ca == l->l_viewer)
+		return;
+	if (!map_fov_visible(l->l_viewer->ca_fov, map_actor_get_x(a), map_actor_get_y(a)))
+		return;
+
+	remote_send(l->l_remote, "actor-at %d %d %d '%c'\r\n", ca->ca_id,
+	    map_actor_get_x(a), map_actor_get_y(a), ca->ca_char);
+	l->l_seen++;
+}
+
+/*
+ * "actor-look ID"; replies with actor-at for every actor in its line
+ * of sight, and then "ok, N actors".
+ */
+static int
+action_actor_look(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	struct look l;
+	unsigned int actor_id, x, y;
+	int assigned;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "actor-look %d", &actor_id);
+	if (assigned != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-look actor-id'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	if (ca->ca_fov == NULL)
+		ca->ca_fov = map_fov_new(ACTOR_SIGHT_RADIUS);
+	x = map_actor_get_x(ca->ca_actor);
+	y = map_actor_get_y(ca->ca_actor);
+	map_fov_update(ca->ca_instance->i_map, ca->ca_fov, x, y);
+
+	l.l_viewer = ca;
+	l.l_remote = r;
+	l.l_seen = 0;
+	map_actors_in_radius(ca->ca_instance->i_map, x, y, ACTOR_SIGHT_RADIUS, look_callback, &l);
+
+	remote_send(r, "ok, %d actors\r\n", l.l_seen);
+	return (0);
+}
+
+/*
+ * "npc-spawn COUNT 'X'".
+ */
+static int
+action_npc_spawn(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	unsigned int count, n, room;
+	int assigned;
+	char ch;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "npc-spawn %u '%c'", &count, &ch);
+	if (assigned != 2) {
+		remote_send(r, "sorry, invalid usage; should be 'npc-spawn count 'X''\r\n");
+		return (0);
+	}
+
+	room = npc_room(c->c_instance);
+	if (room == 0) {
+		remote_send(r, "sorry, no room left\r\n");
+		return (0);
+	}
+	if (count < 1 || count > room) {
+		remote_send(r, "sorry, room for between 1 and %d more\r\n", room);
+		return (0);
+	}
+
+	for (n = 0; n < count; n++) {
+		ca = npc_add(c->c_instance, ch);
+		if (ca == NULL)
+			break;
+		broadcast_actor_at(ca, false, 0, 0);
+	}
+
+	if (n == 0) {
+		remote_send(r, "sorry, no room left\r\n");
+		return (0);
+	}
+	remote_send(r, "ok, %d spawned\r\n", n);
+	return (0);
+}
+
+/*
+ * "actor-set ID NAME VALUE"; properties hold integers.
+ */
+static int
+action_actor_set(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	unsigned int actor_id;
+	long value;
+	int assigned, type;
+	char name[32];
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "actor-set %d %31s %ld", &actor_id, name, &value);
+	if (assigned != 3) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-set actor-id name value'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	type = property_register(name);
+	if (type < 0) {
+		remote_send(r, "sorry, can't use that name\r\n");
+		return (0);
+	}
+
+	*(long *)components_set(components, type, ca->ca_id) = value;
+	record_actor_set(ca, name, value);
+	remote_send(r, "ok\r\n");
+	return (0);
+}
+
+static int
+action_actor_get(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	unsigned int actor_id;
+	long *value = NULL;
+	int assigned, type;
+	char name[32];
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "actor-get %d %31s", &actor_id, name);
+	if (assigned != 2) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-get actor-id name'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	type = property_find(name);
+	if (type >= 0)
+		value = components_get(components, type, ca->ca_id);
+	if (value == NULL) {
+		remote_send(r, "sorry, no such property\r\n");
+		return (0);
+	}
+
+	remote_send(r, "ok, %ld\r\n", *value);
+	return (0);
+}
+
+static int
+action_actor_unset(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	unsigned int actor_id;
+	int assigned, type;
+	char name[32];
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "actor-unset %d %31s", &actor_id, name);
+	if (assigned != 2) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-unset actor-id name'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	type = property_find(name);
+	if (type < 0 || !components_remove(components, type, ca->ca_id)) {
+		remote_send(r, "sorry, no such property\r\n");
+		return (0);
+	}
+
+	record_actor_unset(ca, name);
+	remote_send(r, "ok\r\n");
+	return (0);
+}
+
+/*
+ * Replies with an "item ID 'C' NAME [container]" line for every item,
+ * starting from "it", and returns their number.
+ */
+static unsigned int
+send_items(struct remote *r, struct item *it)
+{
+	unsigned int n = 0;
+
+	for (; it != NULL; it = item_next(it)) {
+		remote_send(r, "item %d '%c' %s%s\r\n", item_get_id(it), item_get_char(it),
+		    item_get_name(it), item_is_container(it) ? " container" : "");
+		n++;
+	}
+
+	return (n);
+}
+
+/*
+ * Returns the item if the actor can reach it: it's in the actor's inventory,
+ * or lying where the actor stands, or inside a container that is.
+ * The inventory itself doesn't count.
+ */
+static struct item *
+client_actor_find_item(struct client_actor *ca, unsigned int item_id)
+{
+	struct item *it, *root, *inventory;
+	unsigned int x, y;
+
+	it = items_find(items, item_id);
+	if (it == NULL)
+		return (NULL);
+
+	inventory = client_actor_inventory(ca, false);
+	if (it == inventory)
+		return (NULL);
+	root = item_get_root(it);
+	if (root == inventory)
+		return (it);
+	if (item_get_position(root, &x, &y) == ca->ca_instance->i_items &&
+	    x == map_actor_get_x(ca->ca_actor) && y == map_actor_get_y(ca->ca_actor))
+		return (it);
+
+	return (NULL);
+}
+
+/*
+ * "item-new X Y 'C' NAME [container]".
+ */
+static int
+action_item_new(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct map *map;
+	struct item *it;
+	unsigned int x, y;
+	int assigned;
+	char ch, name[ITEM_NAME_MAX], kind[10];
+
+	c = (struct client *)uptr;
+	map = c->c_instance->i_map;
+
+	assigned = sscanf(str, "item-new %u %u '%c' %31s %9s", &x, &y, &ch, name, kind);
+	if (assigned < 4 || (assigned == 5 && strcmp(kind, "container") != 0)) {
+		remote_send(r, "sorry, invalid usage; should be 'item-new x y 'X' name [container]'\r\n");
+		return (0);
+	}
+
+	if (x >= map_get_width(map) || y >= map_get_height(map)) {
+		remote_send(r, "sorry, out of the map\r\n");
+		return (0);
+	}
+	if (map_get(map, x, y) != ' ') {
+		remote_send(r, "sorry, can't put it there\r\n");
+		return (0);
+	}
+	if (items_count(items) >= ITEMS_MAX) {
+		remote_send(r, "sorry, too many items\r\n");
+		return (0);
+	}
+
+	it = items_create(items, ch, name, assigned == 5);
+	item_drop(it, c->c_instance->i_items, x, y);
+	remote_send(r, "ok, %d\r\n", item_get_id(it));
+	return (0);
+}
+
+/*
+ * "item-list X Y"; replies with "item" lines, and then "ok, N items".
+ */
+static int
+action_item_list(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	unsigned int x, y, n;
+	int assigned;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "item-list %u %u", &x, &y);
+	if (assigned != 2) {
+		remote_send(r, "sorry, invalid usage; should be 'item-list x y'\r\n");
+		return (0);
+	}
+
+	n = send_items(r, item_floor_first(c->c_instance->i_items, x, y));
+	remote_send(r, "ok, %d items\r\n", n);
+	return (0);
+}
+
+static int
+action_item_inventory(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	struct item *inventory;
+	unsigned int actor_id, n = 0;
+	int assigned;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "item-inventory %d", &actor_id);
+	if (assigned != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'item-inventory actor-id'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	inventory = client_actor_inventory(ca, false);
+	if (inventory != NULL)
+		n = send_items(r, item_first(inventory));
+	remote_send(r, "ok, %d items\r\n", n);
+	return (0);
+}
+
+static int
+action_item_contents(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	struct item *it;
+	unsigned int actor_id, item_id, n;
+	int assigned;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "item-contents %d %d", &actor_id, &item_id);
+	if (assigned != 2) {
+		remote_send(r, "sorry, invalid usage; should be 'item-contents actor-id item-id'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	it = client_actor_find_item(ca, item_id);
+	if (it == NULL) {
+		remote_send(r, "sorry, can't reach that\r\n");
+		return (0);
+	}
+	if (!item_is_container(it)) {
+		remote_send(r, "sorry, that's not a container\r\n");
+		return (0);
+	}
+
+	n = send_items(r, item_first(it));
+	remote_send(r, "ok, %d items\r\n", n);
+	return (0);
+}
+
+static int
+action_item_pickup(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	struct item *it;
+	unsigned int actor_id, item_id;
+	int assigned;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "item-pickup %d %d", &actor_id, &item_id);
+	if (assigned != 2) {
+		remote_send(r, "sorry, invalid usage; should be 'item-pickup actor-id item-id'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	it = client_actor_find_item(ca, item_id);
+	if (it == NULL) {
+		remote_send(r, "sorry, can't reach that\r\n");
+		return (0);
+	}
+
+	if (!item_put(it, client_actor_inventory(ca, true))) {
+		remote_send(r, "sorry, won't fit\r\n");
+		return (0);
+	}
+
+	remote_send(r, "ok\r\n");
+	return (0);
+}
+
+static int
+action_item_drop(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	struct item *it;
+	unsigned int actor_id, item_id;
+	int assigned;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "item-drop %d %d", &actor_id, &item_id);
+	if (assigned != 2) {
+		remote_send(r, "sorry, invalid usage; should be 'item-drop actor-id item-id'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	it = client_actor_find_item(ca, item_id);
+	if (it == NULL) {
+		remote_send(r, "sorry, can't reach that\r\n");
+		return (0);
+	}
+
+	item_drop(it, ca->ca_instance->i_items, map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor));
+	remote_send(r, "ok\r\n");
+	return (0);
+}
+
+/*
+ * "item-put ACTOR-ID ITEM-ID CONTAINER-ID".
+ */
+static int
+action_item_put(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	struct item *it, *container;
+	unsigned int actor_id, item_id, container_id;
+	int assigned;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "item-put %d %d %d", &actor_id, &item_id, &container_id);
+	if (assigned != 3) {
+		remote_send(r, "sorry, invalid usage; should be 'item-put actor-id item-id container-id'\r\n");
+		return (0);
+	}
+
+	ca = client_actor_find(c, actor_id);
+	if (ca == NULL) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
+
+	it = client_actor_find_item(ca, item_id);
+	container = client_actor_find_item(ca, container_id);
+	if (it == NULL || container == NULL) {
+		remote_send(r, "sorry, can't reach that\r\n");
+		return (0);
+	}
+	if (!item_is_container(container)) {
+		remote_send(r, "sorry, that's not a container\r\n");
+		return (0);
+	}
+
+	if (!item_put(it, container)) {
+		remote_send(r, "sorry, won't fit\r\n");
+		return (0);
+	}
+
+	remote_send(r, "ok\r\n");
+	return (0);
+}
+
+static int
+action_map_get_size(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct map *map;
+
+	c = (struct client *)uptr;
+	map = c->c_instance->i_map;
+
+	remote_send(r, "ok, %d %d %lu\r\n", map_get_width(map), map_get_height(map), map_get_version(map));
+	return (0);
+}
+
+static int
+action_map_get(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct map *map;
+	unsigned int x, y;
+	int assigned;
+	char ch;
+
+	c = (struct client *)uptr;
+	map = c->c_instance->i_map;
+
+	assigned = sscanf(str, "map-get %d %d", &x, &y);
+	if (assigned != 2) {
+		remote_send(r, "sorry, invalid usage; should be 'map-get x y'\r\n");
+		return (0);
+	}
+	if (x >= map_get_width(map)) {
+		remote_send(r, "sorry, too large x\r\n");
+		return (0);
+	}
+	if (y >= map_get_height(map)) {
+		remote_send(r, "sorry, too large y\r\n");
+		return (0);
+	}
+	ch = map_get(map, x, y);
+	assert(ch != '\0');
+	remote_send(r, "ok, '%c'\r\n", ch);
+	return (0);
+}
+
+static void
+instance_map_put(struct instance *i, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const char *cells)
+{
+	unsigned int cy;
+
+	map_set_region(i->i_map, x, y, w, h, cells);
+	for (cy = 0; cy < h; cy++)
+		record_map_put(i, x, y + cy, cells + w * cy, w);
+}
+
+/*
+ * Reply with an error; if the client is in the middle of a batch,
+ * the whole batch is going to be discarded.
+ */
+static int
+map_edit_sorry(struct remote *r, struct client *c, const char *reason)
+{
+
+	remote_send(r, "sorry, %s\r\n", reason);
+	if (c->c_batching)
+		c->c_batch_errors++;
+	return (0);
+}
+
+/*
+ * Apply the edit, or queue it if the client is batching.  Takes ownership
+ * of 'cells'.  Queued edits don't get replies.
+ */
+static int
+map_edit(struct remote *r, struct client *c, unsigned int x, unsigned int y, unsigned int w, unsigned int h, char *cells)
+{
+	struct map *map;
+	struct map_edit *me;
+
+	map = c->c_instance->i_map;
+	if (w == 0 || h == 0 || x >= map_get_width(map) || y >= map_get_height(map) ||
+	    w > map_get_width(map) - x || h > map_get_height(map) - y) {
+		free(cells);
+		return (map_edit_sorry(r, c, "out of the map"));
+	}
+
+	if (!c->c_batching) {
+		instance_map_put(c->c_instance, x, y, w, h, cells);
+		free(cells);
+		remote_send(r, "ok\r\n");
+		return (0);
+	}
+
+	if (c->c_batch_cells + (size_t)w * h > MAP_BATCH_CELLS_MAX) {
+		free(cells);
+		return (map_edit_sorry(r, c, "batch too large"));
+	}
+
+	me = calloc(1, sizeof(*me));
+	if (me == NULL)
+		err(1, "calloc");
+	me->me_x = x;
+	me->me_y = y;
+	me->me_w = w;
+	me->me_h = h;
+	me->me_cells = cells;
+	c->c_batch_cells += (size_t)w * h;
+	STAILQ_INSERT_TAIL(&c->c_batch, me, me_next);
+
+	return (0);
+}
+
+static void
+map_batch_discard(struct client *c)
+{
+	struct map_edit *me;
+
+	while ((me = STAILQ_FIRST(&c->c_batch)) != NULL) {
+		STAILQ_REMOVE_HEAD(&c->c_batch, me_next);
+		free(me->me_cells);
+		free(me);
+	}
+	c->c_batching = false;
+	c->c_batch_errors = 0;
+	c->c_batch_cells = 0;
+}
+
+static char *
+cells_new(char ch, size_t len)
+{
+	char *cells;
+
+	cells = malloc(len);
+	if (cells == NULL)
+		err(1, "malloc");
+	memset(cells, ch, len);
+
+	return (cells);
+}
+
+static int
+action_map_set(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	unsigned int x, y;
+	int assigned, off = 0;
+
+	c = (struct client *)uptr;
+
+	/*
+	 * Don't let sscanf(3) skip whitespace before the cell; it could be a space.
+	 */
+	assigned = sscanf(str, "map-set %d %d%n", &x, &y, &off);
+	if (assigned != 2 || str[off] != ' ' || str[off + 1] == '\0')
+		return (map_edit_sorry(r, c, "invalid usage; should be 'map-set x y ch'"));
+
+	return (map_edit(r, c, x, y, 1, 1, cells_new(str[off + 1], 1)));
+}
+
+static int
+action_map_fill(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	unsigned int x, y, w, h;
+	int assigned, off = 0;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "map-fill %d %d %d %d%n", &x, &y, &w, &h, &off);
+	if (assigned != 4 || str[off] != ' ' || str[off + 1] == '\0')
+		return (map_edit_sorry(r, c, "invalid usage; should be 'map-fill x y w h ch'"));
+	if (w == 0 || h == 0 || w > MAP_BATCH_CELLS_MAX / h)
+		return (map_edit_sorry(r, c, "out of the map"));
+
+	return (map_edit(r, c, x, y, w, h, cells_new(str[off + 1], (size_t)w * h)));
+}
+
+static int
+action_map_put_region(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	unsigned int x, y, w, h;
+	int assigned, off = 0;
+	char *cells;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "map-put-region %d %d %d %d%n", &x, &y, &w, &h, &off);
+	if (assigned != 4 || str[off] != ' ')
+		return (map_edit_sorry(r, c, "invalid usage; should be 'map-put-region x y w h rle-data'"));
+	if (w == 0 || h == 0 || w > MAP_BATCH_CELLS_MAX / h)
+		return (map_edit_sorry(r, c, "out of the map"));
+
+	cells = rle_decode(str + off + 1, (size_t)w * h);
+	if (cells == NULL)
+		return (map_edit_sorry(r, c, "invalid rle-data"));
+
+	return (map_edit(r, c, x, y, w, h, cells));
+}
+
+static int
+action_map_batch_begin(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+
+	c = (struct client *)uptr;
+
+	if (c->c_batching) {
+		remote_send(r, "sorry, already batching\r\n");
+		return (0);
+	}
+
+	c->c_batching = true;
+	remote_send(r, "ok\r\n");
+	return (0);
+}
+
+/*
+ * Apply all the queued edits at once; the clients will get a single
+ * map update for all of them.
+ */
+static int
+action_map_batch_end(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct map_edit *me;
+	unsigned int edits = 0;
+
+	c = (struct client *)uptr;
+
+	if (!c->c_batching) {
+		remote_send(r, "sorry, not batching\r\n");
+		return (0);
+	}
+
+	if (c->c_batch_errors > 0) {
+		remote_send(r, "sorry, batch discarded due to %d invalid edits\r\n", c->c_batch_errors);
+		map_batch_discard(c);
+		return (0);
+	}
+
+	STAILQ_FOREACH(me, &c->c_batch, me_next) {
+		instance_map_put(c->c_instance, me->me_x, me->me_y, me->me_w, me->me_h, me->me_cells);
+		edits++;
+	}
+	map_batch_discard(c);
+
+	remote_send(r, "ok, %d edits\r\n", edits);
+	return (0);
+}
+
+static int
+action_map_get_line(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct map *map;
+	unsigned int y;
+	int assigned;
+	char *line;
+
+	c = (struct client *)uptr;
+	map = c->c_instance->i_map;
+
+	assigned = sscanf(str, "map-get-line %d", &y);
+	if (assigned != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'map-get-line y'\r\n");
+		return (0);
+	}
+	if (y >= map_get_height(map)) {
+		remote_send(r, "sorry, too large y\r\n");
+		return (0);
+	}
+	line = map_line(map, y, 0, map_get_width(map) - 1);
+	remote_send(r, "ok, %s\r\n", line);
+	free(line);
+	return (0);
+}
+
+static int
+action_map_changes_since(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct map *map;
+	unsigned long version;
+	unsigned int y;
+	int assigned;
+	char *line;
+
+	c = (struct client *)uptr;
+	map = c->c_instance->i_map;
+
+	assigned = sscanf(str, "map-changes-since %lu", &version);
+	if (assigned != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'map-changes-since version'\r\n");
+		return (0);
+	}
+
+	for (y = 0; y < map_get_height(map); y++) {
+		if (map_get_row_version(map, y) <= version)
+			continue;
+		line = map_line(map, y, 0, map_get_width(map) - 1);
+		remote_send(r, "map-delta %lu 0 %d %s\r\n", map_get_version(map), y, line);
+		free(line);
+	}
+	remote_send(r, "ok, %lu\r\n", map_get_version(map));
+	return (0);
+}
+
+struct blast_victims {
+	struct blast		*bv_blast;
+	struct client_actor	**bv_npcs;
+	unsigned int		bv_len;
+	unsigned int		bv_size;
+};
+
+static void
+blast_victims_callback(struct actor *a, void *arg)
+{
+	struct blast_victims *bv;
+	struct client_actor *ca;
+
+	bv = arg;
+	ca = map_actor_get_uptr(a);
+	if (!ca->ca_npc || !blast_contains(bv->bv_blast, map_actor_get_x(a), map_actor_get_y(a)))
+		return;
+
+	if (bv->bv_len == bv->bv_size) {
+		bv->bv_size = bv->bv_size > 0 ? bv->bv_size * 2 : 64;
+		bv->bv_npcs = realloc(bv->bv_npcs, bv->bv_size * sizeof(*bv->bv_npcs));
+		if (bv->bv_npcs == NULL)
+			err(1, "realloc");
+	}
+	bv->bv_npcs[bv->bv_len++] = ca;
+}
+
+/*
+ * Timer callback; sets off the bomb, and everything that goes off with it.
+ */
+static void
+bomb_explode(void *arg)
+{
+	TAILQ_HEAD(, bomb) going;
+	struct blast_victims bv;
+	struct bomb *b, *tmp;
+	struct instance *i;
+	struct item *it;
+	unsigned int x, y, w, h, cx, cy;
+	char *line;
+
+	b = arg;
+	i = b->b_instance;
+	if (i->i_blast == NULL)
+		i->i_blast = blast_new(i->i_map);
+
+	/*
+	 * In waves: every bomb within the footprint of the ones that have
+	 * just gone off goes off next.
+	 */
+	TAILQ_INIT(&going);
+	TAILQ_REMOVE(&i->i_bombs, b, b_next);
+	TAILQ_INSERT_TAIL(&going, b, b_next);
+	while (!TAILQ_EMPTY(&going)) {
+		while ((b = TAILQ_FIRST(&going)) != NULL) {
+			TAILQ_REMOVE(&going, b, b_next);
+			blast_add(i->i_blast, b->b_x, b->b_y, b->b_radius);
+			timerwheel_cancel(timers, &b->b_timer);
+			i->i_nbombs--;
+			free(b);
+		}
+		TAILQ_FOREACH_SAFE(b, &i->i_bombs, b_next, tmp) {
+			if (!blast_contains(i->i_blast, b->b_x, b->b_y))
+				continue;
+			TAILQ_REMOVE(&i->i_bombs, b, b_next);
+			TAILQ_INSERT_TAIL(&going, b, b_next);
+		}
+	}
+
+	if (!blast_get_rect(i->i_blast, &x, &y, &w, &h))
+		return;
+
+	memset(&bv, 0, sizeof(bv));
+	bv.bv_blast = i->i_blast;
+	map_actors_in_rect(i->i_map, x, y, w, h, blast_victims_callback, &bv);
+	while (bv.bv_len > 0) {
+		broadcast_actor_gone(bv.bv_npcs[--bv.bv_len]);
+		client_actor_remove(bv.bv_npcs[bv.bv_len]);
+	}
+	free(bv.bv_npcs);
+
+	for (cy = y; cy < y + h; cy++) {
+		for (cx = x; cx < x + w; cx++) {
+			if (!blast_contains(i->i_blast, cx, cy))
+				continue;
+			while ((it = item_floor_first(i->i_items, cx, cy)) != NULL)
+				items_destroy(items, it);
+		}
+	}
+
+	if (blast_apply(i->i_blast, ' ') > 0) {
+		for (cy = y; cy < y + h; cy++) {
+			line = map_line(i->i_map, cy, x, x + w - 1);
+			record_map_put(i, x, cy, line, w);
+			free(line);
+		}
+	}
+	blast_clear(i->i_blast);
+}
+
+/*
+ * "bomb-plant X Y RADIUS FUSE", with the fuse in milliseconds.
+ */
+static int
+action_bomb_plant(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct instance *i;
+	struct bomb *b;
+	unsigned int x, y, radius, fuse;
+	int assigned;
+
+	c = (struct client *)uptr;
+	i = c->c_instance;
+
+	assigned = sscanf(str, "bomb-plant %u %u %u %u", &x, &y, &radius, &fuse);
+	if (assigned != 4) {
+		remote_send(r, "sorry, invalid usage; should be 'bomb-plant x y radius fuse'\r\n");
+		return (0);
+	}
+
+	if (x >= map_get_width(i->i_map) || y >= map_get_height(i->i_map)) {
+		remote_send(r, "sorry, out of the map\r\n");
+		return (0);
+	}
+	if (map_get(i->i_map, x, y) != ' ') {
+		remote_send(r, "sorry, can't put it there\r\n");
+		return (0);
+	}
+	if (radius < 1 || radius > BOMB_RADIUS_MAX) {
+		remote_send(r, "sorry, radius should be between 1 and %d\r\n", BOMB_RADIUS_MAX);
+		return (0);
+	}
+	if (fuse > BOMB_FUSE_MAX) {
+		remote_send(r, "sorry, fuse should be at most %d\r\n", BOMB_FUSE_MAX);
+		return (0);
+	}
+	if (i->i_nbombs >= BOMBS_MAX) {
+		remote_send(r, "sorry, too many bombs\r\n");
+		return (0);
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		err(1, "calloc");
+	b->b_instance = i;
+	b->b_x = x;
+	b->b_y = y;
+	b->b_radius = radius;
+	timerwheel_init(&b->b_timer, bomb_explode, b);
+	TAILQ_INSERT_TAIL(&i->i_bombs, b, b_next);
+	i->i_nbombs++;
+	timerwheel_schedule(timers, &b->b_timer, clock_ms() + fuse);
+
+	remote_send(r, "ok\r\n");
+	return (0);
+}
+
+/*
+ * Move the client, along with all its actors, into another instance.
+ * Returns false, with nothing changed, if there's no room there for all
+ * of them.
+ */
+static bool
+client_enter(struct client *c, struct instance *i)
+{
+	struct instance *old;
+	struct client_actor *ca;
+	struct actor **placed;
+	unsigned int n = 0;
+
+	TAILQ_FOREACH(ca, &c->c_actors, ca_client_next)
+		n++;
+	placed = calloc(n + 1, sizeof(*placed));
+	if (placed == NULL)
+		err(1, "calloc");
+
+	/*
+	 * Find room for everyone before moving anyone.
+	 */
+	n = 0;
+	TAILQ_FOREACH(ca, &c->c_actors, ca_client_next) {
+		placed[n] = instance_actor_new(i);
+		if (placed[n] == NULL) {
+			while (n > 0)
+				map_actor_delete(placed[--n]);
+			free(placed);
+			return (false);
+		}
+		map_actor_set_uptr(placed[n++], ca);
+	}
+
+	old = c->c_instance;
+	c->c_instance = i;
+	i->i_clients++;
+	map_watch_delete(c->c_watch);
+	c->c_watch = map_watch_new(i->i_map, c);
+
+	n = 0;
+	TAILQ_FOREACH(ca, &c->c_actors, ca_client_next) {
+		if (ca->ca_departure != NULL)
+			region_departure_cancel(ca->ca_departure);
+		client_actor_walk_stop(ca, "interrupted");
+		broadcast_actor_gone(ca);
+		record_actor_remove(ca);
+		map_actor_delete(ca->ca_actor);
+		ca->ca_actor = placed[n++];
+		ca->ca_instance = i;
+		record_actor_new(ca);
+		record_actor_properties(ca);
+		client_actor_publish(ca);
+		region_mirror(ca);
+		broadcast_actor_at(ca, false, 0, 0);
+	}
+	free(placed);
+	/*
+	 * Whatever was still queued is about the old instance.
+	 */
+	c->c_frame_len = 0;
+	client_view_changed(c, NULL);
+
+	instance_release(old);
+	return (true);
+}
+
+static int
+action_instance_new(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct instance *i, *template;
+	unsigned int template_id;
+	int assigned;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "instance-new %d", &template_id);
+	if (assigned == 1) {
+		template = instance_find(template_id);
+		if (template == NULL || !template->i_template) {
+			remote_send(r, "sorry, no such template\r\n");
+			return (0);
+		}
+	} else {
+		template = instance_find_template();
+		if (template == NULL) {
+			remote_send(r, "sorry, no templates\r\n");
+			return (0);
+		}
+	}
+
+	i = instance_new(map_new_instance(template->i_map), false);
+	if (!client_enter(c, i)) {
+		/*
+		 * Nobody else knows about it yet.
+		 */
+		i->i_clients++;
+		instance_release(i);
+		remote_send(r, "sorry, no room there\r\n");
+		return (0);
+	}
+	remote_send(r, "ok, %d\r\n", i->i_id);
+	return (0);
+}
+
+static int
+action_instance_enter(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct instance *i;
+	unsigned int instance_id;
+	int assigned;
+
+	c = (struct client *)uptr;
+
+	assigned = sscanf(str, "instance-enter %d", &instance_id);
+	if (assigned != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'instance-enter instance-id'\r\n");
+		return (0);
+	}
+
+	i = instance_find(instance_id);
+	if (i == NULL) {
+		remote_send(r, "sorry, no such instance\r\n");
+		return (0);
+	}
+	if (i->i_template) {
+		remote_send(r, "sorry, templates are read-only\r\n");
+		return (0);
+	}
+	if (i == c->c_instance) {
+		remote_send(r, "sorry, you're already there\r\n");
+		return (0);
+	}
+
+	if (!client_enter(c, i)) {
+		remote_send(r, "sorry, no room there\r\n");
+		return (0);
+	}
+	remote_send(r, "ok\r\n");
+	return (0);
+}
+
+static int
+action_bye(struct remote *r, char *str, char **uptr)
+{
+
+	remote_send(r, "ok, see you next time\r\n");
+	/*
+	 * Close the socket, so that the select() will notice
+	 * and delete the client.
+	 */
+#if 0
+	/*
+	 * XXX: Nope, doesn't work.
+	 */
+	close(c->c_fd);
+#endif
+	return (0);
+}
+
+static int
+action_viewport(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_view old_view, v;
+	int assigned;
+
+	c = (struct client *)uptr;
+
+	client_get_view(c, &old_view);
+	if (strcmp(str, "viewport auto") == 0) {
+		c->c_view_explicit = false;
+	} else {
+		assigned = sscanf(str, "viewport %u %u %u %u", &v.v_x, &v.v_y, &v.v_w, &v.v_h);
+		if (assigned != 4) {
+			remote_send(r, "sorry, invalid usage; should be 'viewport x y width height' or 'viewport auto'\r\n");
+			return (0);
+		}
+		c->c_view_explicit = true;
+		c->c_view = v;
+	}
+
+	remote_send(r, "ok\r\n");
+	client_view_changed(c, &old_view);
+	return (0);
+}
+
+/*
+ * "subscribe"; for those who only watch, such as fwkrelay.  The client gets
+ * told about all the actors in the instance, and from then on about whatever
+ * happens there, the way any client without actors does.
+ */
+static int
+action_subscribe(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+
+	c = (struct client *)uptr;
+
+	if (!TAILQ_EMPTY(&c->c_actors)) {
+		remote_send(r, "sorry, subscribers can't have actors\r\n");
+		return (0);
+	}
+
+	c->c_view_explicit = false;
+	remote_send(r, "ok\r\n");
+	client_view_changed(c, NULL);
+	return (0);
+}
+
+static int
+action_say(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+
+	TAILQ_FOREACH(c, &clients, c_next) {
+		/*
+		 * XXX: Validate the string somehow.
+		 */
+		remote_send(c->c_remote, "%s\r\n", str);
+	}
+	return (0);
+}
+
+/*
+ * "hub-load"; replies with the current degradation level, and how busy
+ * the hub was over the last measurement window.
+ */
+static int
+action_hub_load(struct remote *r, char *str, char **uptr)
+{
+
+	remote_send(r, "ok, level %d, %d%% busy\r\n", load_level, load_percent);
+	return (0);
+}
+
+static int
+action_session(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+
+	c = (struct client *)uptr;
+
+	remote_send(r, "ok, %s\r\n", c->c_session);
+	return (0);
+}
+
+/*
+ * "session-resume TOKEN"; take over the actors of a session that was
+ * there before the hub restarted, and the session itself.  Replies with
+ * their IDs.
+ */
+static int
+action_session_resume(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	struct client_view old_view;
+	char token[SESSION_TOKEN_LEN + 1], *reply;
+	size_t reply_len;
+	unsigned int n = 0;
+	FILE *fp;
+
+	c = (struct client *)uptr;
+
+	if (sscanf(str, "session-resume %16s", token) != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'session-resume token'\r\n");
+		return (0);
+	}
+	if (!TAILQ_EMPTY(&c->c_actors)) {
+		remote_send(r, "sorry, you already have actors\r\n");
+		return (0);
+	}
+	if (c->c_instance != world) {
+		remote_send(r, "sorry, you're not in the world\r\n");
+		return (0);
+	}
+
+	client_get_view(c, &old_view);
+	fp = open_memstream(&reply, &reply_len);
+	if (fp == NULL)
+		err(1, "open_memstream");
+	TAILQ_FOREACH(ca, &actors, ca_next) {
+		if (!ca->ca_restored || strcmp(ca->ca_session, token) != 0)
+			continue;
+		ca->ca_restored = false;
+		ca->ca_client = c;
+		TAILQ_INSERT_TAIL(&c->c_actors, ca, ca_client_next);
+		fprintf(fp, "%s%d", n > 0 ? " " : "", ca->ca_id);
+		n++;
+	}
+	if (fclose(fp) != 0)
+		err(1, "open_memstream");
+
+	if (n == 0) {
+		remote_send(r, "sorry, nothing to resume\r\n");
+	} else {
+		strlcpy(c->c_session, token, sizeof(c->c_session));
+		remote_send(r, "ok, %s\r\n", reply);
+		if (!c->c_view_explicit)
+			client_view_changed(c, &old_view);
+	}
+	free(reply);
+	return (0);
+}
+
+/*
+ * Timer callback; whatever was restored from the journal, and not claimed
+ * since, goes away.
+ */
+static void
+restore_timer_fired(void *arg)
+{
+	struct client_actor *ca, *tmp;
+
+	TAILQ_FOREACH_SAFE(ca, &actors, ca_next, tmp) {
+		if (!ca->ca_restored)
+			continue;
+		broadcast_actor_gone(ca);
+		client_actor_remove(ca);
+	}
+}
+
+static int
+action_unknown(struct remote *r, char *str, char **uptr)
+{
+
+	remote_send(r, "sorry, no idea what you mean\r\n");
+	return (0);
+}
+
+static struct client_actor *
+region_ghost_find(unsigned int id)
+{
+	struct client_actor *ca;
+
+	TAILQ_FOREACH(ca, &region_ghosts, ca_next) {
+		if (ca->ca_id == id)
+			return (ca);
+	}
+
+	return (NULL);
+}
+
+static void
+region_ghost_free(struct client_actor *ca)
+{
+
+	broadcast_actor_gone(ca);
+	TAILQ_REMOVE(&region_ghosts, ca, ca_next);
+	map_actor_delete(ca->ca_actor);
+	free(ca);
+}
+
+/*
+ * Whether the cell is on the far side of the border with the neighbour
+ * on that side, where its ghosts may be.
+ */
+static bool
+region_beyond(int side, unsigned int x, unsigned int y)
+{
+
+	if (x >= map_get_width(world->i_map) || y >= map_get_height(world->i_map))
+		return (false);
+	if (side == REGION_WEST)
+		return (x < region_x0);
+	return (x >= region_x1);
+}
+
+/*
+ * "region-hello REGION"; the neighbour introduces itself.
+ */
+static int
+action_region_hello(struct remote *r, char *str, char **uptr)
+{
+	struct region_link *rl;
+	int k;
+
+	rl = (struct region_link *)uptr;
+
+	if (sscanf(str, "region-hello %d", &k) != 1) {
+		warnx("region: invalid hello '%s'", str);
+		return (0);
+	}
+	if (k == (int)region - 1)
+		rl->rl_side = REGION_WEST;
+	else if (k == (int)region + 1)
+		rl->rl_side = REGION_EAST;
+	else
+		warnx("region: hello from region %d, which is not a neighbour", k);
+
+	return (0);
+}
+
+/*
+ * "region-actor-at ID X Y 'C'"; the ghost shows up, or moves.
+ */
+static int
+action_region_actor_at(struct remote *r, char *str, char **uptr)
+{
+	struct region_link *rl;
+	struct client_actor *ca;
+	unsigned int id, x, y, old_x = 0, old_y = 0;
+	bool moved;
+	char ch;
+
+	rl = (struct region_link *)uptr;
+
+	if (sscanf(str, "region-actor-at %d %d %d '%c'", &id, &x, &y, &ch) != 4 ||
+	    rl->rl_side < 0 || !region_beyond(rl->rl_side, x, y)) {
+		warnx("region: invalid '%s'", str);
+		return (0);
+	}
+
+	ca = region_ghost_find(id);
+	moved = ca != NULL;
+	if (map_actor_at(world->i_map, x, y) != NULL &&
+	    (ca == NULL || map_actor_at(world->i_map, x, y) != ca->ca_actor)) {
+		warnx("region: ghost %d stepped on someone at %d, %d", id, x, y);
+		return (0);
+	}
+
+	if (ca == NULL) {
+		ca = calloc(1, sizeof(*ca));
+		if (ca == NULL)
+			err(1, "calloc");
+		ca->ca_id = id;
+		ca->ca_instance = world;
+		ca->ca_ghost = true;
+		TAILQ_INSERT_TAIL(&region_ghosts, ca, ca_next);
+	} else {
+		old_x = map_actor_get_x(ca->ca_actor);
+		old_y = map_actor_get_y(ca->ca_actor);
+		map_actor_delete(ca->ca_actor);
+	}
+	ca->ca_actor = map_actor_new_at(world->i_map, x, y);
+	map_actor_set_uptr(ca->ca_actor, ca);
+	ca->ca_char = ch;
+	broadcast_actor_at(ca, moved, old_x, old_y);
+
+	return (0);
+}
+
+static int
+action_region_actor_gone(struct remote *r, char *str, char **uptr)
+{
+	struct client_actor *ca;
+	unsigned int id;
+
+	if (sscanf(str, "region-actor-gone %d", &id) != 1) {
+		warnx("region: invalid '%s'", str);
+		return (0);
+	}
+
+	ca = region_ghost_find(id);
+	if (ca != NULL)
+		region_ghost_free(ca);
+
+	return (0);
+}
+
+/*
+ * The actor handed off here is still waiting for its owner; time to give up.
+ */
+static void
+region_arrival_expired(void *arg)
+{
+	struct region_arrival *ra;
+	struct client_actor *ca;
+
+	ra = arg;
+	ca = client_actor_find_by_id(ra->ra_id);
+	if (ca != NULL && ca->ca_client == NULL) {
+		broadcast_actor_gone(ca);
+		client_actor_remove(ca);
+	}
+
+	TAILQ_REMOVE(&region_arrivals, ra, ra_next);
+	free(ra);
+}
+
+/*
+ * "region-handoff TOKEN X Y 'C' NAME [PROPERTY VALUE]..."; unless there's
+ * no room for it, the actor is ours now, waiting for its owner to claim it
+ * with the token.  Either way, the neighbour gets told.
+ */
+static int
+action_region_handoff(struct remote *r, char *str, char **uptr)
+{
+	struct region_link *rl;
+	struct region_arrival *ra;
+	struct client_actor *ca;
+	struct actor *a;
+	unsigned int x, y;
+	long value;
+	int assigned, off = 0, type;
+	char token[REGION_TOKEN_LEN + 1], ch, name[32], *p;
+
+	rl = (struct region_link *)uptr;
+	rl->rl_handoff = -1;
+
+	assigned = sscanf(str, "region-handoff %16s %d %d '%c' %31s%n", token, &x, &y, &ch, name, &off);
+	if (assigned != 5 || rl->rl_side < 0 || !region_owns(x) || y >= map_get_height(world->i_map)) {
+		warnx("region: invalid '%s'", str);
+		if (assigned >= 1)
+			remote_send(r, "region-handoff-refused %s\r\n", token);
+		return (0);
+	}
+
+	/*
+	 * Someone might have got there in the meantime.
+	 */
+	if (map_get(world->i_map, x, y) == ' ' && map_actor_at(world->i_map, x, y) == NULL)
+		a = map_actor_new_at(world->i_map, x, y);
+	else
+		a = instance_actor_new(world);
+	if (a == NULL) {
+		remote_send(r, "region-handoff-refused %s\r\n", token);
+		return (0);
+	}
+
+	ca = calloc(1, sizeof(*ca));
+	if (ca == NULL)
+		err(1, "calloc");
+
+	ca->ca_id = slotmap_alloc(actor_ids, ca);
+	ca->ca_actor = a;
+	map_actor_set_uptr(ca->ca_actor, ca);
+	ca->ca_instance = world;
+	ca->ca_char = ch;
+	ca->ca_name = strdup(name);
+	if (ca->ca_name == NULL)
+		err(1, "strdup");
+
+	for (p = str + off; sscanf(p, " %31s %ld%n", name, &value, &off) == 2; p += off) {
+		type = property_register(name);
+		if (type < 0) {
+			warnx("region: dropping property '%s' of actor %d", name, ca->ca_id);
+			continue;
+		}
+		*(long *)components_set(components, type, ca->ca_id) = value;
+	}
+
+	TAILQ_INSERT_TAIL(&actors, ca, ca_next);
+	client_actor_publish(ca);
+	region_mirror(ca);
+	broadcast_actor_at(ca, false, 0, 0);
+	rl->rl_handoff = ca->ca_id;
+	remote_send(r, "region-handoff-ok %s\r\n", token);
+
+	ra = calloc(1, sizeof(*ra));
+	if (ra == NULL)
+		err(1, "calloc");
+	strlcpy(ra->ra_token, token, sizeof(ra->ra_token));
+	ra->ra_id = ca->ca_id;
+	TAILQ_INSERT_TAIL(&region_arrivals, ra, ra_next);
+	timerwheel_init(&ra->ra_timer, region_arrival_expired, ra);
+	timerwheel_schedule(timers, &ra->ra_timer, clock_ms() + REGION_JOIN_TIMEOUT);
+
+	return (0);
+}
+
+/*
+ * "region-item DEPTH 'C' NAME [container]"; one more item of the inventory
+ * of the actor handed off last, as sent by region_send_items().
+ */
+static int
+action_region_item(struct remote *r, char *str, char **uptr)
+{
+	struct region_link *rl;
+	struct client_actor *ca;
+	struct item *container, *it;
+	unsigned int depth, d;
+	int assigned;
+	char ch, name[ITEM_NAME_MAX], kind[10];
+
+	rl = (struct region_link *)uptr;
+
+	/*
+	 * The actor didn't get handed off; its things stay with it.
+	 */
+	if (rl->rl_handoff < 0)
+		return (0);
+
+	assigned = sscanf(str, "region-item %u '%c' %31s %9s", &depth, &ch, name, kind);
+	if (assigned < 3 || (assigned == 4 && strcmp(kind, "container") != 0) ||
+	    depth < 1 || depth > ITEM_NESTING_MAX) {
+		warnx("region: invalid '%s'", str);
+		return (0);
+	}
+	ca = client_actor_find_by_id(rl->rl_handoff);
+	if (ca == NULL || items_count(items) >= ITEMS_MAX) {
+		warnx("region: dropping item '%s'", name);
+		return (0);
+	}
+
+	/*
+	 * Items get put in at the head, so the container one level up is
+	 * whatever came in last there; it leaves everything in reverse order,
+	 * which nothing cares about.
+	 */
+	container = client_actor_inventory(ca, true);
+	for (d = 1; d < depth && container != NULL; d++)
+		container = item_first(container);
+	it = items_create(items, ch, name, assigned == 4);
+	if (container == NULL || !item_put(it, container)) {
+		warnx("region: dropping item '%s'", name);
+		items_destroy(items, it);
+	}
+
+	return (0);
+}
+
+/*
+ * "region-map-put X Y CELLS"; a row of world cells edited elsewhere.
+ * It gets passed along further, unless nothing has changed.
+ */
+static int
+action_region_map_put(struct remote *r, char *str, char **uptr)
+{
+	struct region_link *rl;
+	unsigned int x, y;
+	size_t len;
+	int off = 0;
+	char *cells;
+
+	rl = (struct region_link *)uptr;
+
+	if (sscanf(str, "region-map-put %d %d%n", &x, &y, &off) != 2 || str[off] != ' ' ||
+	    rl->rl_side < 0 || y >= map_get_height(world->i_map)) {
+		warnx("region: invalid map-put");
+		return (0);
+	}
+
+	/*
+	 * Cells can be spaces, so don't let sscanf(3) skip them.
+	 */
+	cells = str + off + 1;
+	len = strlen(cells);
+	if (x < map_get_width(world->i_map) && len > map_get_width(world->i_map) - x)
+		len = map_get_width(world->i_map) - x;
+	if (map_set_region(world->i_map, x, y, len, 1, cells) > 0)
+		region_map_put(x, y, cells, len, rl->rl_side);
+
+	return (0);
+}
+
+static int
+action_region_unknown(struct remote *r, char *str, char **uptr)
+{
+
+	warnx("region: unexpected '%s'", str);
+	return (0);
+}
+
+static struct region_departure *
+region_departure_find(struct region_peer *rp, const char *token)
+{
+	struct region_departure *rd;
+
+	TAILQ_FOREACH(rd, &region_departures, rd_next) {
+		if (&region_peers[rd->rd_side] == rp && strcmp(rd->rd_token, token) == 0)
+			return (rd);
+	}
+
+	return (NULL);
+}
+
+/*
+ * "region-handoff-ok TOKEN", from the neighbour; the actor is not ours
+ * anymore, and neither is its inventory.  Its owner gets told where to find
+ * it, and the actor itself stays around until the end of the iteration,
+ * belonging to no one.
+ */
+static int
+action_region_handoff_ok(struct remote *r, char *str, char **uptr)
+{
+	struct region_peer *rp;
+	struct region_departure *rd;
+	struct client_actor *ca;
+	struct client *c;
+	struct item *inventory;
+	char token[REGION_TOKEN_LEN + 1];
+
+	rp = (struct region_peer *)uptr;
+
+	if (sscanf(str, "region-handoff-ok %16s", token) != 1 ||
+	    (rd = region_departure_find(rp, token)) == NULL) {
+		warnx("region: invalid '%s'", str);
+		return (0);
+	}
+
+	ca = rd->rd_ca;
+	TAILQ_REMOVE(&region_departures, rd, rd_next);
+	free(rd);
+	ca->ca_departure = NULL;
+
+	inventory = client_actor_inventory(ca, false);
+	if (inventory != NULL) {
+		items_destroy(items, inventory);
+		components_remove(components, inventory_component, ca->ca_id);
+	}
+
+	c = ca->ca_client;
+	remote_send(c->c_remote, "region-redirect %d %d %s\r\n", ca->ca_id, FAWORKEN_PORT + rp->rp_region, token);
+	broadcast_actor_gone(ca);
+	TAILQ_REMOVE(&c->c_actors, ca, ca_client_next);
+	client_watch_update(c);
+	ca->ca_client = NULL;
+	TAILQ_INSERT_TAIL(&region_leaving, ca, ca_client_next);
+
+	return (0);
+}
+
+/*
+ * "region-handoff-refused TOKEN", from the neighbour; the actor stays
+ * where it was, which its owner has to be told, having been told "ok".
+ */
+static int
+action_region_handoff_refused(struct remote *r, char *str, char **uptr)
+{
+	struct region_peer *rp;
+	struct region_departure *rd;
+	struct client_actor *ca;
+	char token[REGION_TOKEN_LEN + 1];
+
+	rp = (struct region_peer *)uptr;
+
+	if (sscanf(str, "region-handoff-refused %16s", token) != 1 ||
+	    (rd = region_departure_find(rp, token)) == NULL) {
+		warnx("region: invalid '%s'", str);
+		return (0);
+	}
+
+	ca = rd->rd_ca;
+	region_departure_cancel(rd);
+	send_actor_at(ca->ca_client, ca);
+	return (0);
+}
+
+/*
+ * "region-join TOKEN"; claim the actor handed off to this region.
+ */
+static int
+action_region_join(struct remote *r, char *str, char **uptr)
+{
+	struct client *c;
+	struct client_actor *ca;
+	struct client_view old_view;
+	struct region_arrival *ra;
+	char token[REGION_TOKEN_LEN + 1];
+
+	c = (struct client *)uptr;
+
+	if (sscanf(str, "region-join %16s", token) != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'region-join token'\r\n");
+		return (0);
+	}
+	if (c->c_instance != world) {
+		remote_send(r, "sorry, you're not in the world\r\n");
+		return (0);
+	}
+
+	TAILQ_FOREACH(ra, &region_arrivals, ra_next) {
+		if (strcmp(ra->ra_token, token) == 0)
+			break;
+	}
+	if (ra == NULL) {
+		remote_send(r, "sorry, invalid token\r\n");
+		return (0);
+	}
+	ca = client_actor_find_by_id(ra->ra_id);
+	timerwheel_cancel(timers, &ra->ra_timer);
+	TAILQ_REMOVE(&region_arrivals, ra, ra_next);
+	free(ra);
+	if (ca == NULL || ca->ca_client != NULL) {
+		remote_send(r, "sorry, invalid token\r\n");
+		return (0);
+	}
 
-static TAILQ_HEAD(, client)		clients;
-static TAILQ_HEAD(, client_actor)	actors;
-static struct map			*map;
+	client_get_view(c, &old_view);
+	ca->ca_client = c;
+	TAILQ_INSERT_TAIL(&c->c_actors, ca, ca_client_next);
+	remote_send(r, "ok, your ID is %d\r\n", ca->ca_id);
 
-static unsigned int
-client_actor_allocate_id(void)
+	if (!c->c_view_explicit && ca == TAILQ_FIRST(&c->c_actors))
+		client_view_changed(c, &old_view);
+
+	return (0);
+}
+
+/*
+ * Timer callback; (re)connect to the neighbour, and bring it up to date:
+ * it gets our strip of the map, and our actors close to its border.
+ */
+static void
+region_peer_timer(void *arg)
 {
+	struct region_peer *rp;
 	struct client_actor *ca;
-	unsigned int max_id = 0;
+	struct sockaddr_in sin;
+	unsigned int y;
+	char *line;
+	int error;
 
-	TAILQ_FOREACH(ca, &actors, ca_next) {
-		if (ca->ca_id > max_id)
-			max_id = ca->ca_id;
+	rp = arg;
+
+	rp->rp_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (rp->rp_fd < 0)
+		err(1, "socket");
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(REGION_PEER_PORT + rp->rp_region);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	error = connect(rp->rp_fd, (struct sockaddr *)&sin, sizeof(sin));
+	if (error != 0) {
+		close(rp->rp_fd);
+		rp->rp_fd = -1;
+		timerwheel_schedule(timers, &rp->rp_timer, clock_ms() + REGION_RETRY);
+		return;
 	}
 
-	return (max_id + 1);
+	rp->rp_remote = remote_new(rp->rp_fd);
+	remote_expect(rp->rp_remote, "region-handoff-ok", action_region_handoff_ok, (char **)rp);
+	remote_expect(rp->rp_remote, "region-handoff-refused", action_region_handoff_refused, (char **)rp);
+	remote_expect(rp->rp_remote, "", action_region_unknown, (char **)rp);
+	remote_send(rp->rp_remote, "region-hello %d\r\n", region);
+	for (y = 0; y < map_get_height(world->i_map); y++) {
+		line = map_line(world->i_map, y, region_x0, region_x1 - 1);
+		remote_send(rp->rp_remote, "region-map-put %d %d %s\r\n", region_x0, y, line);
+		free(line);
+	}
+	TAILQ_FOREACH(ca, &actors, ca_next)
+		region_mirror(ca);
 }
 
-static unsigned int
-client_actor_add(struct client *c, char ch, const char *name)
+/*
+ * The neighbour is gone; the actors waiting for it to answer stay here.
+ */
+static void
+region_peer_lost(struct region_peer *rp)
 {
+	struct region_departure *rd, *tmp;
 	struct client_actor *ca;
+	int side;
 
-	ca = calloc(1, sizeof(*ca));
-	if (ca == NULL)
+	side = rp - region_peers;
+	TAILQ_FOREACH(ca, &actors, ca_next)
+		ca->ca_mirrored &= ~(1 << side);
+	TAILQ_FOREACH_SAFE(rd, &region_departures, rd_next, tmp) {
+		if (rd->rd_side != side)
+			continue;
+		ca = rd->rd_ca;
+		region_departure_cancel(rd);
+		send_actor_at(ca->ca_client, ca);
+	}
+
+	remote_delete(rp->rp_remote);
+	rp->rp_remote = NULL;
+	rp->rp_fd = -1;
+	timerwheel_schedule(timers, &rp->rp_timer, clock_ms() + REGION_RETRY);
+}
+
+static void
+region_link_add(int fd)
+{
+	struct region_link *rl;
+
+	rl = calloc(1, sizeof(*rl));
+	if (rl == NULL)
 		err(1, "calloc");
 
-	ca->ca_id = client_actor_allocate_id();
-	ca->ca_actor = map_actor_new(map);
-	ca->ca_client = c;
-	ca->ca_char = ch;
-	ca->ca_name = strdup(name);
-	if (ca->ca_name == NULL)
-		err(1, "strdup");
+	rl->rl_fd = fd;
+	rl->rl_remote = remote_new(fd);
+	rl->rl_side = -1;
+	rl->rl_handoff = -1;
+	TAILQ_INSERT_TAIL(&region_links, rl, rl_next);
 
-	TAILQ_INSERT_TAIL(&actors, ca, ca_next);
+	remote_expect(rl->rl_remote, "region-hello", action_region_hello, (char **)rl);
+	remote_expect(rl->rl_remote, "region-actor-at", action_region_actor_at, (char **)rl);
+	remote_expect(rl->rl_remote, "region-actor-gone", action_region_actor_gone, (char **)rl);
+	remote_expect(rl->rl_remote, "region-handoff", action_region_handoff, (char **)rl);
+	remote_expect(rl->rl_remote, "region-item", action_region_item, (char **)rl);
+	remote_expect(rl->rl_remote, "region-map-put", action_region_map_put, (char **)rl);
+	remote_expect(rl->rl_remote, "", action_region_unknown, (char **)rl);
+}
 
-	return (ca->ca_id);
+/*
+ * The neighbour is gone, and so are its ghosts.
+ */
+static void
+region_link_remove(struct region_link *rl)
+{
+	struct client_actor *ca, *tmp;
+
+	if (rl->rl_side >= 0) {
+		TAILQ_FOREACH_SAFE(ca, &region_ghosts, ca_next, tmp) {
+			if (region_beyond(rl->rl_side, map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor)))
+				region_ghost_free(ca);
+		}
+	}
+
+	TAILQ_REMOVE(&region_links, rl, rl_next);
+	remote_delete(rl->rl_remote);
+	free(rl);
 }
 
+/*
+ * Get rid of the actors handed off during this iteration.
+ */
 static void
-client_actor_remove(struct client_actor *ca)
+region_reap(void)
 {
+	struct client_actor *ca;
 
-	TAILQ_REMOVE(&actors, ca, ca_next);
-	map_actor_delete(ca->ca_actor);
-	free(ca->ca_name);
-	free(ca);
+	while ((ca = TAILQ_FIRST(&region_leaving)) != NULL) {
+		TAILQ_REMOVE(&region_leaving, ca, ca_client_next);
+		client_actor_remove(ca);
+	}
 }
 
-static struct client_actor *
-client_actor_find(struct client *c, unsigned int id)
+static void
+client_add(int fd)
+{
+	struct client *c;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		err(1, "calloc");
+
+	c->c_fd = fd;
+	c->c_remote = remote_new(fd);
+	snprintf(c->c_session, sizeof(c->c_session), "%08x%08x", arc4random(), arc4random());
+	TAILQ_INIT(&c->c_actors);
+	STAILQ_INIT(&c->c_batch);
+	c->c_instance = world;
+	world->i_clients++;
+	c->c_watch = map_watch_new(world->i_map, c);
+	client_watch_update(c);
+	TAILQ_INSERT_TAIL(&clients, c, c_next);
+
+	remote_expect(c->c_remote, "actor-new", action_actor_new, (char **)c);
+	remote_expect(c->c_remote, "actor-locate", action_actor_locate, (char **)c);
+	remote_expect(c->c_remote, "actor-move", action_actor_move, (char **)c);
+	remote_expect(c->c_remote, "actors-move", action_actors_move, (char **)c);
+	remote_expect(c->c_remote, "actor-walk", action_actor_walk, (char **)c);
+	remote_expect(c->c_remote, "actor-walk-path", action_actor_walk_path, (char **)c);
+	remote_expect(c->c_remote, "actor-goto", action_actor_goto, (char **)c);
+	remote_expect(c->c_remote, "actor-look", action_actor_look, (char **)c);
+	remote_expect(c->c_remote, "actor-set", action_actor_set, (char **)c);
+	remote_expect(c->c_remote, "actor-get", action_actor_get, (char **)c);
+	remote_expect(c->c_remote, "actor-unset", action_actor_unset, (char **)c);
+	remote_expect(c->c_remote, "npc-spawn", action_npc_spawn, (char **)c);
+	remote_expect(c->c_remote, "item-new", action_item_new, (char **)c);
+	remote_expect(c->c_remote, "item-list", action_item_list, (char **)c);
+	remote_expect(c->c_remote, "item-inventory", action_item_inventory, (char **)c);
+	remote_expect(c->c_remote, "item-contents", action_item_contents, (char **)c);
+	remote_expect(c->c_remote, "item-pickup", action_item_pickup, (char **)c);
+	remote_expect(c->c_remote, "item-drop", action_item_drop, (char **)c);
+	remote_expect(c->c_remote, "item-put", action_item_put, (char **)c);
+	remote_expect(c->c_remote, "bomb-plant", action_bomb_plant, (char **)c);
+	remote_expect(c->c_remote, "map-get-size", action_map_get_size, (char **)c);
+	remote_expect(c->c_remote, "map-get", action_map_get, (char **)c);
+	remote_expect(c->c_remote, "map-get-line", action_map_get_line, (char **)c);
+	remote_expect(c->c_remote, "map-changes-since", action_map_changes_since, (char **)c);
+	remote_expect(c->c_remote, "map-set", action_map_set, (char **)c);
+	remote_expect(c->c_remote, "map-fill", action_map_fill, (char **)c);
+	remote_expect(c->c_remote, "map-put-region", action_map_put_region, (char **)c);
+	remote_expect(c->c_remote, "map-batch-begin", action_map_batch_begin, (char **)c);
+	remote_expect(c->c_remote, "map-batch-end", action_map_batch_end, (char **)c);
+	remote_expect(c->c_remote, "instance-new", action_instance_new, (char **)c);
+	remote_expect(c->c_remote, "instance-enter", action_instance_enter, (char **)c);
+	remote_expect(c->c_remote, "viewport", action_viewport, (char **)c);
+	remote_expect(c->c_remote, "bye", action_bye, (char **)c);
+	remote_expect(c->c_remote, "say", action_say, (char **)c);
+	remote_expect(c->c_remote, "subscribe", action_subscribe, (char **)c);
+	remote_expect(c->c_remote, "session", action_session, (char **)c);
+	remote_expect(c->c_remote, "session-resume", action_session_resume, (char **)c);
+	remote_expect(c->c_remote, "hub-load", action_hub_load, (char **)c);
+	remote_expect(c->c_remote, "region-join", action_region_join, (char **)c);
+	remote_expect(c->c_remote, "", action_unknown, (char **)c);
+}
+
+static void
+client_remove(struct client *c)
 {
 	struct client_actor *ca;
 
-	TAILQ_FOREACH(ca, &actors, ca_next) {
-		if (ca->ca_client != c)
-			continue;
-		if (ca->ca_id != id)
-			continue;
-		return (ca);
+	while ((ca = TAILQ_FIRST(&c->c_actors)) != NULL) {
+		broadcast_actor_gone(ca);
+		client_actor_remove(ca);
+	}
+
+	map_batch_discard(c);
+	map_watch_delete(c->c_watch);
+	instance_release(c->c_instance);
+	TAILQ_REMOVE(&clients, c, c_next);
+	remote_delete(c->c_remote);
+	free(c->c_frame);
+	free(c);
+}
+
+static struct client *
+client_find_by_fd(int fd)
+{
+	struct client *c;
+
+	TAILQ_FOREACH(c, &clients, c_next) {
+		if (c->c_fd == fd)
+			return (c);
 	}
 
 	return (NULL);
 }
 
+/*
+ * Returns false if the client has to go.
+ */
+static bool
+client_receive(struct client *c)
+{
+
+	return (remote_process(c->c_remote));
+}
+
 static void
-broadcast_actor_at(struct client *c, unsigned int actor_id)
+world_dump(struct journal *j, void *arg)
 {
-	struct client *c2;
 	struct client_actor *ca;
-	unsigned int x, y;
+	struct map *map;
+	const unsigned int *ids;
+	const long *values;
+	unsigned int n, type, y, width, height;
+	char *line;
 
-	ca = client_actor_find(c, actor_id);
-	assert(ca != NULL);
+	map = world->i_map;
+	width = map_get_width(map);
+	height = map_get_height(map);
 
-	/*
-	 * Broadcast the news to the clients.
-	 */
-	x = map_actor_get_x(ca->ca_actor);
-	y = map_actor_get_y(ca->ca_actor);
-	TAILQ_FOREACH(c2, &clients, c_next) {
-		if (c == c2)
+	journal_append(j, "map-size %d %d\n", width, height);
+	for (y = 0; y < height; y++) {
+		line = map_line(map, y, 0, width - 1);
+		journal_append(j, "map-put 0 %d %s\n", y, line);
+		free(line);
+	}
+
+	TAILQ_FOREACH(ca, &actors, ca_next) {
+		if (ca->ca_instance != world || ca->ca_npc)
 			continue;
+		journal_append(j, "actor-new %d %d %d '%c' %s %s\n", ca->ca_id,
+		    map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor), ca->ca_char, ca->ca_name,
+		    client_actor_session(ca));
+	}
 
-		remote_send(c2->c_remote, "actor-at %d %d %d '%c'\r\n", actor_id, x, y, ca->ca_char);
+	for (type = 0; type < components_ntypes(components); type++) {
+		if (!component_is_property(type))
+			continue;
+		ids = components_ids(components, type);
+		values = components_values(components, type);
+		for (n = 0; n < components_count(components, type); n++) {
+			ca = client_actor_find_by_id(ids[n]);
+			if (ca->ca_instance != world)
+				continue;
+			journal_append(j, "actor-set %d %s %ld\n", ids[n],
+			    components_name(components, type), values[n]);
+		}
 	}
 }
 
-static int
-action_actor_new(struct remote *r, char *str, char **uptr)
+static void
+world_replay(char *record, void *arg)
 {
-	struct client *c;
-	unsigned int actor_id;
-	int assigned;
-	char ch;
-	char name[32];
+	struct client_actor *ca;
+	unsigned int id, x, y, width, height;
+	long value;
+	int assigned, off = 0, type;
+	char ch, name[32], session[SESSION_TOKEN_LEN + 1];
 
-	c = (struct client *)uptr;
+	if (sscanf(record, "map-size %d %d", &width, &height) == 2) {
+		if (world != NULL)
+			errx(1, "journal: map-size given twice");
+		world = instance_new(map_new_empty(width, height), false);
+		return;
+	}
 
-	assigned = sscanf(str, "actor-new '%c' %31s", &ch, name);
-	if (assigned != 2) {
-		remote_send(r, "sorry, invalid usage; should be 'actor-new 'X' name'\r\n");
-		return (0);
+	if (world == NULL)
+		errx(1, "journal: '%s' before map-size", record);
+
+	if (sscanf(record, "map-put %d %d%n", &x, &y, &off) == 2 && record[off] == ' ') {
+		/*
+		 * Cells can be spaces, so don't let sscanf(3) skip them.
+		 */
+		record += off + 1;
+		map_set_region(world->i_map, x, y, strlen(record), 1, record);
+		return;
+	}
+
+	/*
+	 * Journals from before sessions have no token; nobody can resume those.
+	 */
+	session[0] = '\0';
+	assigned = sscanf(record, "actor-new %d %d %d '%c' %31s %16s", &id, &x, &y, &ch, name, session);
+	if (assigned >= 5) {
+		client_actor_restore(id, x, y, ch, name, session);
+		return;
 	}
 
-	actor_id = client_actor_add(c, ch, name);
-	remote_send(r, "ok, your ID is %d\r\n", actor_id);
+	if (sscanf(record, "actor-move %d %d %d", &id, &x, &y) == 3) {
+		ca = client_actor_find_by_id(id);
+		if (ca == NULL)
+			errx(1, "journal: actor %d moved before being created", id);
+		map_actor_delete(ca->ca_actor);
+		ca->ca_actor = map_actor_new_at(world->i_map, x, y);
+		map_actor_set_uptr(ca->ca_actor, ca);
+		client_actor_publish(ca);
+		return;
+	}
 
-	broadcast_actor_at(c, actor_id);
+	if (sscanf(record, "actor-remove %d", &id) == 1) {
+		ca = client_actor_find_by_id(id);
+		if (ca == NULL)
+			errx(1, "journal: actor %d removed before being created", id);
+		client_actor_free(ca);
+		return;
+	}
 
-	return (0);
+	if (sscanf(record, "actor-set %d %31s %ld", &id, name, &value) == 3) {
+		ca = client_actor_find_by_id(id);
+		if (ca == NULL)
+			errx(1, "journal: property of actor %d set before it was created", id);
+		type = property_register(name);
+		if (type < 0)
+			errx(1, "journal: invalid property '%s'", name);
+		*(long *)components_set(components, type, id) = value;
+		return;
+	}
+
+	if (sscanf(record, "actor-unset %d %31s", &id, name) == 2) {
+		type = property_find(name);
+		if (type < 0 || !components_remove(components, type, id))
+			errx(1, "journal: actor %d didn't have '%s' to unset", id, name);
+		return;
+	}
+
+	errx(1, "journal: invalid record '%s'", record);
 }
 
-static int
-action_actor_locate(struct remote *r, char *str, char **uptr)
+/*
+ * Send the map within the given rectangle to the client, as map-delta if
+ * it's just a single row, or as map-region otherwise.
+ */
+static void
+client_push_map(struct client *c, struct map *map, unsigned int x0, unsigned int y0,
+    unsigned int x1, unsigned int y1)
 {
-	struct client *c;
-	struct client_actor *ca;
-	unsigned int actor_id;
-	int assigned;
-
-	c = (struct client *)uptr;
+	unsigned int y, w, h;
+	char *cells, *line, *rle;
 
-	assigned = sscanf(str, "actor-locate %d", &actor_id);
-	if (assigned != 1) {
-		remote_send(r, "sorry, invalid usage; should be 'actor-locate actor-id'\r\n");
-		return (0);
+	if (y0 == y1) {
+		line = map_line(map, y0, x0, x1);
+		remote_send(c->c_remote, "map-delta %lu %d %d %s\r\n",
+		    map_get_version(map), x0, y0, line);
+		free(line);
+		return;
 	}
 
-	ca = client_actor_find(c, actor_id);
-	if (ca == NULL) {
-		remote_send(r, "sorry, invalid actor-id\r\n");
-		return (0);
+	w = x1 - x0 + 1;
+	h = y1 - y0 + 1;
+	cells = malloc((size_t)w * h);
+	if (cells == NULL)
+		err(1, "malloc");
+	for (y = y0; y <= y1; y++) {
+		line = map_line(map, y, x0, x1);
+		memcpy(cells + (size_t)w * (y - y0), line, w);
+		free(line);
 	}
+	rle = rle_encode(cells, (size_t)w * h);
+	free(cells);
 
-	remote_send(r, "ok, %d %d\r\n", map_actor_get_x(ca->ca_actor), map_actor_get_y(ca->ca_actor));
-	return (0);
+	remote_send(c->c_remote, "map-region %lu %d %d %d %d %s\r\n",
+	    map_get_version(map), x0, y0, w, h, rle);
+	free(rle);
 }
 
-static int
-action_actor_move(struct remote *r, char *str, char **uptr)
+/*
+ * Send the changed rectangle to the clients in the instance that can see
+ * any of it, clipped to their views.
+ */
+static void
+instance_push_rect(struct instance *i, unsigned int x0, unsigned int y0,
+    unsigned int x1, unsigned int y1)
 {
+	struct client_view v;
 	struct client *c;
-	struct client_actor *ca;
-	unsigned int actor_id;
-	int assigned, error;
-	char direction[10];
+	unsigned int cx0, cx1, cy0, cy1;
 
-	c = (struct client *)uptr;
+	TAILQ_FOREACH(c, &clients, c_next) {
+		if (c->c_instance != i)
+			continue;
+		client_get_view(c, &v);
+		if (v.v_w == 0 || v.v_h == 0)
+			continue;
+		cx0 = x0 > v.v_x ? x0 : v.v_x;
+		cy0 = y0 > v.v_y ? y0 : v.v_y;
+		cx1 = x1 < v.v_x + v.v_w - 1 ? x1 : v.v_x + v.v_w - 1;
+		cy1 = y1 < v.v_y + v.v_h - 1 ? y1 : v.v_y + v.v_h - 1;
+		if (cx0 > cx1 || cy0 > cy1)
+			continue;
+		client_push_map(c, i->i_map, cx0, cy0, cx1, cy1);
+	}
+}
 
-	assigned = sscanf(str, "actor-move %d %9s", &actor_id, direction);
-	if (assigned != 2) {
-		remote_send(r, "sorry, invalid usage; should be 'actor-move actor-id north|south|east|west'\r\n");
-		return (0);
+/*
+ * Send the map changes made since the previous call to the clients
+ * in the same instance that can see them.  Called once per iteration,
+ * so that the edits made in the meantime get coalesced: each dirty row
+ * goes out as its own span, with consecutive rows that have the same span,
+ * like the ones from map-fill, merged into a single rectangle.  Clients
+ * whose view moves catch up on the rest with map-changes-since.
+ */
+static void
+instances_push_changes(void)
+{
+	struct instance *i;
+	unsigned int x0, x1, y, y0, y1, rx0, rx1, ry0;
+	bool run;
+
+	TAILQ_FOREACH(i, &instances, i_next) {
+		if (!map_get_dirty_rows(i->i_map, &y0, &y1))
+			continue;
+
+		run = false;
+		rx0 = rx1 = ry0 = 0;
+		for (y = y0; y <= y1; y++) {
+			if (!map_get_dirty_span(i->i_map, y, &x0, &x1)) {
+				if (run)
+					instance_push_rect(i, rx0, ry0, rx1, y - 1);
+				run = false;
+				continue;
+			}
+			if (run && x0 == rx0 && x1 == rx1)
+				continue;
+			if (run)
+				instance_push_rect(i, rx0, ry0, rx1, y - 1);
+			run = true;
+			rx0 = x0;
+			rx1 = x1;
+			ry0 = y;
+		}
+		if (run)
+			instance_push_rect(i, rx0, ry0, rx1, y1);
+		map_clear_dirty(i->i_map);
 	}
+}
 
-	ca = client_actor_find(c, actor_id);
-	if (ca == NULL) {
-		remote_send(r, "sorry, invalid actor-id\r\n");
-		return (0);
+static void
+world_snapshot_free(void *arg)
+{
+	struct world_snapshot *ws;
+	unsigned int n;
+
+	ws = arg;
+	for (n = 0; n < ws->ws_ninstances; n++)
+		instance_snapshot_release(ws->ws_instances[n]);
+	free(ws->ws_instances);
+	snaptable_view_delete(ws->ws_actors);
+	free(ws);
+}
+
+/*
+ * Publish a new world snapshot for the readers, if anything changed since
+ * the previous one, and free the old ones nobody can be using anymore.
+ * Called once per iteration.
+ */
+static void
+world_publish(void)
+{
+	struct world_snapshot *ws, *old;
+	struct instance_snapshot *is;
+	struct instance *i;
+	unsigned int n;
+
+	if (epoch == NULL)
+		return;
+
+	n = 0;
+	TAILQ_FOREACH(i, &instances, i_next) {
+		n++;
+		if (i->i_snapshot != NULL &&
+		    map_snapshot_get_version(i->i_snapshot->is_map) == map_get_version(i->i_map))
+			continue;
+		if (i->i_snapshot != NULL)
+			instance_snapshot_release(i->i_snapshot);
+		is = calloc(1, sizeof(*is));
+		if (is == NULL)
+			err(1, "calloc");
+		is->is_id = i->i_id;
+		is->is_refcount = 1;
+		is->is_map = map_snapshot_new(i->i_map);
+		i->i_snapshot = is;
+		world_changed = true;
 	}
 
-	if (strcmp(direction, "north") == 0)
-		error = map_actor_move_by(ca->ca_actor, 0, -1);
-	else if (strcmp(direction, "south") == 0)
-		error = map_actor_move_by(ca->ca_actor, 0, 1);
-	else if (strcmp(direction, "west") == 0)
-		error = map_actor_move_by(ca->ca_actor, -1, 0);
-	else if (strcmp(direction, "east") == 0)
-		error = map_actor_move_by(ca->ca_actor, 1, 0);
-	else {
-		remote_send(r, "sorry, no idea where's that\r\n");
-		return (0);
+	if (world_changed) {
+		ws = calloc(1, sizeof(*ws));
+		if (ws == NULL)
+			err(1, "calloc");
+		ws->ws_instances = calloc(n, sizeof(*ws->ws_instances));
+		if (ws->ws_instances == NULL)
+			err(1, "calloc");
+		TAILQ_FOREACH(i, &instances, i_next) {
+			i->i_snapshot->is_refcount++;
+			ws->ws_instances[ws->ws_ninstances++] = i->i_snapshot;
+		}
+		ws->ws_actors = snaptable_snapshot(actor_positions);
+
+		old = atomic_exchange(&published, ws);
+		if (old != NULL)
+			epoch_retire(epoch, world_snapshot_free, old);
+		world_changed = false;
 	}
 
-	if (error == 0) {
-		remote_send(r, "ok\r\n");
-		broadcast_actor_at(c, actor_id);
-	} else
-		remote_send(r, "sorry, can't go that way\r\n");
-	return (0);
+	epoch_reclaim(epoch);
 }
 
-static int
-action_map_get_size(struct remote *r, char *str, char **uptr)
+/*
+ * Must be called between epoch_enter() and epoch_exit().  Returns NULL
+ * if there's no such instance in the snapshot.
+ */
+static const struct instance_snapshot *
+reader_instance(struct reader *rd, const struct world_snapshot **wsp)
 {
+	const struct world_snapshot *ws;
+	unsigned int n;
 
-	remote_send(r, "ok, %d %d\r\n", map_get_width(map), map_get_height(map));
-	return (0);
+	ws = atomic_load(&published);
+	if (wsp != NULL)
+		*wsp = ws;
+	for (n = 0; n < ws->ws_ninstances; n++) {
+		if (ws->ws_instances[n]->is_id == rd->rd_instance)
+			return (ws->ws_instances[n]);
+	}
+
+	return (NULL);
 }
 
 static int
-action_map_get(struct remote *r, char *str, char **uptr)
+reader_map_get_size(struct remote *r, char *str, char **uptr)
 {
-	unsigned int x, y;
-	int assigned;
-	char ch;
+	struct reader *rd;
+	const struct instance_snapshot *is;
+	unsigned int width, height;
+	unsigned long version;
 
-	assigned = sscanf(str, "map-get %d %d", &x, &y);
-	if (assigned != 2) {
-		remote_send(r, "sorry, invalid usage; should be 'map-get x y'\r\n");
-		return (0);
-	}
-	if (x > map_get_width(map)) {
-		remote_send(r, "sorry, too large x\r\n");
-		return (0);
-	}
-	if (y > map_get_height(map)) {
-		remote_send(r, "sorry, too large y\r\n");
+	rd = (struct reader *)uptr;
+
+	epoch_enter(epoch, rd->rd_slot);
+	is = reader_instance(rd, NULL);
+	if (is == NULL) {
+		epoch_exit(epoch, rd->rd_slot);
+		remote_send(r, "sorry, the instance is gone\r\n");
 		return (0);
 	}
-	ch = map_get(map, x, y);
-	assert(ch != '\0');
-	remote_send(r, "ok, '%c'\r\n", ch);
+	width = map_snapshot_get_width(is->is_map);
+	height = map_snapshot_get_height(is->is_map);
+	version = map_snapshot_get_version(is->is_map);
+	epoch_exit(epoch, rd->rd_slot);
+
+	remote_send(r, "ok, %d %d %lu\r\n", width, height, version);
 	return (0);
 }
 
 static int
-action_map_set(struct remote *r, char *str, char **uptr)
+reader_map_get(struct remote *r, char *str, char **uptr)
 {
-	unsigned int x, y;
+	struct reader *rd;
+	const struct instance_snapshot *is;
+	unsigned int x, y, width, height;
 	int assigned;
 	char ch;
 
-	assigned = sscanf(str, "map-set %d %d %c", &x, &y, &ch);
-	if (assigned != 3) {
-		remote_send(r, "sorry, invalid usage; should be 'map-set x y ch'\r\n");
+	rd = (struct reader *)uptr;
+
+	assigned = sscanf(str, "map-get %d %d", &x, &y);
+	if (assigned != 2) {
+		remote_send(r, "sorry, invalid usage; should be 'map-get x y'\r\n");
+		return (0);
+	}
+
+	epoch_enter(epoch, rd->rd_slot);
+	is = reader_instance(rd, NULL);
+	if (is == NULL) {
+		epoch_exit(epoch, rd->rd_slot);
+		remote_send(r, "sorry, the instance is gone\r\n");
 		return (0);
 	}
-	if (x > map_get_width(map)) {
+	width = map_snapshot_get_width(is->is_map);
+	height = map_snapshot_get_height(is->is_map);
+	ch = map_snapshot_get(is->is_map, x, y);
+	epoch_exit(epoch, rd->rd_slot);
+
+	if (x >= width) {
 		remote_send(r, "sorry, too large x\r\n");
 		return (0);
 	}
-	if (y > map_get_height(map)) {
+	if (y >= height) {
 		remote_send(r, "sorry, too large y\r\n");
 		return (0);
 	}
-	map_set(map, x, y, ch);
-	remote_send(r, "ok\r\n");
+	remote_send(r, "ok, '%c'\r\n", ch);
 	return (0);
 }
 
 static int
-action_map_get_line(struct remote *r, char *str, char **uptr)
+reader_map_get_line(struct remote *r, char *str, char **uptr)
 {
+	struct reader *rd;
+	const struct instance_snapshot *is;
 	unsigned int x, y, width;
 	int assigned;
 	char *line;
 
+	rd = (struct reader *)uptr;
+
 	assigned = sscanf(str, "map-get-line %d", &y);
 	if (assigned != 1) {
 		remote_send(r, "sorry, invalid usage; should be 'map-get-line y'\r\n");
 		return (0);
 	}
-	if (y > map_get_height(map)) {
+
+	epoch_enter(epoch, rd->rd_slot);
+	is = reader_instance(rd, NULL);
+	if (is == NULL) {
+		epoch_exit(epoch, rd->rd_slot);
+		remote_send(r, "sorry, the instance is gone\r\n");
+		return (0);
+	}
+	if (y >= map_snapshot_get_height(is->is_map)) {
+		epoch_exit(epoch, rd->rd_slot);
 		remote_send(r, "sorry, too large y\r\n");
 		return (0);
 	}
-	width = map_get_width(map);
-	line = calloc(1, width + 1);
+	width = map_snapshot_get_width(is->is_map);
+	line = malloc(width + 1);
 	if (line == NULL)
-		err(1, "calloc");
+		err(1, "malloc");
 	for (x = 0; x < width; x++)
-		line[x] = map_get(map, x, y);
+		line[x] = map_snapshot_get(is->is_map, x, y);
+	line[width] = '\0';
+	epoch_exit(epoch, rd->rd_slot);
+
 	remote_send(r, "ok, %s\r\n", line);
 	free(line);
 	return (0);
 }
 
+/*
+ * Unlike the main port, any actor can be located, as long as it's
+ * in the instance the reader is looking at.
+ */
 static int
-action_bye(struct remote *r, char *str, char **uptr)
+reader_actor_locate(struct remote *r, char *str, char **uptr)
 {
+	struct reader *rd;
+	const struct world_snapshot *ws;
+	const struct actor_position *ap;
+	unsigned int actor_id, x = 0, y = 0;
+	int assigned;
+	bool found = false;
 
-	remote_send(r, "ok, see you next time\r\n");
-	/*
-	 * Close the socket, so that the select() will notice
-	 * and delete the client.
-	 */
-#if 0
-	/*
-	 * XXX: Nope, doesn't work.
-	 */
-	close(c->c_fd);
-#endif
-	return (0);
-}
+	rd = (struct reader *)uptr;
 
-static int
-action_say(struct remote *r, char *str, char **uptr)
-{
-	struct client *c;
+	assigned = sscanf(str, "actor-locate %d", &actor_id);
+	if (assigned != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'actor-locate actor-id'\r\n");
+		return (0);
+	}
 
-	TAILQ_FOREACH(c, &clients, c_next) {
-		/*
-		 * XXX: Validate the string somehow.
-		 */
-		remote_send(c->c_remote, "%s\r\n", str);
+	epoch_enter(epoch, rd->rd_slot);
+	reader_instance(rd, &ws);
+	ap = snaptable_view_get(ws->ws_actors, slotmap_index(actor_id));
+	if (ap != NULL && ap->ap_id == actor_id && ap->ap_instance == rd->rd_instance) {
+		x = ap->ap_x;
+		y = ap->ap_y;
+		found = true;
 	}
-	return (0);
-}
+	epoch_exit(epoch, rd->rd_slot);
 
-static int
-action_unknown(struct remote *r, char *str, char **uptr)
-{
+	if (!found) {
+		remote_send(r, "sorry, invalid actor-id\r\n");
+		return (0);
+	}
 
-	remote_send(r, "sorry, no idea what you mean\r\n");
+	remote_send(r, "ok, %d %d\r\n", x, y);
 	return (0);
 }
 
-static void
-client_add(int fd)
+/*
+ * Readers have no actors; this just changes which instance they look at.
+ */
+static int
+reader_instance_enter(struct remote *r, char *str, char **uptr)
 {
-	struct client *c;
-
-	c = calloc(1, sizeof(*c));
-	if (c == NULL)
-		err(1, "calloc");
-
-	c->c_fd = fd;
-	c->c_remote = remote_new(fd);
-	TAILQ_INSERT_TAIL(&clients, c, c_next);
+	struct reader *rd;
+	const struct instance_snapshot *is;
+	unsigned int instance_id, old_id;
+	int assigned;
 
-	remote_expect(c->c_remote, "actor-new", action_actor_new, (char **)c);
-	remote_expect(c->c_remote, "actor-locate", action_actor_locate, (char **)c);
-	remote_expect(c->c_remote, "actor-move", action_actor_move, (char **)c);
-	remote_expect(c->c_remote, "map-get-size", action_map_get_size, (char **)c);
-	remote_expect(c->c_remote, "map-get", action_map_get, (char **)c);
-	remote_expect(c->c_remote, "map-get-line", action_map_get_line, (char **)c);
-	remote_expect(c->c_remote, "map-set", action_map_set, (char **)c);
-	remote_expect(c->c_remote, "bye", action_bye, (char **)c);
-	remote_expect(c->c_remote, "say", action_say, (char **)c);
-	remote_expect(c->c_remote, "", action_unknown, (char **)c);
-}
+	rd = (struct reader *)uptr;
 
-static void
-client_remove(struct client *c)
-{
-	struct client_actor *ca, *tmpca;
+	assigned = sscanf(str, "instance-enter %d", &instance_id);
+	if (assigned != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'instance-enter instance-id'\r\n");
+		return (0);
+	}
 
-	TAILQ_FOREACH_SAFE(ca, &actors, ca_next, tmpca) {
-		if (ca->ca_client != c)
-			continue;
-		client_actor_remove(ca);
+	old_id = rd->rd_instance;
+	rd->rd_instance = instance_id;
+	epoch_enter(epoch, rd->rd_slot);
+	is = reader_instance(rd, NULL);
+	epoch_exit(epoch, rd->rd_slot);
+	if (is == NULL) {
+		rd->rd_instance = old_id;
+		remote_send(r, "sorry, no such instance\r\n");
+		return (0);
 	}
 
-	TAILQ_REMOVE(&clients, c, c_next);
-	remote_delete(c->c_remote);
-	free(c);
+	remote_send(r, "ok\r\n");
+	return (0);
 }
 
-static struct client *
-client_find_by_fd(int fd)
+static void *
+reader_main(void *arg)
 {
-	struct client *c;
+	struct reader *rd;
 
-	TAILQ_FOREACH(c, &clients, c_next) {
-		if (c->c_fd == fd)
-			return (c);
-	}
+	rd = arg;
+	while (remote_process_sync(rd->rd_remote))
+		continue;
+
+	epoch_unregister(epoch, rd->rd_slot);
+	remote_delete(rd->rd_remote);
+	free(rd);
 
 	return (NULL);
 }
 
 static void
-client_receive(struct client *c)
+reader_add(int fd)
 {
+	struct reader *rd;
+	pthread_t thread;
+	int slot, error;
+
+	slot = epoch_register(epoch);
+	if (slot < 0) {
+		dprintf(fd, "sorry, too many readers\r\n");
+		close(fd);
+		return;
+	}
+
+	rd = calloc(1, sizeof(*rd));
+	if (rd == NULL)
+		err(1, "calloc");
+	rd->rd_remote = remote_new(fd);
+	rd->rd_slot = slot;
+	rd->rd_instance = world->i_id;
+
+	remote_expect(rd->rd_remote, "map-get-size", reader_map_get_size, (char **)rd);
+	remote_expect(rd->rd_remote, "map-get", reader_map_get, (char **)rd);
+	remote_expect(rd->rd_remote, "map-get-line", reader_map_get_line, (char **)rd);
+	remote_expect(rd->rd_remote, "actor-locate", reader_actor_locate, (char **)rd);
+	remote_expect(rd->rd_remote, "instance-enter", reader_instance_enter, (char **)rd);
+	remote_expect(rd->rd_remote, "bye", action_bye, (char **)rd);
+	remote_expect(rd->rd_remote, "", action_unknown, (char **)rd);
 
-	remote_process(c->c_remote);
+	error = pthread_create(&thread, NULL, reader_main, rd);
+	if (error != 0)
+		errx(1, "pthread_create: %s", strerror(error));
+	error = pthread_detach(thread);
+	if (error != 0)
+		errx(1, "pthread_detach: %s", strerror(error));
 }
 
 static int
 listen_on(int port)
 {
 	struct sockaddr_in sin;
-	int sock, error;
+	int sock, error, flag;
 
 	sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (sock < 0)
 		err(1, "socket");
 
+	/*
+	 * Make it possible to restart the hub right away, e.g. after a crash.
+	 */
+	flag = 1;
+	error = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+	if (error != 0)
+		err(1, "SO_REUSEADDR");
+
 	sin.sin_family = AF_INET;
 	sin.sin_port = htons(port);
 	sin.sin_addr.s_addr = INADDR_ANY;
@@ -437,11 +4644,304 @@ fd_add(int fd, fd_set *fdset, int nfds)
 	return (nfds);
 }
 
+static int
+region_fd_add(fd_set *fdset, int nfds)
+{
+	struct region_link *rl;
+	int side;
+
+	if (region_socket < 0)
+		return (nfds);
+
+	nfds = fd_add(region_socket, fdset, nfds);
+	for (side = 0; side < REGION_SIDES; side++) {
+		if (region_peers[side].rp_remote != NULL)
+			nfds = fd_add(region_peers[side].rp_fd, fdset, nfds);
+	}
+	TAILQ_FOREACH(rl, &region_links, rl_next)
+		nfds = fd_add(rl->rl_fd, fdset, nfds);
+
+	return (nfds);
+}
+
+/*
+ * Handle whatever the neighbours are up to; returns false if none
+ * of the descriptors in "fdset" are theirs.
+ */
+static bool
+region_process(fd_set *fdset)
+{
+	struct region_peer *rp;
+	struct region_link *rl;
+	int fd, side;
+	char buf[64];
+
+	if (region_socket < 0)
+		return (false);
+
+	if (FD_ISSET(region_socket, fdset)) {
+		fd = accept(region_socket, NULL, 0);
+		if (fd < 0)
+			err(1, "accept");
+		region_link_add(fd);
+		return (true);
+	}
+
+	for (side = 0; side < REGION_SIDES; side++) {
+		rp = &region_peers[side];
+		if (rp->rp_remote == NULL || !FD_ISSET(rp->rp_fd, fdset))
+			continue;
+		if (recv(rp->rp_fd, buf, 1, MSG_DONTWAIT | MSG_PEEK) <= 0 ||
+		    !remote_process(rp->rp_remote))
+			region_peer_lost(rp);
+		return (true);
+	}
+
+	TAILQ_FOREACH(rl, &region_links, rl_next) {
+		if (!FD_ISSET(rl->rl_fd, fdset))
+			continue;
+		if (recv(rl->rl_fd, buf, 1, MSG_DONTWAIT | MSG_PEEK) <= 0 ||
+		    !remote_process(rl->rl_remote))
+			region_link_remove(rl);
+		return (true);
+	}
+
+	return (false);
+}
+
+static void
+run_tick(void)
+{
+
+	tick++;
+	instances_push_changes();
+	clients_flush(client_encode_frame);
+}
+
+/*
+ * Runs the tick, and schedules the next one.
+ */
+static void
+tick_timer_fired(void *arg)
+{
+	uint64_t due;
+
+	run_tick();
+	due = tick_epoch + (tick - tick_epoch_tick) * 1000 / tick_hz;
+	/*
+	 * If we've fallen behind, don't try to catch up with a burst
+	 * of ticks; just skip them.
+	 */
+	if (due <= timerwheel_now(timers)) {
+		tick_epoch = timerwheel_now(timers);
+		tick_epoch_tick = tick;
+		due = tick_epoch + 1000 / tick_hz;
+	}
+	timerwheel_schedule(timers, &tick_timer, due);
+}
+
+/*
+ * Point the flow field of every instance with NPCs at the players in it.
+ */
+static void
+npc_update_players(struct instance *i)
+{
+	struct client *c;
+	struct client_actor *ca;
+	unsigned int *xs, *ys, n = 0;
+
+	TAILQ_FOREACH(c, &clients, c_next) {
+		if (c->c_instance != i)
+			continue;
+		TAILQ_FOREACH(ca, &c->c_actors, ca_client_next)
+			n++;
+	}
+
+	xs = calloc(n + 1, sizeof(*xs));
+	ys = calloc(n + 1, sizeof(*ys));
+	if (xs == NULL || ys == NULL)
+		err(1, "calloc");
+
+	n = 0;
+	TAILQ_FOREACH(c, &clients, c_next) {
+		if (c->c_instance != i)
+			continue;
+		TAILQ_FOREACH(ca, &c->c_actors, ca_client_next) {
+			xs[n] = map_actor_get_x(ca->ca_actor);
+			ys[n] = map_actor_get_y(ca->ca_actor);
+			n++;
+		}
+	}
+
+	if (i->i_players == NULL)
+		i->i_players = flowfield_new(i->i_map);
+	flowfield_set_sources(i->i_players, xs, ys, n);
+	flowfield_update(i->i_players);
+	free(xs);
+	free(ys);
+}
+
+/*
+ * Decide where NPCs from "begin" to "end" go next, setting n_move to the
+ * direction, or -1 to stay.  Runs on the job pool threads, so it mustn't
+ * change anything but the NPCs' own state; the maps and the flow fields
+ * are only read.
+ */
+static void
+npc_think(void *arg, unsigned int begin, unsigned int end)
+{
+	struct npc *npcs, *npc;
+	struct flowfield *ff;
+	struct actor *a;
+	unsigned int n, x, y, rng;
+
+	npcs = arg;
+	for (n = begin; n < end; n++) {
+		npc = &npcs[n];
+		a = npc->n_ca->ca_actor;
+		x = map_actor_get_x(a);
+		y = map_actor_get_y(a);
+
+		ff = npc->n_ca->ca_instance->i_players;
+		if (flowfield_get_distance(ff, x, y) <= NPC_CHASE_RADIUS) {
+			npc->n_move = flowfield_next_step(ff, x, y, false);
+			continue;
+		}
+
+		/*
+		 * Xorshift; wander off in a random direction half the time,
+		 * stay put otherwise.
+		 */
+		rng = npc->n_rng;
+		rng ^= rng << 13;
+		rng ^= rng >> 17;
+		rng ^= rng << 5;
+		npc->n_rng = rng;
+		npc->n_move = (rng >> 8) % 8 < 4 ? (int)((rng >> 8) % 8) : -1;
+	}
+}
+
+static void
+npc_update(void)
+{
+	struct instance *i;
+	struct npc *npcs;
+	unsigned int n, count;
+
+	TAILQ_FOREACH(i, &instances, i_next) {
+		if (i->i_npcs > 0)
+			npc_update_players(i);
+	}
+
+	npcs = components_values(components, npc_component);
+	count = components_count(components, npc_component);
+	jobpool_run(jobpool, npc_think, npcs, count, NPC_BATCH);
+
+	/*
+	 * Whoever moves first gets the cell; the others stay where they are.
+	 */
+	for (n = 0; n < count; n++) {
+		if (npcs[n].n_move >= 0)
+			client_actor_step(npcs[n].n_ca, npcs[n].n_move);
+	}
+}
+
+static void
+npc_timer_fired(void *arg)
+{
+	uint64_t due;
+
+	if (components_count(components, npc_component) == 0)
+		return;
+
+	npc_update();
+	due = timerwheel_due(&npc_timer) + 1000 / NPC_UPDATE_HZ;
+	if (due <= timerwheel_now(timers))
+		due = timerwheel_now(timers) + 1000 / NPC_UPDATE_HZ;
+	timerwheel_schedule(timers, &npc_timer, due);
+}
+
+/*
+ * Without ticks, sends out what was held back; reschedules itself
+ * for as long as the hub stays busy.
+ */
+static void
+load_timer_fired(void *arg)
+{
+
+	clients_flush(client_encode_deferred);
+
+	if (load_level > 0)
+		timerwheel_schedule(timers, &load_timer, timerwheel_now(timers) + (LOAD_PERIOD << (load_level - 1)));
+}
+
+/*
+ * Called from the main loop, right before waiting for clients,
+ * with the time the hub stopped waiting the last time.
+ */
+static void
+load_update(uint64_t busy_start)
+{
+	uint64_t now, elapsed;
+	unsigned int old_level;
+
+	now = clock_us();
+	load_busy += now - busy_start;
+	elapsed = now - load_window_start;
+	if (elapsed < LOAD_WINDOW * 1000)
+		return;
+
+	load_percent = load_busy * 100 / elapsed;
+	load_busy = 0;
+	load_window_start = now;
+
+	old_level = load_level;
+	if (load_percent > LOAD_HIGH && load_level < LOAD_LEVEL_MAX)
+		load_level++;
+	else if (load_percent < LOAD_LOW && load_level > 0)
+		load_level--;
+	if (tick_hz != 0 || load_level == old_level)
+		return;
+
+	if (load_level == 0) {
+		timerwheel_cancel(timers, &load_timer);
+		clients_flush(client_encode_deferred);
+	} else if (!timerwheel_pending(&load_timer)) {
+		timerwheel_schedule(timers, &load_timer, clock_ms() + LOAD_PERIOD);
+	}
+}
+
+/*
+ * Nothing else might be going on by the time the journal is due to be synced.
+ */
+static void
+journal_timer_fired(void *arg)
+{
+
+	journal_flush(journal);
+}
+
+/*
+ * Make sure the main loop wakes up to sync the journal.
+ */
+static void
+journal_schedule_sync(void)
+{
+	time_t when, now;
+
+	if (!journal_sync_due(journal, &when) || timerwheel_pending(&journal_timer))
+		return;
+
+	now = time(NULL);
+	timerwheel_schedule(timers, &journal_timer, clock_ms() + (when > now ? when - now : 1) * 1000);
+}
+
 static void
 usage(void)
 {
 
-	printf("usage: fwkhub\n");
+	printf("usage: fwkhub [-d journal-dir] [-g region/regions] [-i templates] [-n npcs] [-r read-only-port]\n"
+	    "              [-s seed] [-t tick-hz]\n");
 	exit(0);
 }
 
@@ -449,33 +4949,206 @@ int
 main(int argc, char **argv)
 {
 	fd_set fdset;
-	int error, i, nfds, client_fd, listening_socket;
+	struct timeval timeout;
+	uint64_t now, due, busy_start;
+	bool have_deadline;
+	int error, i, nfds, client_fd, listening_socket, reader_socket = -1, side;
 	struct client *client;
+	const char *journal_dir = NULL;
 	char buf[1];
+	int ch, templates = 2, nnpcs = 0, reader_port = 0;
+	unsigned int seed = 0;
+	bool seeded = false;
 
-	if (argc != 1)
+	while ((ch = getopt(argc, argv, "d:g:i:n:r:s:t:")) != -1) {
+		switch (ch) {
+		case 'd':
+			journal_dir = optarg;
+			break;
+		case 'g':
+			if (sscanf(optarg, "%u/%u", &region, &regions) != 2 ||
+			    regions < 1 || regions > REGIONS_MAX || region >= regions)
+				errx(1, "invalid region");
+			break;
+		case 'i':
+			templates = atoi(optarg);
+			if (templates < 0)
+				errx(1, "invalid number of templates");
+			break;
+		case 'n':
+			nnpcs = atoi(optarg);
+			if (nnpcs < 0)
+				errx(1, "invalid number of NPCs");
+			break;
+		case 'r':
+			reader_port = atoi(optarg);
+			if (reader_port < 1 || reader_port > 65535)
+				errx(1, "invalid port");
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			seeded = true;
+			break;
+		case 't':
+			tick_hz = atoi(optarg);
+			if (tick_hz < 1 || tick_hz > TICK_HZ_MAX)
+				errx(1, "invalid tick rate");
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
 		usage();
+	if (regions > 0 && journal_dir != NULL)
+		errx(1, "-d and -g are mutually exclusive");
 
 	TAILQ_INIT(&clients);
 	TAILQ_INIT(&actors);
+	TAILQ_INIT(&instances);
+	TAILQ_INIT(&region_links);
+	TAILQ_INIT(&region_ghosts);
+	TAILQ_INIT(&region_leaving);
+	TAILQ_INIT(&region_departures);
+	TAILQ_INIT(&region_arrivals);
+	if (regions > 0)
+		actor_ids = slotmap_new_range(region * REGION_IDS, REGION_IDS);
+	else
+		actor_ids = slotmap_new();
+	pathfinder = pathfinder_new();
+	jobpool = jobpool_new(0);
+	components = components_new();
+	npc_component = components_register(components, "npc", sizeof(struct npc));
+	inventory_component = components_register(components, "inventory", sizeof(unsigned int));
+	items = items_new();
+	timers = timerwheel_new(clock_ms());
+	timerwheel_init(&tick_timer, tick_timer_fired, NULL);
+	timerwheel_init(&npc_timer, npc_timer_fired, NULL);
+	if (reader_port != 0) {
+		epoch = epoch_new();
+		actor_positions = snaptable_new(sizeof(struct actor_position));
+	}
+
+	/*
+	 * Clients going away in the middle of a reply shouldn't take the hub
+	 * down with them.
+	 */
+	signal(SIGPIPE, SIG_IGN);
 
-	map = map_new(200, 60);
+	if (journal_dir != NULL) {
+		journal = journal_open(journal_dir);
+		timerwheel_init(&journal_timer, journal_timer_fired, NULL);
+		if (journal_replay(journal, world_replay, NULL)) {
+			if (world == NULL)
+				errx(1, "%s: no map in the journal", journal_dir);
+			/*
+			 * Compact what we've just replayed.
+			 */
+			journal_checkpoint(journal, world_dump, NULL);
+			timerwheel_init(&restore_timer, restore_timer_fired, NULL);
+			timerwheel_schedule(timers, &restore_timer, clock_ms() + SESSION_RESUME_TIMEOUT);
+		}
+	}
+
+	if (world == NULL) {
+		if (regions > 0 || seeded)
+			world = instance_new(map_new_seeded(REGION_WIDTH * (regions > 0 ? regions : 1),
+			    WORLD_HEIGHT, seed, NULL, NULL), false);
+		else
+			world = instance_new(map_new(WORLD_WIDTH, WORLD_HEIGHT), false);
+		/*
+		 * Freshly generated map goes straight into the journal;
+		 * there is no snapshot to recover it from yet.
+		 */
+		if (journal != NULL) {
+			world_dump(journal, NULL);
+			journal_flush(journal);
+		}
+	}
+	if (regions > 0) {
+		region_x0 = region * REGION_WIDTH;
+		region_x1 = region_x0 + REGION_WIDTH;
+	}
 
-	listening_socket = listen_on(FAWORKEN_PORT);
+	/*
+	 * Templates are not persistent; new ones get generated on every start.
+	 */
+	for (; templates > 0; templates--)
+		instance_new(map_new(TEMPLATE_WIDTH, TEMPLATE_HEIGHT), true);
+
+	if ((unsigned int)nnpcs > npc_room(world))
+		errx(1, "room for at most %d NPCs", npc_room(world));
+	for (; nnpcs > 0; nnpcs--) {
+		if (npc_add(world, NPC_DEFAULT_CHAR) == NULL)
+			errx(1, "no room left for %d more NPCs", nnpcs);
+	}
+
+	listening_socket = listen_on(FAWORKEN_PORT + region);
+	if (reader_port != 0)
+		reader_socket = listen_on(reader_port);
+	if (regions > 0) {
+		region_socket = listen_on(REGION_PEER_PORT + region);
+		for (side = 0; side < REGION_SIDES; side++) {
+			region_peers[side].rp_region = side == REGION_WEST ? (int)region - 1 : (int)region + 1;
+			region_peers[side].rp_fd = -1;
+			if (region_peers[side].rp_region < 0 || region_peers[side].rp_region >= (int)regions)
+				continue;
+			timerwheel_init(&region_peers[side].rp_timer, region_peer_timer, &region_peers[side]);
+			timerwheel_schedule(timers, &region_peers[side].rp_timer, clock_ms());
+		}
+	}
 
 #if 0
 	fprintf(stderr, "listening for clients on port %d\n", FAWORKEN_PORT);
 #endif
 
+	if (tick_hz != 0) {
+		tick_epoch = clock_ms();
+		timerwheel_schedule(timers, &tick_timer, tick_epoch);
+	}
+
+	timerwheel_init(&load_timer, load_timer_fired, NULL);
+	load_window_start = busy_start = clock_us();
+
 	for (;;) {
+		timerwheel_run(timers, clock_ms());
+		if (tick_hz == 0)
+			instances_push_changes();
+
+		if (journal != NULL) {
+			journal_flush(journal);
+			journal_reap(journal);
+			if (journal_checkpoint_due(journal))
+				journal_checkpoint(journal, world_dump, NULL);
+			journal_schedule_sync();
+		}
+		region_reap();
+		world_publish();
+
 		FD_ZERO(&fdset);
 		nfds = 0;
 		nfds = fd_add(listening_socket, &fdset, nfds);
+		if (reader_socket >= 0)
+			nfds = fd_add(reader_socket, &fdset, nfds);
 		TAILQ_FOREACH(client, &clients, c_next)
 			nfds = fd_add(client->c_fd, &fdset, nfds);
-		error = select(nfds + 1, &fdset, NULL, NULL, NULL);
-		if (error <= 0)
+		nfds = region_fd_add(&fdset, nfds);
+		load_update(busy_start);
+		have_deadline = timerwheel_next(timers, &due);
+		if (have_deadline) {
+			now = clock_ms();
+			due = due > now ? due - now : 0;
+			timeout.tv_sec = due / 1000;
+			timeout.tv_usec = due % 1000 * 1000;
+		}
+		error = select(nfds + 1, &fdset, NULL, NULL, have_deadline ? &timeout : NULL);
+		if (error < 0)
 			err(1, "select");
+		busy_start = clock_us();
+		if (error == 0)
+			continue;
 
 		if (FD_ISSET(listening_socket, &fdset)) {
 			client_fd = accept(listening_socket, NULL, 0);
@@ -488,6 +5161,17 @@ main(int argc, char **argv)
 			continue;
 		}
 
+		if (reader_socket >= 0 && FD_ISSET(reader_socket, &fdset)) {
+			client_fd = accept(reader_socket, NULL, 0);
+			if (client_fd < 0)
+				err(1, "accept");
+			reader_add(client_fd);
+			continue;
+		}
+
+		if (region_process(&fdset))
+			continue;
+
 		for (i = 0; i < nfds + 1; i++) {
 			if (!FD_ISSET(i, &fdset))
 				continue;
@@ -497,11 +5181,9 @@ main(int argc, char **argv)
 				/*
 				 * Check if the socket is still connected.
 				 */
-				if (recv(i, buf, sizeof(buf), MSG_DONTWAIT | MSG_PEEK) <= 0) {
+				if (recv(i, buf, sizeof(buf), MSG_DONTWAIT | MSG_PEEK) <= 0 ||
+				    !client_receive(client))
 					client_remove(client);
-					break;
-				}
-				client_receive(client);
 				break;
 			}
 			errx(1, "unknown fd %d", i);
@@ -0,0 +1,660 @@
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "remote.h"
+#include "rle.h"
+
+/*
+ * Relay for spectators.  It connects to the hub once, subscribes to
+ * everything that happens in the world, and keeps a copy of the map
+ * and of the actors.  Spectators connect to the relay instead of the hub,
+ * and get served from that copy: the map and the actors when they ask,
+ * and then the updates, forwarded to all of them just the way they came
+ * from the hub.  However many spectators there are, the hub only ever
+ * sees the one client.
+ *
+ * Spectators can't change anything; the relay only knows the commands
+ * "fwk -s" uses.
+ */
+
+#define	FAWORKEN_PORT		1981
+#define	RELAY_PORT		(FAWORKEN_PORT + 1000)
+
+/*
+ * Whatever a spectator can't take right away gets queued.  The ones that
+ * fall more than SPECTATOR_QUEUE_MAX bytes behind get dropped, so that
+ * a slow spectator never keeps the relay from reading what the hub sends.
+ */
+#define	SPECTATOR_QUEUE_MAX	(1024 * 1024)
+
+/*
+ * Actors are kept in a list, for sending them all to new spectators,
+ * and hashed by ID, for the updates.  The hash table doubles whenever
+ * there are more actors than buckets.
+ */
+#define	ACTOR_BUCKETS_MIN	256
+
+struct relay_actor {
+	TAILQ_ENTRY(relay_actor)	ra_next;
+	LIST_ENTRY(relay_actor)		ra_hash_next;
+	unsigned int			ra_id;
+	unsigned int			ra_x;
+	unsigned int			ra_y;
+	char				ra_char;
+};
+
+struct spectator {
+	TAILQ_ENTRY(spectator)		s_next;
+	int				s_fd;
+	struct remote			*s_remote;
+};
+
+static struct remote			*hub;
+static TAILQ_HEAD(, relay_actor)	actors;
+static LIST_HEAD(relay_actor_bucket, relay_actor) *actor_buckets;
+static unsigned int			actor_buckets_mask;
+static unsigned int			actors_count;
+static TAILQ_HEAD(, spectator)		spectators;
+static unsigned int			map_width;
+static unsigned int			map_height;
+static char				*map_cells;
+static unsigned long			*map_row_versions;
+static unsigned long			map_version;
+
+static int
+server_callback(struct remote *r, char *str, char **uptr)
+{
+	char *reply;
+
+	reply = strdup(str);
+	if (reply == NULL)
+		err(1, "strdup");
+	*uptr = reply;
+
+	/*
+	 * Return 1, so that the callback gets removed.
+	 */
+	return (1);
+}
+
+/*
+ * Send the command to the hub, and wait for the "ok".
+ */
+static char *
+server_request(const char *cmd)
+{
+	char *reply = NULL;
+
+	remote_expect(hub, "ok", server_callback, &reply);
+	remote_expect(hub, "sorry", server_callback, &reply);
+	remote_send(hub, "%s\r\n", cmd);
+	while (reply == NULL) {
+		if (!remote_process_sync(hub))
+			errx(1, "hub went away");
+	}
+	if (strncmp(reply, "ok", strlen("ok")) != 0)
+		errx(1, "hub refused '%s': %s", cmd, reply);
+
+	return (reply);
+}
+
+/*
+ * Pass whatever came from the hub on to all the spectators.  It gets
+ * formatted once, and written out as is.
+ */
+static void
+spectators_forward(const char *str)
+{
+	struct spectator *s;
+	char *msg;
+	int len;
+
+	if (TAILQ_EMPTY(&spectators))
+		return;
+
+	len = asprintf(&msg, "%s\r\n", str);
+	if (len <= 0)
+		err(1, "asprintf");
+	TAILQ_FOREACH(s, &spectators, s_next)
+		remote_send_raw(s->s_remote, msg, len + 1);
+	free(msg);
+}
+
+/*
+ * The low bits of actor IDs are slot indices on the hub, so they're spread
+ * well enough as they are.
+ */
+static struct relay_actor_bucket *
+actor_bucket(unsigned int id)
+{
+
+	return (&actor_buckets[id & actor_buckets_mask]);
+}
+
+static void
+actor_buckets_resize(unsigned int nbuckets)
+{
+	struct relay_actor *ra;
+	unsigned int i;
+
+	free(actor_buckets);
+	actor_buckets = calloc(nbuckets, sizeof(*actor_buckets));
+	if (actor_buckets == NULL)
+		err(1, "calloc");
+	actor_buckets_mask = nbuckets - 1;
+	for (i = 0; i < nbuckets; i++)
+		LIST_INIT(&actor_buckets[i]);
+
+	TAILQ_FOREACH(ra, &actors, ra_next)
+		LIST_INSERT_HEAD(actor_bucket(ra->ra_id), ra, ra_hash_next);
+}
+
+static struct relay_actor *
+actor_find(unsigned int id)
+{
+	struct relay_actor *ra;
+
+	LIST_FOREACH(ra, actor_bucket(id), ra_hash_next) {
+		if (ra->ra_id == id)
+			return (ra);
+	}
+
+	return (NULL);
+}
+
+static void
+actor_at(unsigned int id, unsigned int x, unsigned int y, char ch)
+{
+	struct relay_actor *ra;
+
+	ra = actor_find(id);
+	if (ra == NULL) {
+		ra = calloc(1, sizeof(*ra));
+		if (ra == NULL)
+			err(1, "calloc");
+		ra->ra_id = id;
+		TAILQ_INSERT_TAIL(&actors, ra, ra_next);
+		LIST_INSERT_HEAD(actor_bucket(id), ra, ra_hash_next);
+		actors_count++;
+		if (actors_count > actor_buckets_mask + 1)
+			actor_buckets_resize((actor_buckets_mask + 1) * 2);
+	}
+
+	ra->ra_x = x;
+	ra->ra_y = y;
+	ra->ra_char = ch;
+}
+
+static void
+actor_gone(unsigned int id)
+{
+	struct relay_actor *ra;
+
+	ra = actor_find(id);
+	if (ra == NULL)
+		return;
+
+	TAILQ_REMOVE(&actors, ra, ra_next);
+	LIST_REMOVE(ra, ra_hash_next);
+	actors_count--;
+	free(ra);
+}
+
+static void
+map_put(unsigned long version, unsigned int x, unsigned int y, const char *cells, size_t len)
+{
+
+	if (y >= map_height || x >= map_width)
+		return;
+	if (len > map_width - x)
+		len = map_width - x;
+
+	memcpy(map_cells + (size_t)y * map_width + x, cells, len);
+	map_row_versions[y] = version;
+	if (version > map_version)
+		map_version = version;
+}
+
+static int
+hub_actor_at(struct remote *r, char *str, char **uptr)
+{
+	unsigned int id, x, y;
+	char ch;
+
+	if (sscanf(str, "actor-at %d %d %d '%c'", &id, &x, &y, &ch) != 4)
+		errx(1, "invalid actor-at: %s", str);
+
+	actor_at(id, x, y, ch);
+	spectators_forward(str);
+	return (0);
+}
+
+static int
+hub_actor_gone(struct remote *r, char *str, char **uptr)
+{
+	unsigned int id;
+
+	if (sscanf(str, "actor-gone %d", &id) != 1)
+		errx(1, "invalid actor-gone: %s", str);
+
+	actor_gone(id);
+	spectators_forward(str);
+	return (0);
+}
+
+/*
+ * "frame TICK at ID X Y 'C' gone ID ..."
+ */
+static int
+hub_frame(struct remote *r, char *str, char **uptr)
+{
+	unsigned int id, x, y;
+	unsigned long tick;
+	int off;
+	char ch, *p;
+
+	if (sscanf(str, "frame %lu%n", &tick, &off) != 1)
+		errx(1, "invalid frame: %s", str);
+
+	for (p = str + off; *p != '\0'; p += off) {
+		off = 0;
+		if (sscanf(p, " at %u %u %u '%c'%n", &id, &x, &y, &ch, &off) == 4 && off > 0) {
+			actor_at(id, x, y, ch);
+			continue;
+		}
+		off = 0;
+		if (sscanf(p, " gone %u%n", &id, &off) == 1 && off > 0) {
+			actor_gone(id);
+			continue;
+		}
+		errx(1, "invalid frame entry: %s", p);
+	}
+
+	spectators_forward(str);
+	return (0);
+}
+
+static int
+hub_map_delta(struct remote *r, char *str, char **uptr)
+{
+	unsigned long version;
+	unsigned int x, y;
+	int off = 0;
+
+	if (sscanf(str, "map-delta %lu %d %d%n", &version, &x, &y, &off) != 3 || str[off] != ' ')
+		errx(1, "invalid map-delta: %s", str);
+
+	map_put(version, x, y, str + off + 1, strlen(str + off + 1));
+	spectators_forward(str);
+	return (0);
+}
+
+static int
+hub_map_region(struct remote *r, char *str, char **uptr)
+{
+	unsigned long version;
+	unsigned int x, y, w, h, cy;
+	int off = 0;
+	char *cells;
+
+	if (sscanf(str, "map-region %lu %d %d %d %d%n", &version, &x, &y, &w, &h, &off) != 5 ||
+	    str[off] != ' ')
+		errx(1, "invalid map-region: %s", str);
+
+	cells = rle_decode(str + off + 1, (size_t)w * h);
+	if (cells == NULL)
+		errx(1, "invalid map-region data: %s", str);
+	for (cy = 0; cy < h; cy++)
+		map_put(version, x, y + cy, cells + (size_t)w * cy, w);
+	free(cells);
+
+	spectators_forward(str);
+	return (0);
+}
+
+/*
+ * Everything else the hub sends is meant for clients with actors.
+ */
+static int
+hub_ignore(struct remote *r, char *str, char **uptr)
+{
+
+	return (0);
+}
+
+/*
+ * Download the map, and subscribe to the changes; the actors arrive
+ * in the same way all the later updates do.
+ */
+static void
+hub_subscribe(void)
+{
+	unsigned int y;
+	unsigned long version;
+	char cmd[32], *reply;
+
+	remote_expect(hub, "actor-at", hub_actor_at, NULL);
+	remote_expect(hub, "actor-gone", hub_actor_gone, NULL);
+	remote_expect(hub, "frame", hub_frame, NULL);
+	remote_expect(hub, "map-delta", hub_map_delta, NULL);
+	remote_expect(hub, "map-region", hub_map_region, NULL);
+	remote_expect(hub, "", hub_ignore, NULL);
+
+	reply = server_request("map-get-size");
+	if (sscanf(reply, "ok, %d %d %lu", &map_width, &map_height, &map_version) != 3 ||
+	    map_width == 0 || map_height == 0)
+		errx(1, "invalid reply to map-get-size: %s", reply);
+	free(reply);
+
+	map_cells = calloc(map_height, map_width);
+	map_row_versions = calloc(map_height, sizeof(*map_row_versions));
+	if (map_cells == NULL || map_row_versions == NULL)
+		err(1, "calloc");
+
+	version = map_version;
+	for (y = 0; y < map_height; y++) {
+		snprintf(cmd, sizeof(cmd), "map-get-line %d", y);
+		reply = server_request(cmd);
+		if (strlen(reply) != strlen("ok, ") + map_width)
+			errx(1, "invalid map line length: %s", reply);
+		memcpy(map_cells + (size_t)y * map_width, reply + strlen("ok, "), map_width);
+		free(reply);
+	}
+
+	/*
+	 * Make sure nothing changed since map-get-size got lost in between.
+	 */
+	snprintf(cmd, sizeof(cmd), "map-changes-since %lu", version);
+	free(server_request(cmd));
+	free(server_request("subscribe"));
+}
+
+static int
+spectator_map_get_size(struct remote *r, char *str, char **uptr)
+{
+
+	remote_send(r, "ok, %d %d %lu\r\n", map_width, map_height, map_version);
+	return (0);
+}
+
+static int
+spectator_map_get_line(struct remote *r, char *str, char **uptr)
+{
+	unsigned int y;
+
+	if (sscanf(str, "map-get-line %d", &y) != 1 || y >= map_height) {
+		remote_send(r, "sorry, invalid usage; should be 'map-get-line y'\r\n");
+		return (0);
+	}
+
+	remote_send(r, "ok, %.*s\r\n", map_width, map_cells + (size_t)y * map_width);
+	return (0);
+}
+
+static int
+spectator_map_changes_since(struct remote *r, char *str, char **uptr)
+{
+	unsigned long version;
+	unsigned int y;
+
+	if (sscanf(str, "map-changes-since %lu", &version) != 1) {
+		remote_send(r, "sorry, invalid usage; should be 'map-changes-since version'\r\n");
+		return (0);
+	}
+
+	for (y = 0; y < map_height; y++) {
+		if (map_row_versions[y] <= version)
+			continue;
+		remote_send(r, "map-delta %lu 0 %d %.*s\r\n", map_row_versions[y], y,
+		    map_width, map_cells + (size_t)y * map_width);
+	}
+
+	remote_send(r, "ok, %lu\r\n", map_version);
+	return (0);
+}
+
+static int
+spectator_subscribe(struct remote *r, char *str, char **uptr)
+{
+	struct relay_actor *ra;
+
+	remote_send(r, "ok\r\n");
+	TAILQ_FOREACH(ra, &actors, ra_next)
+		remote_send(r, "actor-at %d %d %d '%c'\r\n", ra->ra_id, ra->ra_x, ra->ra_y, ra->ra_char);
+	return (0);
+}
+
+static int
+spectator_bye(struct remote *r, char *str, char **uptr)
+{
+
+	remote_send(r, "ok, see you next time\r\n");
+	return (0);
+}
+
+static int
+spectator_unknown(struct remote *r, char *str, char **uptr)
+{
+
+	remote_send(r, "sorry, spectators can only watch\r\n");
+	return (0);
+}
+
+static void
+spectator_add(int fd)
+{
+	struct spectator *s;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		err(1, "calloc");
+
+	s->s_fd = fd;
+	s->s_remote = remote_new(fd);
+	remote_set_queueing(s->s_remote);
+	TAILQ_INSERT_TAIL(&spectators, s, s_next);
+
+	remote_expect(s->s_remote, "map-get-size", spectator_map_get_size, (char **)s);
+	remote_expect(s->s_remote, "map-get-line", spectator_map_get_line, (char **)s);
+	remote_expect(s->s_remote, "map-changes-since", spectator_map_changes_since, (char **)s);
+	remote_expect(s->s_remote, "subscribe", spectator_subscribe, (char **)s);
+	remote_expect(s->s_remote, "bye", spectator_bye, (char **)s);
+	remote_expect(s->s_remote, "", spectator_unknown, (char **)s);
+}
+
+static void
+spectator_remove(struct spectator *s)
+{
+
+	TAILQ_REMOVE(&spectators, s, s_next);
+	remote_delete(s->s_remote);
+	free(s);
+}
+
+static int
+connect_to(const char *ip, int port)
+{
+	struct sockaddr_in sin;
+	int sock, error;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		err(1, "socket");
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, ip, &sin.sin_addr) != 1)
+		errx(1, "invalid ip address");
+
+	error = connect(sock, (struct sockaddr *)&sin, sizeof(sin));
+	if (error != 0)
+		err(1, "connect");
+
+	return (sock);
+}
+
+static int
+listen_on(int port)
+{
+	struct sockaddr_in sin;
+	int sock, error, flag;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		err(1, "socket");
+
+	flag = 1;
+	error = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+	if (error != 0)
+		err(1, "SO_REUSEADDR");
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = INADDR_ANY;
+
+	error = bind(sock, (struct sockaddr *)&sin, sizeof(sin));
+	if (error != 0)
+		err(1, "bind");
+
+	error = listen(sock, 42);
+	if (error != 0)
+		err(1, "listen");
+
+	return (sock);
+}
+
+static int
+fd_add(int fd, fd_set *fdset, int nfds)
+{
+
+	FD_SET(fd, fdset);
+	if (fd > nfds)
+		nfds = fd;
+	return (nfds);
+}
+
+static void
+usage(void)
+{
+
+	printf("usage: fwkrelay [-p port] hub-ip [hub-port]\n");
+	exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+	fd_set fdset, wfdset;
+	struct spectator *s, *tmp;
+	int ch, error, nfds, hub_fd, hub_port, fd, listening_socket, port = RELAY_PORT;
+	char buf[1];
+
+	while ((ch = getopt(argc, argv, "p:")) != -1) {
+		switch (ch) {
+		case 'p':
+			port = atoi(optarg);
+			if (port < 1 || port > 65535)
+				errx(1, "invalid port");
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1 || argc > 2)
+		usage();
+
+	if (argc == 2) {
+		hub_port = atoi(argv[1]);
+		if (hub_port <= 0 || hub_port > 65535)
+			errx(1, "invalid port number");
+	} else
+		hub_port = FAWORKEN_PORT;
+
+	TAILQ_INIT(&actors);
+	actor_buckets_resize(ACTOR_BUCKETS_MIN);
+	TAILQ_INIT(&spectators);
+
+	/*
+	 * Spectators going away in the middle of an update shouldn't take
+	 * the relay down with them.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
+	hub_fd = connect_to(argv[0], hub_port);
+	hub = remote_new(hub_fd);
+	hub_subscribe();
+
+	listening_socket = listen_on(port);
+
+	for (;;) {
+		FD_ZERO(&fdset);
+		FD_ZERO(&wfdset);
+		nfds = 0;
+		nfds = fd_add(hub_fd, &fdset, nfds);
+		nfds = fd_add(listening_socket, &fdset, nfds);
+		TAILQ_FOREACH(s, &spectators, s_next) {
+			nfds = fd_add(s->s_fd, &fdset, nfds);
+			if (remote_queued(s->s_remote) > 0)
+				nfds = fd_add(s->s_fd, &wfdset, nfds);
+		}
+
+		error = select(nfds + 1, &fdset, &wfdset, NULL, NULL);
+		if (error <= 0)
+			err(1, "select");
+
+		if (FD_ISSET(hub_fd, &fdset)) {
+			if (recv(hub_fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_PEEK) <= 0)
+				errx(1, "hub went away");
+			if (!remote_process(hub))
+				errx(1, "hub sent too long a line");
+		}
+
+		if (FD_ISSET(listening_socket, &fdset)) {
+			fd = accept(listening_socket, NULL, 0);
+			if (fd < 0)
+				err(1, "accept");
+			/*
+			 * It wouldn't fit in the fd_set.
+			 */
+			if (fd >= FD_SETSIZE) {
+				warnx("too many spectators");
+				close(fd);
+			} else
+				spectator_add(fd);
+		}
+
+		TAILQ_FOREACH_SAFE(s, &spectators, s_next, tmp) {
+			if (FD_ISSET(s->s_fd, &fdset) &&
+			    (recv(s->s_fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_PEEK) <= 0 ||
+			    !remote_process(s->s_remote))) {
+				spectator_remove(s);
+				continue;
+			}
+			if (FD_ISSET(s->s_fd, &wfdset) && !remote_flush(s->s_remote)) {
+				spectator_remove(s);
+				continue;
+			}
+			if (remote_queued(s->s_remote) > SPECTATOR_QUEUE_MAX) {
+				warnx("dropping a spectator that fell behind");
+				spectator_remove(s);
+			}
+		}
+	}
+
+	return (0);
+}
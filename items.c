@@ -0,0 +1,405 @@
+#include <sys/queue.h>
+#include <assert.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "items.h"
+#include "slotmap.h"
+
+/*
+ * Items are either lying on the floor, or inside a container, or nowhere,
+ * the way actor inventories are: those are containers that belong to the
+ * actor instead of being anywhere.  Wherever they are, items are kept
+ * in lists headed either by the container, or by the floor cell.
+ *
+ * Item records come from slabs of ITEMS_SLAB, with destroyed ones going
+ * on a free list, so that creating and destroying lots of them doesn't
+ * churn through malloc(3).  The floor is split into chunks, like the map,
+ * and every chunk has the list heads for its cells; chunks get allocated
+ * when the first item lands in them, and are kept from then on.
+ */
+
+#define	ITEMS_SLAB		1024
+#define	ITEM_CHUNK_SHIFT	4
+#define	ITEM_CHUNK_SIZE		(1 << ITEM_CHUNK_SHIFT)
+#define	ITEM_CHUNK_MASK		(ITEM_CHUNK_SIZE - 1)
+
+LIST_HEAD(item_list, item);
+
+struct item {
+	LIST_ENTRY(item)	it_next;
+	struct item_list	it_contents;
+	struct item_floor	*it_floor;
+	struct item		*it_container;
+	unsigned int		it_id;
+	unsigned int		it_x;
+	unsigned int		it_y;
+	char			it_char;
+	bool			it_is_container;
+	char			it_name[ITEM_NAME_MAX];
+};
+
+struct item_floor_chunk {
+	struct item_list	ifc_cells[ITEM_CHUNK_SIZE * ITEM_CHUNK_SIZE];
+};
+
+struct item_floor {
+	unsigned int		if_width;
+	unsigned int		if_height;
+	unsigned int		if_chunks_wide;
+	struct item_floor_chunk	**if_chunks;
+};
+
+struct items {
+	struct slotmap		*is_ids;
+	struct item		**is_slabs;
+	unsigned int		is_nslabs;
+	struct item_list	is_free;
+	unsigned int		is_count;
+};
+
+struct items *
+items_new(void)
+{
+	struct items *is;
+
+	is = calloc(1, sizeof(*is));
+	if (is == NULL)
+		err(1, "calloc");
+	is->is_ids = slotmap_new();
+	LIST_INIT(&is->is_free);
+
+	return (is);
+}
+
+/*
+ * Items still around go away with it.
+ */
+void
+items_delete(struct items *is)
+{
+	unsigned int i;
+
+	for (i = 0; i < is->is_nslabs; i++)
+		free(is->is_slabs[i]);
+	free(is->is_slabs);
+	slotmap_delete(is->is_ids);
+	free(is);
+}
+
+unsigned int
+items_count(struct items *is)
+{
+
+	return (is->is_count);
+}
+
+static void
+items_grow(struct items *is)
+{
+	struct item *slab;
+	unsigned int i;
+
+	is->is_slabs = realloc(is->is_slabs, (is->is_nslabs + 1) * sizeof(*is->is_slabs));
+	if (is->is_slabs == NULL)
+		err(1, "realloc");
+	slab = calloc(ITEMS_SLAB, sizeof(*slab));
+	if (slab == NULL)
+		err(1, "calloc");
+	is->is_slabs[is->is_nslabs++] = slab;
+
+	for (i = ITEMS_SLAB; i > 0; i--)
+		LIST_INSERT_HEAD(&is->is_free, &slab[i - 1], it_next);
+}
+
+/*
+ * The new item isn't anywhere yet.  Names longer than ITEM_NAME_MAX - 1
+ * get truncated.
+ */
+struct item *
+items_create(struct items *is, char ch, const char *name, bool container)
+{
+	struct item *it;
+
+	if (LIST_EMPTY(&is->is_free))
+		items_grow(is);
+	it = LIST_FIRST(&is->is_free);
+	LIST_REMOVE(it, it_next);
+
+	memset(it, 0, sizeof(*it));
+	LIST_INIT(&it->it_contents);
+	it->it_id = slotmap_alloc(is->is_ids, it);
+	it->it_char = ch;
+	it->it_is_container = container;
+	strlcpy(it->it_name, name, sizeof(it->it_name));
+	is->is_count++;
+
+	return (it);
+}
+
+/*
+ * Destroys the item, along with whatever is inside.
+ */
+void
+items_destroy(struct items *is, struct item *it)
+{
+	struct item *child;
+
+	item_remove(it);
+	while ((child = LIST_FIRST(&it->it_contents)) != NULL)
+		items_destroy(is, child);
+
+	slotmap_free(is->is_ids, it->it_id);
+	LIST_INSERT_HEAD(&is->is_free, it, it_next);
+	is->is_count--;
+}
+
+struct item *
+items_find(struct items *is, unsigned int id)
+{
+
+	return (slotmap_get(is->is_ids, id));
+}
+
+unsigned int
+item_get_id(const struct item *it)
+{
+
+	return (it->it_id);
+}
+
+char
+item_get_char(const struct item *it)
+{
+
+	return (it->it_char);
+}
+
+const char *
+item_get_name(const struct item *it)
+{
+
+	return (it->it_name);
+}
+
+bool
+item_is_container(const struct item *it)
+{
+
+	return (it->it_is_container);
+}
+
+/*
+ * Returns NULL if the item isn't inside a container.
+ */
+struct item *
+item_get_container(const struct item *it)
+{
+
+	return (it->it_container);
+}
+
+/*
+ * Returns the floor the item is lying on, or NULL if it isn't.
+ */
+struct item_floor *
+item_get_position(const struct item *it, unsigned int *x, unsigned int *y)
+{
+
+	if (it->it_floor == NULL)
+		return (NULL);
+
+	*x = it->it_x;
+	*y = it->it_y;
+	return (it->it_floor);
+}
+
+/*
+ * Returns the outermost container, or the item itself if it's not in one.
+ */
+struct item *
+item_get_root(struct item *it)
+{
+
+	while (it->it_container != NULL)
+		it = it->it_container;
+
+	return (it);
+}
+
+struct item *
+item_first(const struct item *container)
+{
+
+	return (LIST_FIRST(&container->it_contents));
+}
+
+/*
+ * Returns the next item in the same place: the same floor cell,
+ * or the same container.
+ */
+struct item *
+item_next(const struct item *it)
+{
+
+	return (LIST_NEXT(it, it_next));
+}
+
+/*
+ * Take the item from wherever it is; afterwards it's nowhere.
+ */
+void
+item_remove(struct item *it)
+{
+
+	if (it->it_floor == NULL && it->it_container == NULL)
+		return;
+
+	LIST_REMOVE(it, it_next);
+	it->it_floor = NULL;
+	it->it_container = NULL;
+}
+
+static struct item_list *
+item_floor_cell(struct item_floor *fl, unsigned int x, unsigned int y)
+{
+	struct item_floor_chunk **ifcp;
+
+	ifcp = &fl->if_chunks[(y >> ITEM_CHUNK_SHIFT) * fl->if_chunks_wide + (x >> ITEM_CHUNK_SHIFT)];
+	if (*ifcp == NULL) {
+		/*
+		 * All zeroes is what LIST_INIT() does.
+		 */
+		*ifcp = calloc(1, sizeof(**ifcp));
+		if (*ifcp == NULL)
+			err(1, "calloc");
+	}
+
+	return (&(*ifcp)->ifc_cells[(y & ITEM_CHUNK_MASK) * ITEM_CHUNK_SIZE + (x & ITEM_CHUNK_MASK)]);
+}
+
+void
+item_drop(struct item *it, struct item_floor *fl, unsigned int x, unsigned int y)
+{
+
+	assert(x < fl->if_width && y < fl->if_height);
+
+	item_remove(it);
+	LIST_INSERT_HEAD(item_floor_cell(fl, x, y), it, it_next);
+	it->it_floor = fl;
+	it->it_x = x;
+	it->it_y = y;
+}
+
+/*
+ * How deep the nesting goes inside the item; zero for an empty one.
+ */
+static unsigned int
+item_height(const struct item *it)
+{
+	const struct item *child;
+	unsigned int height = 0, h;
+
+	LIST_FOREACH(child, &it->it_contents, it_next) {
+		h = item_height(child) + 1;
+		if (h > height)
+			height = h;
+	}
+
+	return (height);
+}
+
+/*
+ * Put the item into the container.  Returns false if it can't go there:
+ * it's not a container, or it's inside the item being put, or the nesting
+ * would get deeper than ITEM_NESTING_MAX.
+ */
+bool
+item_put(struct item *it, struct item *container)
+{
+	struct item *parent;
+	unsigned int depth = 0;
+
+	if (!container->it_is_container)
+		return (false);
+
+	for (parent = container; parent != NULL; parent = parent->it_container) {
+		if (parent == it)
+			return (false);
+		depth++;
+	}
+	if (depth + item_height(it) > ITEM_NESTING_MAX)
+		return (false);
+
+	item_remove(it);
+	LIST_INSERT_HEAD(&container->it_contents, it, it_next);
+	it->it_container = container;
+	return (true);
+}
+
+struct item_floor *
+item_floor_new(unsigned int width, unsigned int height)
+{
+	struct item_floor *fl;
+
+	fl = calloc(1, sizeof(*fl));
+	if (fl == NULL)
+		err(1, "calloc");
+
+	fl->if_width = width;
+	fl->if_height = height;
+	fl->if_chunks_wide = (width + ITEM_CHUNK_MASK) >> ITEM_CHUNK_SHIFT;
+	fl->if_chunks = calloc(fl->if_chunks_wide * ((height + ITEM_CHUNK_MASK) >> ITEM_CHUNK_SHIFT),
+	    sizeof(*fl->if_chunks));
+	if (fl->if_chunks == NULL)
+		err(1, "calloc");
+
+	return (fl);
+}
+
+/*
+ * Destroys all the items lying on the floor.
+ */
+void
+item_floor_delete(struct items *is, struct item_floor *fl)
+{
+	struct item_floor_chunk *ifc;
+	struct item *it;
+	unsigned int c, nchunks, i;
+
+	nchunks = fl->if_chunks_wide * ((fl->if_height + ITEM_CHUNK_MASK) >> ITEM_CHUNK_SHIFT);
+	for (c = 0; c < nchunks; c++) {
+		ifc = fl->if_chunks[c];
+		if (ifc == NULL)
+			continue;
+		for (i = 0; i < ITEM_CHUNK_SIZE * ITEM_CHUNK_SIZE; i++) {
+			while ((it = LIST_FIRST(&ifc->ifc_cells[i])) != NULL)
+				items_destroy(is, it);
+		}
+		free(ifc);
+	}
+
+	free(fl->if_chunks);
+	free(fl);
+}
+
+/*
+ * Returns the first item lying at (x, y), or NULL if there are none;
+ * item_next() gives the rest.
+ */
+struct item *
+item_floor_first(struct item_floor *fl, unsigned int x, unsigned int y)
+{
+	struct item_floor_chunk *ifc;
+
+	if (x >= fl->if_width || y >= fl->if_height)
+		return (NULL);
+
+	ifc = fl->if_chunks[(y >> ITEM_CHUNK_SHIFT) * fl->if_chunks_wide + (x >> ITEM_CHUNK_SHIFT)];
+	if (ifc == NULL)
+		return (NULL);
+
+	return (LIST_FIRST(&ifc->ifc_cells[(y & ITEM_CHUNK_MASK) * ITEM_CHUNK_SIZE + (x & ITEM_CHUNK_MASK)]));
+}
@@ -0,0 +1,37 @@
+#ifndef ITEMS_H
+#define	ITEMS_H
+
+#include <stdbool.h>
+
+#define	ITEM_NAME_MAX		32
+#define	ITEM_NESTING_MAX	8
+
+struct items;
+struct item;
+struct item_floor;
+
+struct items		*items_new(void);
+void			items_delete(struct items *is);
+unsigned int		items_count(struct items *is);
+struct item		*items_create(struct items *is, char ch, const char *name, bool container);
+void			items_destroy(struct items *is, struct item *it);
+struct item		*items_find(struct items *is, unsigned int id);
+
+unsigned int		item_get_id(const struct item *it);
+char			item_get_char(const struct item *it);
+const char		*item_get_name(const struct item *it);
+bool			item_is_container(const struct item *it);
+struct item		*item_get_container(const struct item *it);
+struct item_floor	*item_get_position(const struct item *it, unsigned int *x, unsigned int *y);
+struct item		*item_get_root(struct item *it);
+struct item		*item_first(const struct item *container);
+struct item		*item_next(const struct item *it);
+void			item_remove(struct item *it);
+void			item_drop(struct item *it, struct item_floor *fl, unsigned int x, unsigned int y);
+bool			item_put(struct item *it, struct item *container);
+
+struct item_floor	*item_floor_new(unsigned int width, unsigned int height);
+void			item_floor_delete(struct items *is, struct item_floor *fl);
+struct item		*item_floor_first(struct item_floor *fl, unsigned int x, unsigned int y);
+
+#endif /* !ITEMS_H */
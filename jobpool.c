@@ -0,0 +1,264 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jobpool.h"
+
+/*
+ * A pool of threads for running the same function over batches of a range,
+ * in parallel.  Batches are dealt out to per-thread queues; every thread
+ * takes work from the back of its own queue, and once it's empty, steals
+ * from the front of the others'.  The calling thread joins in, with a queue
+ * of its own, and returns when all the batches are done.
+ */
+
+struct job {
+	unsigned int	j_begin;
+	unsigned int	j_end;
+};
+
+struct job_queue {
+	pthread_mutex_t	jq_lock;
+	struct job	*jq_jobs;
+	unsigned int	jq_head;
+	unsigned int	jq_tail;
+	unsigned int	jq_size;
+};
+
+struct jobpool {
+	unsigned int	jp_nthreads;
+	pthread_t	*jp_threads;
+	struct job_queue *jp_queues;	/* one per thread, plus the caller's */
+	pthread_mutex_t	jp_lock;
+	pthread_cond_t	jp_work_cv;
+	pthread_cond_t	jp_done_cv;
+	unsigned long	jp_generation;
+	unsigned int	jp_pending;
+	bool		jp_exiting;
+	void		(*jp_fn)(void *arg, unsigned int begin, unsigned int end);
+	void		*jp_arg;
+};
+
+struct jobpool_thread {
+	struct jobpool	*jt_pool;
+	unsigned int	jt_index;
+};
+
+static bool
+jobpool_take(struct jobpool *jp, unsigned int self, struct job *j)
+{
+	struct job_queue *jq;
+	unsigned int i;
+
+	jq = &jp->jp_queues[self];
+	pthread_mutex_lock(&jq->jq_lock);
+	if (jq->jq_head < jq->jq_tail) {
+		*j = jq->jq_jobs[--jq->jq_tail];
+		pthread_mutex_unlock(&jq->jq_lock);
+		return (true);
+	}
+	pthread_mutex_unlock(&jq->jq_lock);
+
+	for (i = 1; i <= jp->jp_nthreads; i++) {
+		jq = &jp->jp_queues[(self + i) % (jp->jp_nthreads + 1)];
+		pthread_mutex_lock(&jq->jq_lock);
+		if (jq->jq_head < jq->jq_tail) {
+			*j = jq->jq_jobs[jq->jq_head++];
+			pthread_mutex_unlock(&jq->jq_lock);
+			return (true);
+		}
+		pthread_mutex_unlock(&jq->jq_lock);
+	}
+
+	return (false);
+}
+
+static void
+jobpool_work(struct jobpool *jp, unsigned int self)
+{
+	struct job j;
+
+	while (jobpool_take(jp, self, &j)) {
+		jp->jp_fn(jp->jp_arg, j.j_begin, j.j_end);
+
+		pthread_mutex_lock(&jp->jp_lock);
+		jp->jp_pending--;
+		if (jp->jp_pending == 0)
+			pthread_cond_broadcast(&jp->jp_done_cv);
+		pthread_mutex_unlock(&jp->jp_lock);
+	}
+}
+
+static void *
+jobpool_thread(void *arg)
+{
+	struct jobpool_thread *jt;
+	struct jobpool *jp;
+	unsigned long generation = 0;
+	unsigned int self;
+
+	jt = arg;
+	jp = jt->jt_pool;
+	self = jt->jt_index;
+	free(jt);
+
+	for (;;) {
+		pthread_mutex_lock(&jp->jp_lock);
+		while (jp->jp_generation == generation && !jp->jp_exiting)
+			pthread_cond_wait(&jp->jp_work_cv, &jp->jp_lock);
+		if (jp->jp_exiting) {
+			pthread_mutex_unlock(&jp->jp_lock);
+			return (NULL);
+		}
+		generation = jp->jp_generation;
+		pthread_mutex_unlock(&jp->jp_lock);
+
+		jobpool_work(jp, self);
+	}
+}
+
+/*
+ * With "nthreads" being zero, use as many threads as there are CPUs,
+ * counting the caller.
+ */
+struct jobpool *
+jobpool_new(unsigned int nthreads)
+{
+	struct jobpool *jp;
+	struct jobpool_thread *jt;
+	unsigned int i;
+	long ncpus;
+	int error;
+
+	if (nthreads == 0) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 1 ? ncpus - 1 : 0;
+	}
+
+	jp = calloc(1, sizeof(*jp));
+	if (jp == NULL)
+		err(1, "calloc");
+	jp->jp_nthreads = nthreads;
+	jp->jp_threads = calloc(nthreads, sizeof(*jp->jp_threads));
+	jp->jp_queues = calloc(nthreads + 1, sizeof(*jp->jp_queues));
+	if ((nthreads > 0 && jp->jp_threads == NULL) || jp->jp_queues == NULL)
+		err(1, "calloc");
+	pthread_mutex_init(&jp->jp_lock, NULL);
+	pthread_cond_init(&jp->jp_work_cv, NULL);
+	pthread_cond_init(&jp->jp_done_cv, NULL);
+	for (i = 0; i <= nthreads; i++)
+		pthread_mutex_init(&jp->jp_queues[i].jq_lock, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		jt = malloc(sizeof(*jt));
+		if (jt == NULL)
+			err(1, "malloc");
+		jt->jt_pool = jp;
+		jt->jt_index = i;
+		error = pthread_create(&jp->jp_threads[i], NULL, jobpool_thread, jt);
+		if (error != 0)
+			errx(1, "pthread_create: %s", strerror(error));
+	}
+
+	return (jp);
+}
+
+void
+jobpool_delete(struct jobpool *jp)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&jp->jp_lock);
+	jp->jp_exiting = true;
+	pthread_cond_broadcast(&jp->jp_work_cv);
+	pthread_mutex_unlock(&jp->jp_lock);
+
+	for (i = 0; i < jp->jp_nthreads; i++)
+		pthread_join(jp->jp_threads[i], NULL);
+
+	for (i = 0; i <= jp->jp_nthreads; i++) {
+		pthread_mutex_destroy(&jp->jp_queues[i].jq_lock);
+		free(jp->jp_queues[i].jq_jobs);
+	}
+	pthread_mutex_destroy(&jp->jp_lock);
+	pthread_cond_destroy(&jp->jp_work_cv);
+	pthread_cond_destroy(&jp->jp_done_cv);
+	free(jp->jp_queues);
+	free(jp->jp_threads);
+	free(jp);
+}
+
+unsigned int
+jobpool_get_nthreads(struct jobpool *jp)
+{
+
+	return (jp->jp_nthreads + 1);
+}
+
+/*
+ * Call "fn" for [0, n), split into batches of "batch" elements, and wait
+ * for all of them to finish.  Batches may run in any order, concurrently.
+ */
+void
+jobpool_run(struct jobpool *jp, void (*fn)(void *arg, unsigned int begin, unsigned int end),
+    void *arg, unsigned int n, unsigned int batch)
+{
+	struct job_queue *jq;
+	unsigned int begin, i, nbatches;
+
+	if (n == 0)
+		return;
+	if (batch == 0)
+		batch = 1;
+
+	nbatches = (n + batch - 1) / batch;
+	if (jp->jp_nthreads == 0 || nbatches == 1) {
+		fn(arg, 0, n);
+		return;
+	}
+
+	pthread_mutex_lock(&jp->jp_lock);
+	jp->jp_fn = fn;
+	jp->jp_arg = arg;
+	jp->jp_pending = nbatches;
+
+	for (i = 0; i <= jp->jp_nthreads; i++) {
+		jq = &jp->jp_queues[i];
+		pthread_mutex_lock(&jq->jq_lock);
+		jq->jq_head = jq->jq_tail = 0;
+		if (jq->jq_size < nbatches / (jp->jp_nthreads + 1) + 1) {
+			jq->jq_size = nbatches / (jp->jp_nthreads + 1) + 1;
+			jq->jq_jobs = realloc(jq->jq_jobs, jq->jq_size * sizeof(*jq->jq_jobs));
+			if (jq->jq_jobs == NULL)
+				err(1, "realloc");
+		}
+		pthread_mutex_unlock(&jq->jq_lock);
+	}
+
+	/*
+	 * Deal the batches out like cards, so that every queue gets
+	 * a similar share.
+	 */
+	for (begin = 0, i = 0; begin < n; begin += batch, i++) {
+		jq = &jp->jp_queues[i % (jp->jp_nthreads + 1)];
+		pthread_mutex_lock(&jq->jq_lock);
+		jq->jq_jobs[jq->jq_tail].j_begin = begin;
+		jq->jq_jobs[jq->jq_tail].j_end = begin + batch < n ? begin + batch : n;
+		jq->jq_tail++;
+		pthread_mutex_unlock(&jq->jq_lock);
+	}
+
+	jp->jp_generation++;
+	pthread_cond_broadcast(&jp->jp_work_cv);
+	pthread_mutex_unlock(&jp->jp_lock);
+
+	jobpool_work(jp, jp->jp_nthreads);
+
+	pthread_mutex_lock(&jp->jp_lock);
+	while (jp->jp_pending > 0)
+		pthread_cond_wait(&jp->jp_done_cv, &jp->jp_lock);
+	pthread_mutex_unlock(&jp->jp_lock);
+}
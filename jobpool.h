@@ -0,0 +1,12 @@
+#ifndef JOBPOOL_H
+#define	JOBPOOL_H
+
+struct jobpool;
+
+struct jobpool	*jobpool_new(unsigned int nthreads);
+void		jobpool_delete(struct jobpool *jp);
+unsigned int	jobpool_get_nthreads(struct jobpool *jp);
+void		jobpool_run(struct jobpool *jp, void (*fn)(void *arg, unsigned int begin, unsigned int end),
+		    void *arg, unsigned int n, unsigned int batch);
+
+#endif /* !JOBPOOL_H */
@@ -0,0 +1,539 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+/*
+ * The journal directory contains files named "snapshot.N" and "journal.N".
+ * Snapshot N is the state of the world right before the first record
+ * in journal N.  To recover, load the newest snapshot and replay journals
+ * starting from the one with the same generation number.
+ *
+ * Snapshots are written by a child process, forked off the hub; that way
+ * the child gets a consistent, copy-on-write view of the world, and the
+ * parent can keep on serving clients in the meantime.
+ *
+ * The hub only ever write(2)s to the journal; fdatasync(2) is done
+ * by a separate thread, so that a slow disk doesn't stall the event loop.
+ */
+
+#define	JOURNAL_SYNC_INTERVAL		1	/* seconds */
+#define	JOURNAL_CHECKPOINT_INTERVAL	300	/* seconds */
+#define	JOURNAL_CHECKPOINT_RECORDS	100000
+
+struct journal {
+	char		*j_dir;
+	int		j_fd;
+	unsigned int	j_gen;
+	unsigned int	j_oldest_gen;
+	unsigned int	j_snapshot_gen;
+	char		*j_buf;
+	size_t		j_buffered;
+	size_t		j_buf_size;
+	bool		j_unsynced;
+	unsigned int	j_records;
+	time_t		j_last_sync;
+	time_t		j_last_checkpoint;
+	pid_t		j_child;
+	unsigned int	j_child_gen;
+
+	/*
+	 * Protected by j_lock.  The sync thread syncs j_sync_fd; j_retire_fd
+	 * is the previous generation's descriptor, to be synced and closed
+	 * before that.  Either is -1 if there's nothing to do.
+	 */
+	pthread_t	j_thread;
+	pthread_mutex_t	j_lock;
+	pthread_cond_t	j_cv;
+	int		j_sync_fd;
+	int		j_retire_fd;
+	bool		j_syncing;
+	bool		j_exiting;
+};
+
+static char *
+journal_path(struct journal *j, const char *name, unsigned int gen, const char *suffix)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s.%u%s", j->j_dir, name, gen, suffix) < 0)
+		err(1, "asprintf");
+
+	return (path);
+}
+
+static int
+journal_open_gen(struct journal *j, unsigned int gen)
+{
+	char *path;
+	int fd;
+
+	path = journal_path(j, "journal", gen, "");
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0)
+		err(1, "%s", path);
+	free(path);
+
+	return (fd);
+}
+
+/*
+ * Returns the generation number, or 0 if the name doesn't match.
+ */
+static unsigned int
+journal_parse_name(const char *name, const char *prefix)
+{
+	unsigned int gen;
+	int len = 0;
+
+	if (strncmp(name, prefix, strlen(prefix)) != 0)
+		return (0);
+	if (sscanf(name + strlen(prefix), ".%u%n", &gen, &len) != 1)
+		return (0);
+	if (name[strlen(prefix) + len] != '\0')
+		return (0);
+
+	return (gen);
+}
+
+static void *
+journal_sync_thread(void *arg)
+{
+	struct journal *j;
+	int sync_fd, retire_fd;
+
+	j = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&j->j_lock);
+		j->j_syncing = false;
+		pthread_cond_broadcast(&j->j_cv);
+		while (j->j_sync_fd < 0 && j->j_retire_fd < 0 && !j->j_exiting)
+			pthread_cond_wait(&j->j_cv, &j->j_lock);
+		if (j->j_sync_fd < 0 && j->j_retire_fd < 0) {
+			pthread_mutex_unlock(&j->j_lock);
+			return (NULL);
+		}
+		sync_fd = j->j_sync_fd;
+		retire_fd = j->j_retire_fd;
+		j->j_sync_fd = j->j_retire_fd = -1;
+		j->j_syncing = true;
+		pthread_mutex_unlock(&j->j_lock);
+
+		/*
+		 * The older generation goes first, so that the records
+		 * on disk never have a hole in them.
+		 */
+		if (retire_fd >= 0) {
+			if (fdatasync(retire_fd) != 0)
+				err(1, "fdatasync");
+			close(retire_fd);
+		}
+		if (sync_fd >= 0 && fdatasync(sync_fd) != 0)
+			err(1, "fdatasync");
+	}
+}
+
+struct journal *
+journal_open(const char *dir)
+{
+	struct journal *j;
+	struct dirent *de;
+	DIR *d;
+	unsigned int gen, last_gen = 0;
+	int error;
+
+	j = calloc(1, sizeof(*j));
+	if (j == NULL)
+		err(1, "calloc");
+	j->j_dir = strdup(dir);
+	if (j->j_dir == NULL)
+		err(1, "strdup");
+	j->j_buf_size = 65536;
+	j->j_buf = malloc(j->j_buf_size);
+	if (j->j_buf == NULL)
+		err(1, "malloc");
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		err(1, "%s", dir);
+
+	d = opendir(dir);
+	if (d == NULL)
+		err(1, "%s", dir);
+	j->j_oldest_gen = UINT_MAX;
+	while ((de = readdir(d)) != NULL) {
+		gen = journal_parse_name(de->d_name, "snapshot");
+		if (gen > j->j_snapshot_gen)
+			j->j_snapshot_gen = gen;
+		if (gen == 0)
+			gen = journal_parse_name(de->d_name, "journal");
+		if (gen == 0)
+			continue;
+		if (gen > last_gen)
+			last_gen = gen;
+		if (gen < j->j_oldest_gen)
+			j->j_oldest_gen = gen;
+	}
+	closedir(d);
+
+	/*
+	 * Never append to an existing journal; its last record might be torn.
+	 */
+	j->j_gen = last_gen + 1;
+	if (j->j_oldest_gen == UINT_MAX)
+		j->j_oldest_gen = j->j_gen;
+	j->j_fd = journal_open_gen(j, j->j_gen);
+	j->j_last_sync = j->j_last_checkpoint = time(NULL);
+
+	j->j_sync_fd = j->j_retire_fd = -1;
+	pthread_mutex_init(&j->j_lock, NULL);
+	pthread_cond_init(&j->j_cv, NULL);
+	error = pthread_create(&j->j_thread, NULL, journal_sync_thread, j);
+	if (error != 0)
+		errx(1, "pthread_create: %s", strerror(error));
+
+	return (j);
+}
+
+static bool
+journal_replay_file(const char *path, void (*callback)(char *record, void *arg), void *arg)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			warn("%s", path);
+		return (false);
+	}
+
+	while ((len = getline(&line, &linecap, fp)) > 0) {
+		if (line[len - 1] != '\n') {
+			warnx("%s: ignoring torn record at the end", path);
+			break;
+		}
+		line[len - 1] = '\0';
+		callback(line, arg);
+	}
+
+	free(line);
+	fclose(fp);
+	return (true);
+}
+
+bool
+journal_replay(struct journal *j, void (*callback)(char *record, void *arg), void *arg)
+{
+	unsigned int gen;
+	char *path;
+	bool replayed = false;
+
+	if (j->j_snapshot_gen != 0) {
+		path = journal_path(j, "snapshot", j->j_snapshot_gen, "");
+		replayed = journal_replay_file(path, callback, arg);
+		free(path);
+		gen = j->j_snapshot_gen;
+	} else
+		gen = j->j_oldest_gen;
+
+	for (; gen < j->j_gen; gen++) {
+		path = journal_path(j, "journal", gen, "");
+		if (journal_replay_file(path, callback, arg))
+			replayed = true;
+		free(path);
+	}
+
+	return (replayed);
+}
+
+void
+journal_append(struct journal *j, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	for (;;) {
+		va_start(args, fmt);
+		len = vsnprintf(j->j_buf + j->j_buffered, j->j_buf_size - j->j_buffered, fmt, args);
+		va_end(args);
+		if (len < 0)
+			err(1, "vsnprintf");
+		if ((size_t)len < j->j_buf_size - j->j_buffered)
+			break;
+
+		j->j_buf_size *= 2;
+		j->j_buf = realloc(j->j_buf, j->j_buf_size);
+		if (j->j_buf == NULL)
+			err(1, "realloc");
+	}
+
+	j->j_buffered += len;
+	j->j_records++;
+}
+
+static int
+journal_write_buffer(struct journal *j)
+{
+	size_t written = 0;
+	ssize_t len;
+
+	while (written < j->j_buffered) {
+		len = write(j->j_fd, j->j_buf + written, j->j_buffered - written);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		written += len;
+	}
+	j->j_buffered = 0;
+
+	return (0);
+}
+
+/*
+ * Hand the journal over to the sync thread, unless it's still busy
+ * with the previous one; then it's up to the next journal_flush().
+ */
+static void
+journal_sync(struct journal *j)
+{
+
+	pthread_mutex_lock(&j->j_lock);
+	if (j->j_syncing || j->j_sync_fd >= 0) {
+		pthread_mutex_unlock(&j->j_lock);
+		return;
+	}
+	j->j_sync_fd = j->j_fd;
+	pthread_cond_broadcast(&j->j_cv);
+	pthread_mutex_unlock(&j->j_lock);
+
+	j->j_unsynced = false;
+	j->j_last_sync = time(NULL);
+}
+
+/*
+ * Called once per hub iteration, after the replies have been sent.
+ * Records are written out in a single write(2); the sync thread gets
+ * to fdatasync(2) them at most once per JOURNAL_SYNC_INTERVAL.
+ */
+void
+journal_flush(struct journal *j)
+{
+
+	if (j->j_buffered > 0) {
+		if (journal_write_buffer(j) != 0)
+			err(1, "write");
+		j->j_unsynced = true;
+	}
+
+	if (j->j_unsynced && time(NULL) - j->j_last_sync >= JOURNAL_SYNC_INTERVAL)
+		journal_sync(j);
+}
+
+/*
+ * Returns false if everything written has been synced; otherwise, "when"
+ * is the time(3) from which journal_flush() will sync it.
+ */
+bool
+journal_sync_due(struct journal *j, time_t *when)
+{
+
+	if (!j->j_unsynced)
+		return (false);
+
+	*when = j->j_last_sync + JOURNAL_SYNC_INTERVAL;
+	return (true);
+}
+
+bool
+journal_checkpoint_due(struct journal *j)
+{
+
+	if (j->j_child != 0)
+		return (false);
+	if (j->j_records >= JOURNAL_CHECKPOINT_RECORDS)
+		return (true);
+	if (j->j_records > 0 && time(NULL) - j->j_last_checkpoint >= JOURNAL_CHECKPOINT_INTERVAL)
+		return (true);
+	return (false);
+}
+
+static void
+journal_write_snapshot(struct journal *j, unsigned int gen, void (*dump)(struct journal *j, void *arg), void *arg)
+{
+	char *tmp_path, *path;
+	int fd;
+
+	tmp_path = journal_path(j, "snapshot", gen, ".tmp");
+	path = journal_path(j, "snapshot", gen, "");
+
+	j->j_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (j->j_fd < 0) {
+		warn("%s", tmp_path);
+		_exit(1);
+	}
+
+	dump(j, arg);
+
+	if (journal_write_buffer(j) != 0 || fsync(j->j_fd) != 0) {
+		warn("%s", tmp_path);
+		_exit(1);
+	}
+	close(j->j_fd);
+
+	if (rename(tmp_path, path) != 0) {
+		warn("rename");
+		_exit(1);
+	}
+
+	fd = open(j->j_dir, O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+
+	_exit(0);
+}
+
+void
+journal_checkpoint(struct journal *j, void (*dump)(struct journal *j, void *arg), void *arg)
+{
+	unsigned int gen;
+	pid_t pid;
+	int fd;
+
+	if (j->j_child != 0)
+		return;
+
+	/*
+	 * Make sure the current journal is complete before starting
+	 * a new one; the new snapshot will replace both.  The sync thread
+	 * syncs and closes it before it gets to the new one.
+	 */
+	journal_flush(j);
+
+	gen = j->j_gen + 1;
+	fd = journal_open_gen(j, gen);
+
+	pid = fork();
+	if (pid < 0) {
+		warn("fork");
+		close(fd);
+		return;
+	}
+	if (pid == 0) {
+		close(fd);
+		close(j->j_fd);
+		journal_write_snapshot(j, gen, dump, arg);
+		/* NOTREACHED */
+	}
+
+	pthread_mutex_lock(&j->j_lock);
+	while (j->j_retire_fd >= 0)
+		pthread_cond_wait(&j->j_cv, &j->j_lock);
+	j->j_retire_fd = j->j_fd;
+	if (j->j_sync_fd == j->j_fd)
+		j->j_sync_fd = -1;
+	pthread_cond_broadcast(&j->j_cv);
+	pthread_mutex_unlock(&j->j_lock);
+
+	j->j_fd = fd;
+	j->j_unsynced = false;
+	j->j_gen = gen;
+	j->j_child = pid;
+	j->j_child_gen = gen;
+	j->j_records = 0;
+	j->j_last_checkpoint = time(NULL);
+}
+
+static void
+journal_child_exited(struct journal *j, int status)
+{
+	unsigned int gen;
+	char *path;
+
+	j->j_child = 0;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		warnx("checkpoint %u failed; keeping the older journals", j->j_child_gen);
+		return;
+	}
+
+	/*
+	 * The snapshot is safely on disk; everything older is redundant.
+	 */
+	for (gen = j->j_oldest_gen; gen < j->j_child_gen; gen++) {
+		path = journal_path(j, "journal", gen, "");
+		unlink(path);
+		free(path);
+		path = journal_path(j, "snapshot", gen, "");
+		unlink(path);
+		free(path);
+	}
+	j->j_oldest_gen = j->j_snapshot_gen = j->j_child_gen;
+}
+
+void
+journal_reap(struct journal *j)
+{
+	pid_t pid;
+	int status;
+
+	if (j->j_child == 0)
+		return;
+
+	pid = waitpid(j->j_child, &status, WNOHANG);
+	if (pid < 0)
+		err(1, "waitpid");
+	if (pid == 0)
+		return;
+
+	journal_child_exited(j, status);
+}
+
+void
+journal_close(struct journal *j)
+{
+	int status;
+
+	journal_flush(j);
+
+	pthread_mutex_lock(&j->j_lock);
+	j->j_exiting = true;
+	pthread_cond_broadcast(&j->j_cv);
+	pthread_mutex_unlock(&j->j_lock);
+	pthread_join(j->j_thread, NULL);
+	if (j->j_unsynced && fdatasync(j->j_fd) != 0)
+		err(1, "fdatasync");
+
+	if (j->j_child != 0) {
+		if (waitpid(j->j_child, &status, 0) < 0)
+			err(1, "waitpid");
+		journal_child_exited(j, status);
+	}
+
+	close(j->j_fd);
+	pthread_cond_destroy(&j->j_cv);
+	pthread_mutex_destroy(&j->j_lock);
+	free(j->j_buf);
+	free(j->j_dir);
+	free(j);
+}
@@ -0,0 +1,19 @@
+#ifndef JOURNAL_H
+#define	JOURNAL_H
+
+#include <stdbool.h>
+#include <time.h>
+
+struct journal;
+
+struct journal	*journal_open(const char *dir);
+void		journal_close(struct journal *j);
+bool		journal_replay(struct journal *j, void (*callback)(char *record, void *arg), void *arg);
+void		journal_append(struct journal *j, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void		journal_flush(struct journal *j);
+bool		journal_sync_due(struct journal *j, time_t *when);
+bool		journal_checkpoint_due(struct journal *j);
+void		journal_checkpoint(struct journal *j, void (*dump)(struct journal *j, void *arg), void *arg);
+void		journal_reap(struct journal *j);
+
+#endif /* !JOURNAL_H */
@@ -1,34 +1,308 @@
+#include <sys/queue.h>
 #include <assert.h>
 #include <err.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "window.h"
 #include "map.h"
 
+/*
+ * Map data is split into square chunks.  Maps instantiated from a template
+ * share the template's chunks; a chunk gets copied on the first write
+ * to a shared chunk.
+ */
+#define	MAP_CHUNK_SHIFT		4
+#define	MAP_CHUNK_SIZE		(1 << MAP_CHUNK_SHIFT)
+#define	MAP_CHUNK_MASK		(MAP_CHUNK_SIZE - 1)
+
+struct map_chunk {
+	unsigned int	mc_refcount;
+	char		mc_data[MAP_CHUNK_SIZE * MAP_CHUNK_SIZE];
+};
+
+#define	MAP_REGION_NONE		UINT_MAX
+
+/*
+ * Random guesses at an empty spot for a new actor, before looking
+ * through the cells one by one.
+ */
+#define	MAP_SPOT_TRIES		64
+
+/*
+ * Every change bumps the map version, and stamps the row with it, so that
+ * clients can ask for the rows changed since the version they have.
+ * Additionally, the span of cells changed in each row is tracked until
+ * map_clear_dirty(), to push the changes to the clients.
+ */
+
+/*
+ * Actors are indexed in two ways: every chunk has a bucket listing actors
+ * within it, for area queries, and every cell points to the actor standing
+ * there, for collisions.  Both are allocated when the first actor appears.
+ * Actors restored from the journal might share a cell; the cell then points
+ * to any one of them.
+ */
+LIST_HEAD(map_bucket, actor);
+
+/*
+ * Watches are rectangles someone is interested in, like the clients' views.
+ * They're indexed by the same chunks as actors, with a link in the bucket
+ * of every chunk the rectangle touches, so that finding the watches covering
+ * a cell only looks at those that are nearby.
+ */
+struct map_watch_link {
+	LIST_ENTRY(map_watch_link) mwl_next;
+	struct map_watch *mwl_watch;
+};
+
+LIST_HEAD(map_watch_bucket, map_watch_link);
+
+struct map_watch {
+	struct map	*mw_map;
+	void		*mw_uptr;
+	unsigned int	mw_x;
+	unsigned int	mw_y;
+	unsigned int	mw_w;
+	unsigned int	mw_h;
+	struct map_watch_link *mw_links;
+	unsigned int	mw_nlinks;
+};
+
+/*
+ * Connected floor cells form regions, kept in a union-find structure indexed
+ * by cell.  Adding floor only merges regions, so it's done incrementally;
+ * adding a wall might split one, and then everything gets relabeled the next
+ * time it's needed.  It's allocated lazily, since it costs eight bytes
+ * per cell, and most instances never need it.
+ */
 struct map {
 	unsigned int	m_width;
 	unsigned int	m_height;
 	unsigned int	m_number_of_cells;
 	unsigned int	m_number_of_empty_cells;
-	char		*m_data;
+	unsigned int	m_chunks_wide;
+	unsigned int	m_chunks_high;
+	struct map_chunk **m_chunks;
+	unsigned int	*m_region_parent;
+	unsigned int	*m_region_size;
+	unsigned int	m_region_largest;
+	bool		m_regions_valid;
+	bool		m_may_be_split;
+	unsigned long	m_version;
+	unsigned long	*m_row_version;
+	unsigned int	*m_row_dirty_x0;
+	unsigned int	*m_row_dirty_x1;
+	unsigned int	m_dirty_y0;
+	unsigned int	m_dirty_y1;
+	struct map_bucket *m_buckets;
+	struct actor	**m_occupant;
+	struct map_watch_bucket *m_watch_buckets;
+	unsigned int	m_nwatches;
 };
 
 struct actor {
+	LIST_ENTRY(actor) a_next;
 	struct map	*a_map;
 	unsigned int	a_x;
 	unsigned int	a_y;
+	void		*a_uptr;
 };
 
+static void	map_region_cell_changed(struct map *m, unsigned int x, unsigned int y, char old, char c);
+static void	map_mark_dirty(struct map *m, unsigned int x, unsigned int y);
+static void	map_mark_dirty_span(struct map *m, unsigned int y, unsigned int x0, unsigned int x1);
+
+static struct map_chunk **
+map_chunkp(struct map *m, unsigned int x, unsigned int y)
+{
+
+	return (&m->m_chunks[(y >> MAP_CHUNK_SHIFT) * m->m_chunks_wide + (x >> MAP_CHUNK_SHIFT)]);
+}
+
+static unsigned int
+map_chunk_offset(unsigned int x, unsigned int y)
+{
+
+	return ((y & MAP_CHUNK_MASK) * MAP_CHUNK_SIZE + (x & MAP_CHUNK_MASK));
+}
+
+static void
+map_chunk_release(struct map_chunk *mc)
+{
+
+	assert(mc->mc_refcount > 0);
+	mc->mc_refcount--;
+	if (mc->mc_refcount == 0)
+		free(mc);
+}
+
+/*
+ * Make sure the chunk isn't shared, copying it if it is.
+ */
+static void
+map_chunk_own(struct map_chunk **mcp)
+{
+	struct map_chunk *copy;
+
+	if ((*mcp)->mc_refcount == 1)
+		return;
+
+	copy = malloc(sizeof(*copy));
+	if (copy == NULL)
+		err(1, "malloc");
+	memcpy(copy->mc_data, (*mcp)->mc_data, sizeof(copy->mc_data));
+	copy->mc_refcount = 1;
+	map_chunk_release(*mcp);
+	*mcp = copy;
+}
+
 void
 map_set(struct map *m, unsigned int x, unsigned int y, char c)
 {
+	struct map_chunk **mcp;
+	char old;
 
 	if (x >= m->m_width)
 		return;
 	if (y >= m->m_height)
 		return;
 
-	m->m_data[m->m_width * y + x] = c;
+	mcp = map_chunkp(m, x, y);
+	old = (*mcp)->mc_data[map_chunk_offset(x, y)];
+	if (old == c)
+		return;
+
+	map_region_cell_changed(m, x, y, old, c);
+	map_mark_dirty(m, x, y);
+	map_chunk_own(mcp);
+	(*mcp)->mc_data[map_chunk_offset(x, y)] = c;
+}
+
+/*
+ * Cells are given row by row; w * h of them.  Anything outside of the map
+ * gets ignored.  Like map_set_masked(), this bumps the map version just once,
+ * and goes through the cells a chunk row at a time.  Returns the number
+ * of cells changed.
+ */
+unsigned int
+map_set_region(struct map *m, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const char *cells)
+{
+	struct map_chunk **mcp;
+	const char *crow;
+	unsigned int cx, cy, i, span, xend, yend, changed = 0, x0, x1;
+	char *data;
+
+	if (x >= m->m_width || y >= m->m_height)
+		return (0);
+	xend = w > m->m_width - x ? m->m_width : x + w;
+	yend = h > m->m_height - y ? m->m_height : y + h;
+
+	for (cy = y; cy < yend; cy++) {
+		x0 = UINT_MAX;
+		x1 = 0;
+		for (cx = x; cx < xend; cx += span) {
+			span = MAP_CHUNK_SIZE - (cx & MAP_CHUNK_MASK);
+			if (span > xend - cx)
+				span = xend - cx;
+			crow = cells + (size_t)w * (cy - y) + (cx - x);
+			mcp = map_chunkp(m, cx, cy);
+			data = (*mcp)->mc_data + map_chunk_offset(cx, cy);
+
+			/*
+			 * Compare first, so that shared chunks with nothing
+			 * to change don't get copied.
+			 */
+			if (memcmp(data, crow, span) == 0)
+				continue;
+
+			for (i = 0; i < span; i++) {
+				if (data[i] == crow[i])
+					continue;
+				map_region_cell_changed(m, cx + i, cy, data[i], crow[i]);
+				if (x0 == UINT_MAX)
+					x0 = cx + i;
+				x1 = cx + i;
+				if (changed++ == 0)
+					m->m_version++;
+			}
+
+			map_chunk_own(mcp);
+			data = (*mcp)->mc_data + map_chunk_offset(cx, cy);
+			memcpy(data, crow, span);
+		}
+		if (x0 != UINT_MAX)
+			map_mark_dirty_span(m, cy, x0, x1);
+	}
+
+	return (changed);
+}
+
+/*
+ * Set every cell of the rectangle for which the mask is nonzero to "c";
+ * the mask has "stride" bytes per row.  Unlike a map_set() per cell,
+ * this bumps the map version just once, and goes through the cells a chunk
+ * row at a time, in loops simple enough for the compiler to vectorize.
+ * Returns the number of cells changed.
+ */
+unsigned int
+map_set_masked(struct map *m, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    const unsigned char *mask, unsigned int stride, char c)
+{
+	struct map_chunk **mcp;
+	const unsigned char *mrow;
+	unsigned int cx, cy, i, span, n, changed = 0, x0, x1;
+	char *data;
+
+	assert(x <= m->m_width && w <= m->m_width - x);
+	assert(y <= m->m_height && h <= m->m_height - y);
+
+	for (cy = y; cy < y + h; cy++) {
+		x0 = UINT_MAX;
+		x1 = 0;
+		for (cx = x; cx < x + w; cx += span) {
+			span = MAP_CHUNK_SIZE - (cx & MAP_CHUNK_MASK);
+			if (span > x + w - cx)
+				span = x + w - cx;
+			mrow = mask + (size_t)stride * (cy - y) + (cx - x);
+			mcp = map_chunkp(m, cx, cy);
+			data = (*mcp)->mc_data + map_chunk_offset(cx, cy);
+
+			/*
+			 * Count first, so that shared chunks with nothing
+			 * to change don't get copied.
+			 */
+			n = 0;
+			for (i = 0; i < span; i++)
+				n += (mrow[i] != 0) & (data[i] != c);
+			if (n == 0)
+				continue;
+
+			for (i = 0; i < span; i++) {
+				if (mrow[i] == 0 || data[i] == c)
+					continue;
+				map_region_cell_changed(m, cx + i, cy, data[i], c);
+				if (x0 == UINT_MAX)
+					x0 = cx + i;
+				x1 = cx + i;
+			}
+
+			map_chunk_own(mcp);
+			data = (*mcp)->mc_data + map_chunk_offset(cx, cy);
+			for (i = 0; i < span; i++)
+				data[i] = mrow[i] != 0 ? c : data[i];
+
+			if (changed == 0)
+				m->m_version++;
+			changed += n;
+		}
+		if (x0 != UINT_MAX)
+			map_mark_dirty_span(m, cy, x0, x1);
+	}
+
+	return (changed);
 }
 
 char
@@ -40,7 +314,261 @@ map_get(struct map *m, unsigned int x, unsigned int y)
 	if (y >= m->m_height)
 		return ('\0');
 
-	return (m->m_data[m->m_width * y + x]);
+	return ((*map_chunkp(m, x, y))->mc_data[map_chunk_offset(x, y)]);
+}
+
+/*
+ * Stamp the row with the current version, and add x0 to x1 to its dirty span.
+ */
+static void
+map_mark_dirty_span(struct map *m, unsigned int y, unsigned int x0, unsigned int x1)
+{
+
+	m->m_row_version[y] = m->m_version;
+
+	if (m->m_row_dirty_x0[y] > m->m_row_dirty_x1[y]) {
+		m->m_row_dirty_x0[y] = x0;
+		m->m_row_dirty_x1[y] = x1;
+	} else {
+		if (x0 < m->m_row_dirty_x0[y])
+			m->m_row_dirty_x0[y] = x0;
+		if (x1 > m->m_row_dirty_x1[y])
+			m->m_row_dirty_x1[y] = x1;
+	}
+
+	if (m->m_dirty_y0 > m->m_dirty_y1) {
+		m->m_dirty_y0 = m->m_dirty_y1 = y;
+	} else if (y < m->m_dirty_y0) {
+		m->m_dirty_y0 = y;
+	} else if (y > m->m_dirty_y1) {
+		m->m_dirty_y1 = y;
+	}
+}
+
+static void
+map_mark_dirty(struct map *m, unsigned int x, unsigned int y)
+{
+
+	m->m_version++;
+	map_mark_dirty_span(m, y, x, x);
+}
+
+unsigned long
+map_get_version(struct map *m)
+{
+
+	return (m->m_version);
+}
+
+unsigned long
+map_get_row_version(struct map *m, unsigned int y)
+{
+
+	if (y >= m->m_height)
+		return (0);
+
+	return (m->m_row_version[y]);
+}
+
+/*
+ * Returns false if nothing changed since the last map_clear_dirty().
+ */
+bool
+map_get_dirty_rows(struct map *m, unsigned int *y0, unsigned int *y1)
+{
+
+	if (m->m_dirty_y0 > m->m_dirty_y1)
+		return (false);
+
+	*y0 = m->m_dirty_y0;
+	*y1 = m->m_dirty_y1;
+	return (true);
+}
+
+bool
+map_get_dirty_span(struct map *m, unsigned int y, unsigned int *x0, unsigned int *x1)
+{
+
+	if (m->m_row_dirty_x0[y] > m->m_row_dirty_x1[y])
+		return (false);
+
+	*x0 = m->m_row_dirty_x0[y];
+	*x1 = m->m_row_dirty_x1[y];
+	return (true);
+}
+
+void
+map_clear_dirty(struct map *m)
+{
+	unsigned int y;
+
+	if (m->m_dirty_y0 > m->m_dirty_y1)
+		return;
+
+	for (y = m->m_dirty_y0; y <= m->m_dirty_y1; y++) {
+		m->m_row_dirty_x0[y] = 1;
+		m->m_row_dirty_x1[y] = 0;
+	}
+	m->m_dirty_y0 = 1;
+	m->m_dirty_y1 = 0;
+}
+
+static bool
+map_is_floor(char c)
+{
+
+	return (c == ' ');
+}
+
+static unsigned int
+map_region_find(struct map *m, unsigned int i)
+{
+	unsigned int *parent;
+
+	parent = m->m_region_parent;
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+
+	return (i);
+}
+
+static void
+map_region_union(struct map *m, unsigned int a, unsigned int b)
+{
+	unsigned int tmp;
+
+	a = map_region_find(m, a);
+	b = map_region_find(m, b);
+	if (a == b)
+		return;
+
+	if (m->m_region_size[a] < m->m_region_size[b]) {
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+	m->m_region_parent[b] = a;
+	m->m_region_size[a] += m->m_region_size[b];
+
+	if (m->m_region_largest == b ||
+	    m->m_region_size[a] > m->m_region_size[map_region_find(m, m->m_region_largest)])
+		m->m_region_largest = a;
+}
+
+static bool
+map_region_labeled(struct map *m, unsigned int x, unsigned int y)
+{
+
+	if (x >= m->m_width || y >= m->m_height)
+		return (false);
+
+	return (m->m_region_parent[m->m_width * y + x] != MAP_REGION_NONE);
+}
+
+/*
+ * Make a cell a single-cell region, and merge it with the neighbouring floor.
+ */
+static void
+map_region_add(struct map *m, unsigned int x, unsigned int y)
+{
+	unsigned int i;
+
+	i = m->m_width * y + x;
+	m->m_region_parent[i] = i;
+	m->m_region_size[i] = 1;
+	if (m->m_region_largest == MAP_REGION_NONE)
+		m->m_region_largest = i;
+
+	if (map_region_labeled(m, x - 1, y))
+		map_region_union(m, i, i - 1);
+	if (map_region_labeled(m, x + 1, y))
+		map_region_union(m, i, i + 1);
+	if (map_region_labeled(m, x, y - 1))
+		map_region_union(m, i, i - m->m_width);
+	if (map_region_labeled(m, x, y + 1))
+		map_region_union(m, i, i + m->m_width);
+}
+
+static void
+map_region_label(struct map *m)
+{
+	unsigned int x, y, i;
+
+	if (m->m_region_parent == NULL) {
+		m->m_region_parent = calloc(m->m_number_of_cells, sizeof(*m->m_region_parent));
+		m->m_region_size = calloc(m->m_number_of_cells, sizeof(*m->m_region_size));
+		if (m->m_region_parent == NULL || m->m_region_size == NULL)
+			err(1, "calloc");
+	}
+
+	m->m_region_largest = MAP_REGION_NONE;
+	for (i = 0; i < m->m_number_of_cells; i++)
+		m->m_region_parent[i] = MAP_REGION_NONE;
+
+	for (y = 0; y < m->m_height; y++) {
+		for (x = 0; x < m->m_width; x++) {
+			if (map_is_floor(map_get(m, x, y)))
+				map_region_add(m, x, y);
+		}
+	}
+
+	/*
+	 * Flatten the trees, so that the lookups are O(1).
+	 */
+	for (i = 0; i < m->m_number_of_cells; i++) {
+		if (m->m_region_parent[i] != MAP_REGION_NONE)
+			map_region_find(m, i);
+	}
+
+	m->m_regions_valid = true;
+}
+
+static void
+map_region_update(struct map *m)
+{
+
+	if (!m->m_regions_valid)
+		map_region_label(m);
+}
+
+static void
+map_region_cell_changed(struct map *m, unsigned int x, unsigned int y, char old, char c)
+{
+
+	if (map_is_floor(old) == map_is_floor(c))
+		return;
+
+	if (!map_is_floor(c)) {
+		m->m_may_be_split = true;
+		m->m_regions_valid = false;
+		return;
+	}
+
+	if (m->m_regions_valid)
+		map_region_add(m, x, y);
+}
+
+bool
+map_same_region(struct map *m, unsigned int x1, unsigned int y1, unsigned int x2, unsigned int y2)
+{
+
+	if (!map_is_floor(map_get(m, x1, y1)) || !map_is_floor(map_get(m, x2, y2)))
+		return (false);
+
+	map_region_update(m);
+
+	return (map_region_find(m, m->m_width * y1 + x1) == map_region_find(m, m->m_width * y2 + x2));
+}
+
+static bool
+map_in_largest_region(struct map *m, unsigned int x, unsigned int y)
+{
+
+	map_region_update(m);
+
+	return (map_region_find(m, m->m_width * y + x) == map_region_find(m, m->m_region_largest));
 }
 
 static void
@@ -276,6 +804,78 @@ map_remove_thin_walls(struct map *m)
 	}
 }
 
+/*
+ * Connect every region to the largest one.  This is a breadth-first search
+ * through the rock, starting from the largest region; whenever it bumps into
+ * floor not connected to it yet, the path leading there gets carved out.
+ * Carving merges the regions, so it's all done in a single pass.
+ */
+static void
+map_link_regions(struct map *m)
+{
+	unsigned int *prev, *queue, head = 0, tail = 0;
+	unsigned int i, n, p, x, y, main, d;
+	const int dx[] = { -1, 1, 0, 0 }, dy[] = { 0, 0, -1, 1 };
+	char *visited;
+
+	if (m->m_width < 5 || m->m_height < 5)
+		return;
+
+	map_region_update(m);
+	if (m->m_region_largest == MAP_REGION_NONE)
+		return;
+
+	prev = calloc(m->m_number_of_cells, sizeof(*prev));
+	queue = calloc(m->m_number_of_cells, sizeof(*queue));
+	visited = calloc(m->m_number_of_cells, sizeof(*visited));
+	if (prev == NULL || queue == NULL || visited == NULL)
+		err(1, "calloc");
+
+	main = map_region_find(m, m->m_region_largest);
+	for (i = 0; i < m->m_number_of_cells; i++) {
+		if (m->m_region_parent[i] == MAP_REGION_NONE || map_region_find(m, i) != main)
+			continue;
+		visited[i] = 1;
+		prev[i] = i;
+		queue[tail++] = i;
+	}
+
+	while (head < tail) {
+		i = queue[head++];
+		for (d = 0; d < 4; d++) {
+			x = i % m->m_width + dx[d];
+			y = i / m->m_width + dy[d];
+
+			/*
+			 * Don't dig into the border.
+			 */
+			if (x < 2 || x >= m->m_width - 2 || y < 2 || y >= m->m_height - 2)
+				continue;
+
+			n = m->m_width * y + x;
+			if (visited[n])
+				continue;
+			visited[n] = 1;
+			prev[n] = i;
+			queue[tail++] = n;
+
+			if (!map_is_floor(map_get(m, x, y)))
+				continue;
+			if (map_region_find(m, n) == map_region_find(m, m->m_region_largest))
+				continue;
+
+			for (p = i; !map_is_floor(map_get(m, p % m->m_width, p / m->m_width)); p = prev[p]) {
+				m->m_number_of_empty_cells++;
+				map_set(m, p % m->m_width, p / m->m_width, ' ');
+			}
+		}
+	}
+
+	free(prev);
+	free(queue);
+	free(visited);
+}
+
 static void
 map_make_border(struct map *m)
 {
@@ -298,11 +898,10 @@ map_make_border(struct map *m)
 	}
 }
 
-struct map *
-map_new(unsigned int w, unsigned int h)
+static struct map *
+map_alloc(unsigned int w, unsigned int h)
 {
 	struct map *m;
-	unsigned int x, y;
 
 	assert(w > 0);
 	assert(h > 0);
@@ -313,29 +912,233 @@ map_new(unsigned int w, unsigned int h)
 	m->m_width = w;
 	m->m_height = h;
 	m->m_number_of_cells = m->m_width * m->m_height;
-	m->m_data = calloc(1, m->m_width * m->m_height);
-	if (m->m_data == NULL)
+	m->m_region_largest = MAP_REGION_NONE;
+	m->m_chunks_wide = (w + MAP_CHUNK_MASK) >> MAP_CHUNK_SHIFT;
+	m->m_chunks_high = (h + MAP_CHUNK_MASK) >> MAP_CHUNK_SHIFT;
+	m->m_chunks = calloc(m->m_chunks_wide * m->m_chunks_high, sizeof(*m->m_chunks));
+	if (m->m_chunks == NULL)
 		err(1, "calloc");
 
-	sranddev();
+	m->m_row_version = calloc(h, sizeof(*m->m_row_version));
+	m->m_row_dirty_x0 = calloc(h, sizeof(*m->m_row_dirty_x0));
+	m->m_row_dirty_x1 = calloc(h, sizeof(*m->m_row_dirty_x1));
+	if (m->m_row_version == NULL || m->m_row_dirty_x0 == NULL || m->m_row_dirty_x1 == NULL)
+		err(1, "calloc");
+	m->m_dirty_y0 = 0;
+	m->m_dirty_y1 = h - 1;
+	map_clear_dirty(m);
 
-	/*
-	 * Fill the map with solid rock.
-	 */
-	for (y = 0; y < m->m_height; y++) {
-		for (x = 0; x < m->m_width; x++)
-			map_set(m, x, y, '#');
+	return (m);
+}
+
+/*
+ * Returns a map filled with solid rock.
+ */
+struct map *
+map_new_empty(unsigned int w, unsigned int h)
+{
+	struct map *m;
+	unsigned int i;
+
+	m = map_alloc(w, h);
+	for (i = 0; i < m->m_chunks_wide * m->m_chunks_high; i++) {
+		m->m_chunks[i] = malloc(sizeof(*m->m_chunks[i]));
+		if (m->m_chunks[i] == NULL)
+			err(1, "malloc");
+		m->m_chunks[i]->mc_refcount = 1;
+		memset(m->m_chunks[i]->mc_data, '#', sizeof(m->m_chunks[i]->mc_data));
 	}
 
-	map_make_caves(m);
-	map_make_tunnels(m);
-	map_make_border(m);
-	map_remove_thin_walls(m);
-	map_make_walls(m);
+	/*
+	 * We don't know what's going to be put there.
+	 */
+	m->m_may_be_split = true;
 
 	return (m);
 }
 
+/*
+ * Returns a copy of the template map.  The copy is cheap: both maps
+ * share the data until one of them gets modified.
+ */
+struct map *
+map_new_instance(struct map *template)
+{
+	struct map *m;
+	unsigned int i;
+
+	m = map_alloc(template->m_width, template->m_height);
+	m->m_number_of_empty_cells = template->m_number_of_empty_cells;
+	m->m_may_be_split = template->m_may_be_split;
+	m->m_version = template->m_version;
+	memcpy(m->m_row_version, template->m_row_version, m->m_height * sizeof(*m->m_row_version));
+	for (i = 0; i < m->m_chunks_wide * m->m_chunks_high; i++) {
+		m->m_chunks[i] = template->m_chunks[i];
+		m->m_chunks[i]->mc_refcount++;
+	}
+
+	return (m);
+}
+
+/*
+ * An immutable copy of the map contents, sharing the chunks with the map,
+ * that can be read from other threads while the map is being changed.
+ * Creating and deleting snapshots changes the chunk reference counts, so
+ * it has to be done by the thread that changes the map.  Snapshots remain
+ * valid after the map is deleted.
+ */
+struct map_snapshot {
+	unsigned int	ms_width;
+	unsigned int	ms_height;
+	unsigned int	ms_chunks_wide;
+	unsigned int	ms_chunks_high;
+	unsigned long	ms_version;
+	struct map_chunk **ms_chunks;
+};
+
+struct map_snapshot *
+map_snapshot_new(struct map *m)
+{
+	struct map_snapshot *ms;
+	unsigned int i, nchunks;
+
+	ms = calloc(1, sizeof(*ms));
+	if (ms == NULL)
+		err(1, "calloc");
+
+	ms->ms_width = m->m_width;
+	ms->ms_height = m->m_height;
+	ms->ms_chunks_wide = m->m_chunks_wide;
+	ms->ms_chunks_high = m->m_chunks_high;
+	ms->ms_version = m->m_version;
+	nchunks = m->m_chunks_wide * m->m_chunks_high;
+	ms->ms_chunks = malloc(nchunks * sizeof(*ms->ms_chunks));
+	if (ms->ms_chunks == NULL)
+		err(1, "malloc");
+	for (i = 0; i < nchunks; i++) {
+		ms->ms_chunks[i] = m->m_chunks[i];
+		ms->ms_chunks[i]->mc_refcount++;
+	}
+
+	return (ms);
+}
+
+void
+map_snapshot_delete(struct map_snapshot *ms)
+{
+	unsigned int i;
+
+	for (i = 0; i < ms->ms_chunks_wide * ms->ms_chunks_high; i++)
+		map_chunk_release(ms->ms_chunks[i]);
+	free(ms->ms_chunks);
+	free(ms);
+}
+
+unsigned int
+map_snapshot_get_width(const struct map_snapshot *ms)
+{
+
+	return (ms->ms_width);
+}
+
+unsigned int
+map_snapshot_get_height(const struct map_snapshot *ms)
+{
+
+	return (ms->ms_height);
+}
+
+unsigned long
+map_snapshot_get_version(const struct map_snapshot *ms)
+{
+
+	return (ms->ms_version);
+}
+
+char
+map_snapshot_get(const struct map_snapshot *ms, unsigned int x, unsigned int y)
+{
+
+	if (x >= ms->ms_width || y >= ms->ms_height)
+		return ('\0');
+
+	return (ms->ms_chunks[(y >> MAP_CHUNK_SHIFT) * ms->ms_chunks_wide + (x >> MAP_CHUNK_SHIFT)]->mc_data[map_chunk_offset(x, y)]);
+}
+
+void
+map_delete(struct map *m)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->m_chunks_wide * m->m_chunks_high; i++)
+		map_chunk_release(m->m_chunks[i]);
+	free(m->m_chunks);
+	free(m->m_region_parent);
+	free(m->m_region_size);
+	free(m->m_row_version);
+	free(m->m_row_dirty_x0);
+	free(m->m_row_dirty_x1);
+	assert(m->m_nwatches == 0);
+	free(m->m_buckets);
+	free(m->m_occupant);
+	free(m->m_watch_buckets);
+	free(m);
+}
+
+static const struct {
+	const char	*mp_name;
+	void		(*mp_func)(struct map *m);
+} map_phases[] = {
+	{ "map_make_caves", map_make_caves },
+	{ "map_make_tunnels", map_make_tunnels },
+	{ "map_make_border", map_make_border },
+	{ "map_link_regions", map_link_regions },
+	{ "map_remove_thin_walls", map_remove_thin_walls },
+	{ "map_make_walls", map_make_walls },
+};
+
+/*
+ * Generate a map from a given seed; the same seed always gives the same map.
+ * The callback, if any, is called with the name of every phase before it
+ * starts, and with NULL after the last one; it's there for benchmarking.
+ */
+struct map *
+map_new_seeded(unsigned int w, unsigned int h, unsigned int seed,
+    void (*phase_callback)(const char *phase, void *arg), void *arg)
+{
+	struct map *m;
+	unsigned int i;
+
+	m = map_new_empty(w, h);
+
+	srand(seed);
+
+	for (i = 0; i < sizeof(map_phases) / sizeof(map_phases[0]); i++) {
+		if (phase_callback != NULL)
+			phase_callback(map_phases[i].mp_name, arg);
+		map_phases[i].mp_func(m);
+	}
+	if (phase_callback != NULL)
+		phase_callback(NULL, arg);
+
+	/*
+	 * All the floor is connected now.
+	 */
+	m->m_may_be_split = false;
+	map_clear_dirty(m);
+
+	return (m);
+}
+
+struct map *
+map_new(unsigned int w, unsigned int h)
+{
+
+	sranddev();
+
+	return (map_new_seeded(w, h, rand(), NULL, NULL));
+}
+
 unsigned int
 map_get_width(struct map *m)
 {
@@ -350,38 +1153,433 @@ map_get_height(struct map *m)
 	return (m->m_height);
 }
 
-static void
-map_find_empty_spot(struct map *m, unsigned int *xp, unsigned int *yp)
+/*
+ * Whether a new actor can go there: it's floor, not in a sealed pocket,
+ * and no one is standing there.
+ */
+static bool
+map_is_empty_spot(struct map *m, unsigned int x, unsigned int y)
 {
-	unsigned int x, y;
 	char c;
 
-	for (;;) {
-		x = rand() % m->m_width;
-		y = rand() % m->m_height;
+	c = map_get(m, x, y);
+	assert(c != '\0');
+
+	if (!map_is_floor(c))
+		return (false);
+	if (m->m_may_be_split && !map_in_largest_region(m, x, y))
+		return (false);
+
+	return (map_actor_at(m, x, y) == NULL);
+}
 
-		c = map_get(m, x, y);
-		assert(c != '\0');
+/*
+ * Finds a random empty spot within the rectangle.  After MAP_SPOT_TRIES
+ * random misses, it goes through every cell, starting from a random one;
+ * returns false if there's no empty spot at all.
+ */
+static bool
+map_find_empty_spot(struct map *m, unsigned int x0, unsigned int y0, unsigned int w, unsigned int h,
+    unsigned int *xp, unsigned int *yp)
+{
+	unsigned int x, y, i, j, n, start;
+
+	for (i = 0; i < MAP_SPOT_TRIES; i++) {
+		x = x0 + rand() % w;
+		y = y0 + rand() % h;
+		if (map_is_empty_spot(m, x, y)) {
+			*xp = x;
+			*yp = y;
+			return (true);
+		}
+	}
 
-		if (c == ' ') {
+	n = w * h;
+	start = rand() % n;
+	for (i = 0; i < n; i++) {
+		j = (start + i) % n;
+		x = x0 + j % w;
+		y = y0 + j / w;
+		if (map_is_empty_spot(m, x, y)) {
 			*xp = x;
 			*yp = y;
+			return (true);
+		}
+	}
+
+	return (false);
+}
+
+static struct map_bucket *
+map_bucket(struct map *m, unsigned int x, unsigned int y)
+{
+
+	return (&m->m_buckets[(y >> MAP_CHUNK_SHIFT) * m->m_chunks_wide + (x >> MAP_CHUNK_SHIFT)]);
+}
+
+static void
+map_index_add(struct actor *a)
+{
+	struct map *m;
+	unsigned int i;
+
+	m = a->a_map;
+	if (m->m_buckets == NULL) {
+		m->m_buckets = calloc(m->m_chunks_wide * m->m_chunks_high, sizeof(*m->m_buckets));
+		if (m->m_buckets == NULL)
+			err(1, "calloc");
+		for (i = 0; i < m->m_chunks_wide * m->m_chunks_high; i++)
+			LIST_INIT(&m->m_buckets[i]);
+		m->m_occupant = calloc(m->m_number_of_cells, sizeof(*m->m_occupant));
+		if (m->m_occupant == NULL)
+			err(1, "calloc");
+	}
+
+	LIST_INSERT_HEAD(map_bucket(m, a->a_x, a->a_y), a, a_next);
+	if (m->m_occupant[a->a_y * m->m_width + a->a_x] == NULL)
+		m->m_occupant[a->a_y * m->m_width + a->a_x] = a;
+}
+
+static void
+map_index_remove(struct actor *a)
+{
+	struct map *m;
+	struct actor *other;
+	struct actor **occupantp;
+
+	m = a->a_map;
+	LIST_REMOVE(a, a_next);
+
+	occupantp = &m->m_occupant[a->a_y * m->m_width + a->a_x];
+	if (*occupantp != a)
+		return;
+
+	*occupantp = NULL;
+	LIST_FOREACH(other, map_bucket(m, a->a_x, a->a_y), a_next) {
+		if (other->a_x == a->a_x && other->a_y == a->a_y) {
+			*occupantp = other;
 			break;
 		}
 	}
 }
 
+/*
+ * Returns the actor standing at given coordinates, or NULL if there's none.
+ */
+struct actor *
+map_actor_at(struct map *m, unsigned int x, unsigned int y)
+{
+
+	if (m->m_occupant == NULL)
+		return (NULL);
+	if (x >= m->m_width || y >= m->m_height)
+		return (NULL);
+
+	return (m->m_occupant[y * m->m_width + x]);
+}
+
+/*
+ * Calls the callback for every actor within the rectangle; returns
+ * the number of them.  The callback must not move or delete actors.
+ */
+unsigned int
+map_actors_in_rect(struct map *m, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    void (*callback)(struct actor *a, void *arg), void *arg)
+{
+	struct actor *a;
+	unsigned int bx, by, bx0, by0, bx1, by1, found = 0;
+
+	if (m->m_buckets == NULL || w == 0 || h == 0)
+		return (0);
+	if (x >= m->m_width || y >= m->m_height)
+		return (0);
+	if (w > m->m_width - x)
+		w = m->m_width - x;
+	if (h > m->m_height - y)
+		h = m->m_height - y;
+
+	bx0 = x >> MAP_CHUNK_SHIFT;
+	by0 = y >> MAP_CHUNK_SHIFT;
+	bx1 = (x + w - 1) >> MAP_CHUNK_SHIFT;
+	by1 = (y + h - 1) >> MAP_CHUNK_SHIFT;
+
+	for (by = by0; by <= by1; by++) {
+		for (bx = bx0; bx <= bx1; bx++) {
+			LIST_FOREACH(a, &m->m_buckets[by * m->m_chunks_wide + bx], a_next) {
+				if (a->a_x < x || a->a_x >= x + w)
+					continue;
+				if (a->a_y < y || a->a_y >= y + h)
+					continue;
+				if (callback != NULL)
+					callback(a, arg);
+				found++;
+			}
+		}
+	}
+
+	return (found);
+}
+
+struct map_radius_query {
+	unsigned int	mrq_x;
+	unsigned int	mrq_y;
+	unsigned long	mrq_radius_squared;
+	unsigned int	mrq_found;
+	void		(*mrq_callback)(struct actor *a, void *arg);
+	void		*mrq_arg;
+};
+
+static void
+map_radius_callback(struct actor *a, void *arg)
+{
+	struct map_radius_query *mrq;
+	long dx, dy;
+
+	mrq = arg;
+	dx = (long)a->a_x - mrq->mrq_x;
+	dy = (long)a->a_y - mrq->mrq_y;
+	if ((unsigned long)(dx * dx + dy * dy) > mrq->mrq_radius_squared)
+		return;
+
+	if (mrq->mrq_callback != NULL)
+		mrq->mrq_callback(a, mrq->mrq_arg);
+	mrq->mrq_found++;
+}
+
+/*
+ * Like map_actors_in_rect(), but for a circle.
+ */
+unsigned int
+map_actors_in_radius(struct map *m, unsigned int x, unsigned int y, unsigned int radius,
+    void (*callback)(struct actor *a, void *arg), void *arg)
+{
+	struct map_radius_query mrq;
+	unsigned int x0, y0;
+
+	mrq.mrq_x = x;
+	mrq.mrq_y = y;
+	mrq.mrq_radius_squared = (unsigned long)radius * radius;
+	mrq.mrq_found = 0;
+	mrq.mrq_callback = callback;
+	mrq.mrq_arg = arg;
+
+	x0 = x > radius ? x - radius : 0;
+	y0 = y > radius ? y - radius : 0;
+	map_actors_in_rect(m, x0, y0, x + radius - x0 + 1, y + radius - y0 + 1,
+	    map_radius_callback, &mrq);
+
+	return (mrq.mrq_found);
+}
+
+struct map_watch *
+map_watch_new(struct map *m, void *uptr)
+{
+	struct map_watch *mw;
+	unsigned int i;
+
+	if (m->m_watch_buckets == NULL) {
+		m->m_watch_buckets = calloc(m->m_chunks_wide * m->m_chunks_high, sizeof(*m->m_watch_buckets));
+		if (m->m_watch_buckets == NULL)
+			err(1, "calloc");
+		for (i = 0; i < m->m_chunks_wide * m->m_chunks_high; i++)
+			LIST_INIT(&m->m_watch_buckets[i]);
+	}
+
+	mw = calloc(1, sizeof(*mw));
+	if (mw == NULL)
+		err(1, "calloc");
+	mw->mw_map = m;
+	mw->mw_uptr = uptr;
+	m->m_nwatches++;
+
+	return (mw);
+}
+
+static void
+map_watch_unlink(struct map_watch *mw)
+{
+	unsigned int i;
+
+	for (i = 0; i < mw->mw_nlinks; i++)
+		LIST_REMOVE(&mw->mw_links[i], mwl_next);
+	mw->mw_nlinks = 0;
+}
+
+void
+map_watch_delete(struct map_watch *mw)
+{
+
+	map_watch_unlink(mw);
+	mw->mw_map->m_nwatches--;
+	free(mw->mw_links);
+	free(mw);
+}
+
+/*
+ * Move the watch to cover the rectangle, clipped to the map.  The buckets
+ * only get touched if the set of chunks the rectangle touches has changed.
+ */
+void
+map_watch_set(struct map_watch *mw, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	struct map *m;
+	unsigned int bx, by, bx0, by0, bx1, by1, n;
+	bool same;
+
+	m = mw->mw_map;
+	if (x >= m->m_width || y >= m->m_height)
+		w = h = 0;
+	if (w > m->m_width - x)
+		w = m->m_width - x;
+	if (h > m->m_height - y)
+		h = m->m_height - y;
+
+	if (w == 0 || h == 0) {
+		map_watch_unlink(mw);
+		mw->mw_w = mw->mw_h = 0;
+		return;
+	}
+
+	bx0 = x >> MAP_CHUNK_SHIFT;
+	by0 = y >> MAP_CHUNK_SHIFT;
+	bx1 = (x + w - 1) >> MAP_CHUNK_SHIFT;
+	by1 = (y + h - 1) >> MAP_CHUNK_SHIFT;
+	same = mw->mw_w > 0 && mw->mw_h > 0 &&
+	    bx0 == mw->mw_x >> MAP_CHUNK_SHIFT && by0 == mw->mw_y >> MAP_CHUNK_SHIFT &&
+	    bx1 == (mw->mw_x + mw->mw_w - 1) >> MAP_CHUNK_SHIFT &&
+	    by1 == (mw->mw_y + mw->mw_h - 1) >> MAP_CHUNK_SHIFT;
+
+	mw->mw_x = x;
+	mw->mw_y = y;
+	mw->mw_w = w;
+	mw->mw_h = h;
+	if (same)
+		return;
+
+	map_watch_unlink(mw);
+	n = (bx1 - bx0 + 1) * (by1 - by0 + 1);
+	mw->mw_links = realloc(mw->mw_links, n * sizeof(*mw->mw_links));
+	if (mw->mw_links == NULL)
+		err(1, "realloc");
+	for (by = by0; by <= by1; by++) {
+		for (bx = bx0; bx <= bx1; bx++) {
+			mw->mw_links[mw->mw_nlinks].mwl_watch = mw;
+			LIST_INSERT_HEAD(&m->m_watch_buckets[by * m->m_chunks_wide + bx],
+			    &mw->mw_links[mw->mw_nlinks], mwl_next);
+			mw->mw_nlinks++;
+		}
+	}
+}
+
+bool
+map_watch_contains(const struct map_watch *mw, unsigned int x, unsigned int y)
+{
+
+	if (x < mw->mw_x || x - mw->mw_x >= mw->mw_w)
+		return (false);
+	if (y < mw->mw_y || y - mw->mw_y >= mw->mw_h)
+		return (false);
+	return (true);
+}
+
+/*
+ * Calls the callback with the uptr of every watch covering the cell;
+ * returns the number of them.  The callback must not change any watches.
+ */
+unsigned int
+map_watches_at(struct map *m, unsigned int x, unsigned int y,
+    void (*callback)(void *uptr, void *arg), void *arg)
+{
+	struct map_watch_link *mwl;
+	unsigned int found = 0;
+
+	if (m->m_watch_buckets == NULL)
+		return (0);
+	if (x >= m->m_width || y >= m->m_height)
+		return (0);
+
+	LIST_FOREACH(mwl, &m->m_watch_buckets[(y >> MAP_CHUNK_SHIFT) * m->m_chunks_wide + (x >> MAP_CHUNK_SHIFT)], mwl_next) {
+		if (!map_watch_contains(mwl->mwl_watch, x, y))
+			continue;
+		callback(mwl->mwl_watch->mw_uptr, arg);
+		found++;
+	}
+
+	return (found);
+}
+
+/*
+ * Returns the number of floor cells within the rectangle.
+ */
+unsigned int
+map_count_floor(struct map *m, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	unsigned int cx, cy, n = 0;
+
+	assert(x + w <= m->m_width && y + h <= m->m_height);
+
+	for (cy = y; cy < y + h; cy++) {
+		for (cx = x; cx < x + w; cx++)
+			n += map_is_floor(map_get(m, cx, cy));
+	}
+
+	return (n);
+}
+
+/*
+ * Returns NULL if there's no empty spot left for the actor.
+ */
 struct actor *
 map_actor_new(struct map *m)
+{
+
+	return (map_actor_new_within(m, 0, 0, m->m_width, m->m_height));
+}
+
+/*
+ * Like map_actor_new(), except that the actor lands within the rectangle.
+ */
+struct actor *
+map_actor_new_within(struct map *m, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
 {
 	struct actor *a;
+	unsigned int ax, ay;
+
+	assert(w > 0 && h > 0 && x + w <= m->m_width && y + h <= m->m_height);
+
+	if (!map_find_empty_spot(m, x, y, w, h, &ax, &ay))
+		return (NULL);
 
 	a = calloc(1, sizeof(*a));
 	if (a == NULL)
 		err(1, "calloc");
 
 	a->a_map = m;
-	map_find_empty_spot(m, &a->a_x, &a->a_y);
+	a->a_x = ax;
+	a->a_y = ay;
+	map_index_add(a);
+	return (a);
+}
+
+/*
+ * Used when restoring the world from the journal; the position
+ * is not checked.
+ */
+struct actor *
+map_actor_new_at(struct map *m, unsigned int x, unsigned int y)
+{
+	struct actor *a;
+
+	assert(x < m->m_width && y < m->m_height);
+
+	a = calloc(1, sizeof(*a));
+	if (a == NULL)
+		err(1, "calloc");
+
+	a->a_map = m;
+	a->a_x = x;
+	a->a_y = y;
+	map_index_add(a);
 	return (a);
 }
 
@@ -389,6 +1587,7 @@ void
 map_actor_delete(struct actor *a)
 {
 
+	map_index_remove(a);
 	free(a);
 }
 
@@ -406,18 +1605,255 @@ map_actor_get_y(struct actor *a)
 	return (a->a_y);
 }
 
+void *
+map_actor_get_uptr(struct actor *a)
+{
+
+	return (a->a_uptr);
+}
+
+void
+map_actor_set_uptr(struct actor *a, void *uptr)
+{
+
+	a->a_uptr = uptr;
+}
+
+/*
+ * Returns 0 on success, 1 if there's a wall in the way, and 2 if there's
+ * another actor.
+ */
 int
 map_actor_move_by(struct actor *a, int dx, int dy)
 {
+	unsigned int x, y;
 	char c;
 
-	c = map_get(a->a_map, a->a_x + dx, a->a_y + dy);
+	x = a->a_x + dx;
+	y = a->a_y + dy;
+
+	c = map_get(a->a_map, x, y);
 	assert(c != '\0');
 	if (c != ' ')
 		return (1);
+	if (map_actor_at(a->a_map, x, y) != NULL)
+		return (2);
 
-	a->a_x += dx;
-	a->a_y += dy;
+	map_index_remove(a);
+	a->a_x = x;
+	a->a_y = y;
+	map_index_add(a);
 
 	return (0);
 }
+
+/*
+ * Field of view, computed with recursive shadowcasting: every octant
+ * is scanned row by row, outwards, and walls narrow down the range of slopes
+ * that remain visible further on.  Anything that's not floor blocks
+ * the view, but is visible itself.
+ *
+ * The result is a bitset covering the square around the viewer, reused
+ * for every computation.  It stays valid until the viewer moves, or a row
+ * within the radius changes.
+ */
+struct map_fov {
+	struct map	*f_map;
+	unsigned long	f_version;
+	unsigned int	f_radius;
+	unsigned int	f_side;
+	unsigned int	f_x;
+	unsigned int	f_y;
+	unsigned char	*f_bits;
+};
+
+static const int map_fov_octants[8][4] = {
+	{ 1, 0, 0, 1 },
+	{ 0, 1, 1, 0 },
+	{ 0, -1, 1, 0 },
+	{ -1, 0, 0, 1 },
+	{ -1, 0, 0, -1 },
+	{ 0, -1, -1, 0 },
+	{ 0, 1, -1, 0 },
+	{ 1, 0, 0, -1 },
+};
+
+struct map_fov *
+map_fov_new(unsigned int radius)
+{
+	struct map_fov *f;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		err(1, "calloc");
+
+	f->f_radius = radius;
+	f->f_side = 2 * radius + 1;
+	f->f_bits = calloc((f->f_side * f->f_side + 7) / 8, 1);
+	if (f->f_bits == NULL)
+		err(1, "calloc");
+
+	return (f);
+}
+
+void
+map_fov_delete(struct map_fov *f)
+{
+
+	free(f->f_bits);
+	free(f);
+}
+
+static void
+map_fov_mark(struct map_fov *f, int dx, int dy)
+{
+	unsigned int bit;
+
+	bit = (dy + f->f_radius) * f->f_side + (dx + f->f_radius);
+	f->f_bits[bit / 8] |= 1 << (bit % 8);
+}
+
+static bool
+map_fov_blocks(struct map *m, int x, int y)
+{
+
+	if (x < 0 || y < 0)
+		return (true);
+
+	return (!map_is_floor(map_get(m, x, y)));
+}
+
+/*
+ * Scan the octant from "row" outwards, between the "start" and "end" slopes.
+ * The octant transforms octant-relative coordinates into map ones;
+ * rows are numbered with negative dy.
+ */
+static void
+map_fov_cast(struct map *m, struct map_fov *f, const int *octant, int row, double start, double end)
+{
+	double left, right, next_start = 0;
+	int dx, dy, x, y, radius;
+	bool blocked;
+
+	if (start < end)
+		return;
+
+	radius = f->f_radius;
+	for (; row <= radius; row++) {
+		dy = -row;
+		blocked = false;
+		for (dx = -row; dx <= 0; dx++) {
+			left = (dx - 0.5) / (dy + 0.5);
+			right = (dx + 0.5) / (dy - 0.5);
+			if (start < right)
+				continue;
+			if (end > left)
+				break;
+
+			x = f->f_x + dx * octant[0] + dy * octant[1];
+			y = f->f_y + dx * octant[2] + dy * octant[3];
+			if (dx * dx + dy * dy <= radius * radius)
+				map_fov_mark(f, x - (int)f->f_x, y - (int)f->f_y);
+
+			if (blocked) {
+				if (map_fov_blocks(m, x, y)) {
+					next_start = right;
+					continue;
+				}
+				blocked = false;
+				start = next_start;
+			} else if (map_fov_blocks(m, x, y) && row < radius) {
+				blocked = true;
+				map_fov_cast(m, f, octant, row + 1, start, left);
+				next_start = right;
+			}
+		}
+		if (blocked)
+			break;
+	}
+}
+
+static void
+map_fov_compute(struct map *m, struct map_fov *f, unsigned int x, unsigned int y)
+{
+	unsigned int i;
+
+	f->f_map = m;
+	f->f_version = m->m_version;
+	f->f_x = x;
+	f->f_y = y;
+	memset(f->f_bits, 0, (f->f_side * f->f_side + 7) / 8);
+
+	map_fov_mark(f, 0, 0);
+	for (i = 0; i < 8; i++)
+		map_fov_cast(m, f, map_fov_octants[i], 1, 1.0, 0.0);
+}
+
+/*
+ * Make the field of view current for a viewer at (x, y); returns true if it
+ * had to be recomputed, and false if nothing has changed since last time.
+ */
+bool
+map_fov_update(struct map *m, struct map_fov *f, unsigned int x, unsigned int y)
+{
+	unsigned int y0, y1;
+
+	if (f->f_map != m || f->f_x != x || f->f_y != y) {
+		map_fov_compute(m, f, x, y);
+		return (true);
+	}
+
+	if (f->f_version == m->m_version)
+		return (false);
+
+	y0 = y > f->f_radius ? y - f->f_radius : 0;
+	y1 = y + f->f_radius < m->m_height ? y + f->f_radius : m->m_height - 1;
+	for (; y0 <= y1; y0++) {
+		if (m->m_row_version[y0] > f->f_version) {
+			map_fov_compute(m, f, x, y);
+			return (true);
+		}
+	}
+
+	/*
+	 * Changes were elsewhere; no need to look at those rows again.
+	 */
+	f->f_version = m->m_version;
+	return (false);
+}
+
+/*
+ * Same as map_fov_update() for a number of actors at once; "changed"
+ * gets set for the ones that had to be recomputed.  Returns how many.
+ */
+unsigned int
+map_fov_update_actors(struct map *m, struct actor **actors, struct map_fov **fovs, bool *changed, unsigned int n)
+{
+	unsigned int i, recomputed = 0;
+
+	for (i = 0; i < n; i++) {
+		assert(actors[i]->a_map == m);
+		changed[i] = map_fov_update(m, fovs[i], actors[i]->a_x, actors[i]->a_y);
+		if (changed[i])
+			recomputed++;
+	}
+
+	return (recomputed);
+}
+
+bool
+map_fov_visible(struct map_fov *f, unsigned int x, unsigned int y)
+{
+	unsigned int dx, dy, bit;
+
+	if (f->f_map == NULL)
+		return (false);
+
+	dx = x - f->f_x + f->f_radius;
+	dy = y - f->f_y + f->f_radius;
+	if (dx >= f->f_side || dy >= f->f_side)
+		return (false);
+
+	bit = dy * f->f_side + dx;
+	return ((f->f_bits[bit / 8] & (1 << (bit % 8))) != 0);
+}
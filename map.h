@@ -1,18 +1,64 @@
 #ifndef MAP_H
 #define	MAP_H
 
+#include <stdbool.h>
+
 struct map;
+struct map_fov;
+struct map_snapshot;
+struct map_watch;
 struct actor;
 
 struct map	*map_new(unsigned int w, unsigned int h);
+struct map	*map_new_seeded(unsigned int w, unsigned int h, unsigned int seed,
+		    void (*phase_callback)(const char *phase, void *arg), void *arg);
+struct map	*map_new_empty(unsigned int w, unsigned int h);
+struct map	*map_new_instance(struct map *template);
+void		map_delete(struct map *m);
 struct actor	*map_actor_new(struct map *m);
+struct actor	*map_actor_new_within(struct map *m, unsigned int x, unsigned int y, unsigned int w, unsigned int h);
+struct actor	*map_actor_new_at(struct map *m, unsigned int x, unsigned int y);
 void		map_actor_delete(struct actor *a);
+struct actor	*map_actor_at(struct map *m, unsigned int x, unsigned int y);
+unsigned int	map_actors_in_rect(struct map *m, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+		    void (*callback)(struct actor *a, void *arg), void *arg);
+unsigned int	map_actors_in_radius(struct map *m, unsigned int x, unsigned int y, unsigned int radius,
+		    void (*callback)(struct actor *a, void *arg), void *arg);
+struct map_watch	*map_watch_new(struct map *m, void *uptr);
+void		map_watch_delete(struct map_watch *mw);
+void		map_watch_set(struct map_watch *mw, unsigned int x, unsigned int y, unsigned int w, unsigned int h);
+bool		map_watch_contains(const struct map_watch *mw, unsigned int x, unsigned int y);
+unsigned int	map_watches_at(struct map *m, unsigned int x, unsigned int y,
+		    void (*callback)(void *uptr, void *arg), void *arg);
 unsigned int	map_get_width(struct map *m);
 unsigned int	map_get_height(struct map *m);
+unsigned int	map_count_floor(struct map *m, unsigned int x, unsigned int y, unsigned int w, unsigned int h);
 char		map_get(struct map *m, unsigned int x, unsigned int y);
 void		map_set(struct map *m, unsigned int x, unsigned int y, char c);
+unsigned int	map_set_region(struct map *m, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const char *cells);
+unsigned int	map_set_masked(struct map *m, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+		    const unsigned char *mask, unsigned int stride, char c);
+unsigned long	map_get_version(struct map *m);
+unsigned long	map_get_row_version(struct map *m, unsigned int y);
+bool		map_get_dirty_rows(struct map *m, unsigned int *y0, unsigned int *y1);
+bool		map_get_dirty_span(struct map *m, unsigned int y, unsigned int *x0, unsigned int *x1);
+void		map_clear_dirty(struct map *m);
+bool		map_same_region(struct map *m, unsigned int x1, unsigned int y1, unsigned int x2, unsigned int y2);
 unsigned int	map_actor_get_x(struct actor *a);
 unsigned int	map_actor_get_y(struct actor *a);
+void		*map_actor_get_uptr(struct actor *a);
+void		map_actor_set_uptr(struct actor *a, void *uptr);
 int		map_actor_move_by(struct actor *a, int dx, int dy);
+struct map_fov	*map_fov_new(unsigned int radius);
+void		map_fov_delete(struct map_fov *f);
+bool		map_fov_update(struct map *m, struct map_fov *f, unsigned int x, unsigned int y);
+unsigned int	map_fov_update_actors(struct map *m, struct actor **actors, struct map_fov **fovs, bool *changed, unsigned int n);
+bool		map_fov_visible(struct map_fov *f, unsigned int x, unsigned int y);
+struct map_snapshot	*map_snapshot_new(struct map *m);
+void		map_snapshot_delete(struct map_snapshot *ms);
+unsigned int	map_snapshot_get_width(const struct map_snapshot *ms);
+unsigned int	map_snapshot_get_height(const struct map_snapshot *ms);
+unsigned long	map_snapshot_get_version(const struct map_snapshot *ms);
+char		map_snapshot_get(const struct map_snapshot *ms, unsigned int x, unsigned int y);
 
 #endif /* !MAP_H */
@@ -0,0 +1,333 @@
+#include <assert.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "map.h"
+#include "path.h"
+
+/*
+ * A* over the map grid, moving in four directions, with the Manhattan
+ * distance as the heuristic.  All the per-cell state is kept in arrays
+ * that are reused between searches; instead of clearing them, every search
+ * gets a new stamp, and cells with an older one count as unvisited.
+ *
+ * Jump point search doesn't buy much here: with four directions, there
+ * are too few symmetric paths for pruning them to pay off.  Unreachable
+ * goals, which would otherwise be the most expensive case, are caught
+ * without searching by checking whether both ends are in the same region.
+ *
+ * Results are cached; an entry is only valid as long as the map version
+ * hasn't changed, so that any map_set() invalidates it.
+ */
+
+#define	PATH_CACHE_SIZE		256
+
+static const int path_dx[] = { 0, 0, -1, 1 };
+static const int path_dy[] = { -1, 1, 0, 0 };
+
+struct path_node {
+	unsigned int	pn_f;
+	unsigned int	pn_h;
+	unsigned int	pn_cell;
+};
+
+struct path_cache_entry {
+	struct map	*pce_map;
+	unsigned long	pce_version;
+	unsigned int	pce_x0;
+	unsigned int	pce_y0;
+	unsigned int	pce_x1;
+	unsigned int	pce_y1;
+	int		pce_len;
+	unsigned char	*pce_path;
+	size_t		pce_path_size;
+};
+
+struct pathfinder {
+	unsigned int		pf_cells;
+	unsigned int		pf_stamp;
+	unsigned int		*pf_stamps;
+	unsigned int		*pf_g;
+	unsigned char		*pf_from;
+	unsigned char		*pf_path;
+	struct path_node	*pf_heap;
+	unsigned int		pf_heap_len;
+	unsigned int		pf_heap_size;
+	struct path_cache_entry	pf_cache[PATH_CACHE_SIZE];
+};
+
+struct pathfinder *
+pathfinder_new(void)
+{
+	struct pathfinder *pf;
+
+	pf = calloc(1, sizeof(*pf));
+	if (pf == NULL)
+		err(1, "calloc");
+
+	return (pf);
+}
+
+void
+pathfinder_delete(struct pathfinder *pf)
+{
+	unsigned int i;
+
+	for (i = 0; i < PATH_CACHE_SIZE; i++)
+		free(pf->pf_cache[i].pce_path);
+	free(pf->pf_stamps);
+	free(pf->pf_g);
+	free(pf->pf_from);
+	free(pf->pf_path);
+	free(pf->pf_heap);
+	free(pf);
+}
+
+/*
+ * Must be called before deleting the map, so that a new map that happens
+ * to be allocated at the same address doesn't get its paths.
+ */
+void
+pathfinder_forget_map(struct pathfinder *pf, struct map *m)
+{
+	unsigned int i;
+
+	for (i = 0; i < PATH_CACHE_SIZE; i++) {
+		if (pf->pf_cache[i].pce_map == m)
+			pf->pf_cache[i].pce_map = NULL;
+	}
+}
+
+static void
+pathfinder_reserve(struct pathfinder *pf, unsigned int cells)
+{
+
+	if (cells <= pf->pf_cells)
+		return;
+
+	free(pf->pf_stamps);
+	free(pf->pf_g);
+	free(pf->pf_from);
+	free(pf->pf_path);
+	pf->pf_stamps = calloc(cells, sizeof(*pf->pf_stamps));
+	pf->pf_g = malloc(cells * sizeof(*pf->pf_g));
+	pf->pf_from = malloc(cells);
+	pf->pf_path = malloc(cells);
+	if (pf->pf_stamps == NULL || pf->pf_g == NULL || pf->pf_from == NULL || pf->pf_path == NULL)
+		err(1, "malloc");
+	pf->pf_cells = cells;
+	pf->pf_stamp = 0;
+}
+
+static bool
+path_node_less(const struct path_node *a, const struct path_node *b)
+{
+
+	/*
+	 * Among equally good nodes, prefer the ones closer to the goal.
+	 */
+	if (a->pn_f != b->pn_f)
+		return (a->pn_f < b->pn_f);
+	return (a->pn_h < b->pn_h);
+}
+
+static void
+pathfinder_push(struct pathfinder *pf, unsigned int f, unsigned int h, unsigned int cell)
+{
+	struct path_node tmp;
+	unsigned int i, parent;
+
+	if (pf->pf_heap_len == pf->pf_heap_size) {
+		pf->pf_heap_size = pf->pf_heap_size > 0 ? pf->pf_heap_size * 2 : 1024;
+		pf->pf_heap = realloc(pf->pf_heap, pf->pf_heap_size * sizeof(*pf->pf_heap));
+		if (pf->pf_heap == NULL)
+			err(1, "realloc");
+	}
+
+	i = pf->pf_heap_len++;
+	pf->pf_heap[i].pn_f = f;
+	pf->pf_heap[i].pn_h = h;
+	pf->pf_heap[i].pn_cell = cell;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!path_node_less(&pf->pf_heap[i], &pf->pf_heap[parent]))
+			break;
+		tmp = pf->pf_heap[i];
+		pf->pf_heap[i] = pf->pf_heap[parent];
+		pf->pf_heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+static struct path_node
+pathfinder_pop(struct pathfinder *pf)
+{
+	struct path_node top, tmp;
+	unsigned int i, child;
+
+	assert(pf->pf_heap_len > 0);
+	top = pf->pf_heap[0];
+	pf->pf_heap[0] = pf->pf_heap[--pf->pf_heap_len];
+
+	i = 0;
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= pf->pf_heap_len)
+			break;
+		if (child + 1 < pf->pf_heap_len && path_node_less(&pf->pf_heap[child + 1], &pf->pf_heap[child]))
+			child++;
+		if (!path_node_less(&pf->pf_heap[child], &pf->pf_heap[i]))
+			break;
+		tmp = pf->pf_heap[i];
+		pf->pf_heap[i] = pf->pf_heap[child];
+		pf->pf_heap[child] = tmp;
+		i = child;
+	}
+
+	return (top);
+}
+
+static unsigned int
+distance(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1)
+{
+
+	return ((x0 > x1 ? x0 - x1 : x1 - x0) + (y0 > y1 ? y0 - y1 : y1 - y0));
+}
+
+/*
+ * Returns the path length, or -1 if there is no path.
+ */
+static int
+pathfinder_search(struct pathfinder *pf, struct map *m, unsigned int x0, unsigned int y0,
+    unsigned int x1, unsigned int y1)
+{
+	struct path_node pn;
+	unsigned int width, x, y, nx, ny, cell, ncell, g, h, d;
+	int len;
+
+	if (x0 == x1 && y0 == y1)
+		return (0);
+	if (!map_same_region(m, x0, y0, x1, y1))
+		return (-1);
+
+	width = map_get_width(m);
+	pathfinder_reserve(pf, width * map_get_height(m));
+
+	pf->pf_stamp++;
+	if (pf->pf_stamp == 0) {
+		memset(pf->pf_stamps, 0, pf->pf_cells * sizeof(*pf->pf_stamps));
+		pf->pf_stamp = 1;
+	}
+	pf->pf_heap_len = 0;
+
+	cell = y0 * width + x0;
+	pf->pf_stamps[cell] = pf->pf_stamp;
+	pf->pf_g[cell] = 0;
+	h = distance(x0, y0, x1, y1);
+	pathfinder_push(pf, h, h, cell);
+
+	while (pf->pf_heap_len > 0) {
+		pn = pathfinder_pop(pf);
+		cell = pn.pn_cell;
+		x = cell % width;
+		y = cell / width;
+		g = pf->pf_g[cell];
+
+		/*
+		 * Stale entry; the cell got pushed again with a better score.
+		 */
+		if (pn.pn_f != g + pn.pn_h)
+			continue;
+
+		if (x == x1 && y == y1)
+			break;
+
+		for (d = 0; d < 4; d++) {
+			nx = x + path_dx[d];
+			ny = y + path_dy[d];
+			if (map_get(m, nx, ny) != ' ')
+				continue;
+			ncell = ny * width + nx;
+			if (pf->pf_stamps[ncell] == pf->pf_stamp && pf->pf_g[ncell] <= g + 1)
+				continue;
+			pf->pf_stamps[ncell] = pf->pf_stamp;
+			pf->pf_g[ncell] = g + 1;
+			pf->pf_from[ncell] = d;
+			h = distance(nx, ny, x1, y1);
+			pathfinder_push(pf, g + 1 + h, h, ncell);
+		}
+	}
+
+	cell = y1 * width + x1;
+	if (pf->pf_stamps[cell] != pf->pf_stamp)
+		return (-1);
+
+	/*
+	 * Walk back from the goal, filling the path from the end.
+	 */
+	len = pf->pf_g[cell];
+	x = x1;
+	y = y1;
+	while (x != x0 || y != y0) {
+		d = pf->pf_from[y * width + x];
+		pf->pf_path[pf->pf_g[y * width + x] - 1] = d;
+		x -= path_dx[d];
+		y -= path_dy[d];
+	}
+
+	return (len);
+}
+
+/*
+ * Finds the shortest path from (x0, y0) to (x1, y1), ignoring actors.
+ * Returns the number of steps, with the steps themselves in "path",
+ * valid until the next call, or -1 if the goal can't be reached.
+ */
+int
+pathfinder_find(struct pathfinder *pf, struct map *m, unsigned int x0, unsigned int y0,
+    unsigned int x1, unsigned int y1, const unsigned char **path)
+{
+	struct path_cache_entry *pce;
+	unsigned int hash;
+	int len;
+
+	if (x0 >= map_get_width(m) || y0 >= map_get_height(m))
+		return (-1);
+	if (x1 >= map_get_width(m) || y1 >= map_get_height(m))
+		return (-1);
+
+	hash = (x0 * 73856093u) ^ (y0 * 19349663u) ^ (x1 * 83492791u) ^ (y1 * 2654435761u) ^
+	    (unsigned int)((uintptr_t)m >> 4);
+	pce = &pf->pf_cache[hash % PATH_CACHE_SIZE];
+	if (pce->pce_map == m && pce->pce_version == map_get_version(m) &&
+	    pce->pce_x0 == x0 && pce->pce_y0 == y0 && pce->pce_x1 == x1 && pce->pce_y1 == y1) {
+		*path = pce->pce_path;
+		return (pce->pce_len);
+	}
+
+	len = pathfinder_search(pf, m, x0, y0, x1, y1);
+
+	if (len > 0 && (size_t)len > pce->pce_path_size) {
+		free(pce->pce_path);
+		pce->pce_path = malloc(len);
+		if (pce->pce_path == NULL)
+			err(1, "malloc");
+		pce->pce_path_size = len;
+	}
+	if (len > 0)
+		memcpy(pce->pce_path, pf->pf_path, len);
+	pce->pce_map = m;
+	pce->pce_version = map_get_version(m);
+	pce->pce_x0 = x0;
+	pce->pce_y0 = y0;
+	pce->pce_x1 = x1;
+	pce->pce_y1 = y1;
+	pce->pce_len = len;
+
+	*path = pce->pce_path;
+	return (len);
+}
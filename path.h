@@ -0,0 +1,21 @@
+#ifndef PATH_H
+#define	PATH_H
+
+struct map;
+struct pathfinder;
+
+/*
+ * Steps the path is made of.
+ */
+#define	PATH_NORTH	0
+#define	PATH_SOUTH	1
+#define	PATH_WEST	2
+#define	PATH_EAST	3
+
+struct pathfinder	*pathfinder_new(void);
+void			pathfinder_delete(struct pathfinder *pf);
+int			pathfinder_find(struct pathfinder *pf, struct map *m, unsigned int x0, unsigned int y0,
+			    unsigned int x1, unsigned int y1, const unsigned char **path);
+void			pathfinder_forget_map(struct pathfinder *pf, struct map *m);
+
+#endif /* !PATH_H */
@@ -4,6 +4,8 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -11,6 +13,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#define	REMOTE_BUF_SIZE_MAX	(4 * 1024 * 1024)
+
 struct remote;
 
 struct expect {
@@ -26,6 +30,11 @@ struct remote {
 	size_t			r_buffered;
 	size_t			r_buf_size;
 	char			*r_buf;
+	bool			r_overflow;
+	bool			r_queueing;
+	size_t			r_queued;
+	size_t			r_queue_size;
+	char			*r_queue;
 	TAILQ_HEAD(, expect)	r_expects; /* sic */
 };
 
@@ -67,16 +76,107 @@ remote_delete(struct remote *r)
 
 	close(r->r_fd);
 	free(r->r_buf);
+	free(r->r_queue);
 	free(r);
 }
 
+/*
+ * Send messages formatted elsewhere; every one of them must be followed
+ * by the terminating NUL, the way remote_send() sends them.
+ */
+void
+remote_send_raw(struct remote *r, const char *buf, size_t len)
+{
+	ssize_t written;
+
+	if (!r->r_queueing) {
+		written = write(r->r_fd, buf, len);
+		if (written < 0)
+			warn("write");
+		return;
+	}
+
+	/*
+	 * Nothing may overtake what's already queued.
+	 */
+	if (r->r_queued == 0) {
+		written = write(r->r_fd, buf, len);
+		if (written < 0 && errno != EAGAIN && errno != EINTR) {
+			warn("write");
+			return;
+		}
+		if (written > 0) {
+			buf += written;
+			len -= written;
+		}
+	}
+	if (len == 0)
+		return;
+
+	if (r->r_queued + len > r->r_queue_size) {
+		while (r->r_queued + len > r->r_queue_size)
+			r->r_queue_size = r->r_queue_size > 0 ? r->r_queue_size * 2 : 1024;
+		r->r_queue = realloc(r->r_queue, r->r_queue_size);
+		if (r->r_queue == NULL)
+			err(1, "realloc");
+	}
+	memcpy(r->r_queue + r->r_queued, buf, len);
+	r->r_queued += len;
+}
+
+/*
+ * Make the socket nonblocking; from now on, whatever can't be written
+ * right away gets queued, to be sent by remote_flush() once the socket
+ * becomes writable.
+ */
+void
+remote_set_queueing(struct remote *r)
+{
+	int flags;
+
+	flags = fcntl(r->r_fd, F_GETFL);
+	if (flags < 0 || fcntl(r->r_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		err(1, "fcntl");
+	r->r_queueing = true;
+}
+
+/*
+ * Returns the number of bytes waiting to be sent.
+ */
+size_t
+remote_queued(const struct remote *r)
+{
+
+	return (r->r_queued);
+}
+
+/*
+ * Send as much of the queue as the socket takes.  Returns false
+ * if the connection is gone.
+ */
+bool
+remote_flush(struct remote *r)
+{
+	ssize_t written;
+
+	if (r->r_queued == 0)
+		return (true);
+
+	written = write(r->r_fd, r->r_queue, r->r_queued);
+	if (written < 0)
+		return (errno == EAGAIN || errno == EINTR);
+
+	r->r_queued -= written;
+	memmove(r->r_queue, r->r_queue + written, r->r_queued);
+	return (true);
+}
+
 void
 remote_send(struct remote *r, const char *fmt, ...)
 {
 	va_list args;
 	char *msg;
 	int msglen;
-	ssize_t len;
 
 	/*
 	 * XXX: Make it nonblocking.
@@ -86,9 +186,7 @@ remote_send(struct remote *r, const char *fmt, ...)
 	va_end(args);
 	if (msglen <= 0)
 		err(1, "vasprintf");
-	len = write(r->r_fd, msg, msglen + 1);
-	if (len < 0)
-		warn("write");
+	remote_send_raw(r, msg, msglen + 1);
 	free(msg);
 }
 
@@ -118,10 +216,25 @@ remote_receive_internal(struct remote *r)
 		err(1, "FIONREAD");
 
 	if (bytes > 0) {
+		/*
+		 * Grow the buffer for long lines, such as map regions,
+		 * but don't let a client eat all our memory.
+		 */
+		while (bytes > r->r_buf_size - r->r_buffered && r->r_buf_size < REMOTE_BUF_SIZE_MAX) {
+			r->r_buf_size *= 2;
+			r->r_buf = realloc(r->r_buf, r->r_buf_size);
+			if (r->r_buf == NULL)
+				err(1, "realloc");
+		}
 		if (bytes > r->r_buf_size - r->r_buffered)
 			bytes = r->r_buf_size - r->r_buffered;
 		if (bytes <= 0) {
-			warnx("client overflow\n");
+			/*
+			 * Nothing more is going to fit; as far as the callers
+			 * are concerned, the connection is gone.
+			 */
+			warnx("client overflow");
+			r->r_overflow = true;
 			return (NULL);
 		}
 
@@ -170,6 +283,8 @@ remote_receive(struct remote *r)
 		/*
 		 * Check if the socket is still connected and wait for some data.
 		 */
+		if (r->r_overflow)
+			return (NULL);
 		if (recv(r->r_fd, buf, sizeof(buf), MSG_WAITALL | MSG_PEEK) <= 0)
 			return (NULL);
 
@@ -233,7 +348,10 @@ expect_find(struct remote *r, const char *word)
 	return (NULL);
 }
 
-void
+/*
+ * Returns false if there was no complete command to process.
+ */
+static bool
 remote_process_internal(struct remote *r, bool sync)
 {
 	char *cmd, *word;
@@ -247,7 +365,7 @@ remote_process_internal(struct remote *r, bool sync)
 	else
 		cmd = remote_receive_async(r);
 	if (cmd == NULL)
-		return;
+		return (false);
 
 	/*
 	 * Isolate the first word, find the matching expect,
@@ -294,20 +412,34 @@ remote_process_internal(struct remote *r, bool sync)
 			free(e);
 		}
 	}
+
+	return (true);
 }
 
-void
+/*
+ * Returns false once the connection is gone.
+ */
+bool
 remote_process_sync(struct remote *r)
 {
 
-	remote_process_internal(r, true);
+	return (remote_process_internal(r, true));
 }
 
-void
+/*
+ * Returns false if the connection should be closed, because the other side
+ * has sent a line that doesn't fit in the buffer.
+ */
+bool
 remote_process(struct remote *r)
 {
+
 	/*
-	 * XXX: Deal with all the commands, not just one.
+	 * Deal with all the commands received so far, not just one; otherwise
+	 * the rest would wait in the buffer until some more data arrives.
 	 */
-	remote_process_internal(r, false);
+	while (remote_process_internal(r, false))
+		continue;
+
+	return (!r->r_overflow);
 }
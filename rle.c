@@ -0,0 +1,92 @@
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rle.h"
+
+/*
+ * Run-length encoding used for map regions.  Each run is an optional
+ * decimal count (one, if omitted), followed by the cell.  A cell that
+ * is a digit or a backslash gets prefixed with a backslash.  For example,
+ * "5#3 \1|" decodes into "#####   1|".
+ */
+
+char *
+rle_encode(const char *cells, size_t len)
+{
+	char *rle;
+	size_t i, n, off = 0;
+	int printed;
+
+	/*
+	 * Worst case is two bytes per cell.
+	 */
+	rle = malloc(len * 2 + 1);
+	if (rle == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < len; i += n) {
+		for (n = 1; i + n < len && cells[i + n] == cells[i]; n++)
+			continue;
+
+		if (n > 2) {
+			printed = snprintf(rle + off, len * 2 + 1 - off, "%zu", n);
+			off += printed;
+		} else if (n == 2) {
+			/*
+			 * "2x" is no shorter than "xx"; go for the latter.
+			 */
+			n = 1;
+		}
+		if (isdigit((unsigned char)cells[i]) || cells[i] == '\\')
+			rle[off++] = '\\';
+		rle[off++] = cells[i];
+	}
+	rle[off] = '\0';
+
+	return (rle);
+}
+
+/*
+ * Returns NULL if the data is malformed, or doesn't decode
+ * into exactly 'len' cells.
+ */
+char *
+rle_decode(const char *rle, size_t len)
+{
+	char *cells, *end;
+	size_t off = 0;
+	unsigned long n;
+
+	cells = malloc(len + 1);
+	if (cells == NULL)
+		err(1, "malloc");
+
+	while (*rle != '\0') {
+		n = 1;
+		if (isdigit((unsigned char)*rle)) {
+			n = strtoul(rle, &end, 10);
+			rle = end;
+		}
+		if (*rle == '\\')
+			rle++;
+		if (*rle == '\0' || n == 0 || n > len - off) {
+			free(cells);
+			return (NULL);
+		}
+
+		memset(cells + off, *rle, n);
+		off += n;
+		rle++;
+	}
+
+	if (off != len) {
+		free(cells);
+		return (NULL);
+	}
+	cells[len] = '\0';
+
+	return (cells);
+}
@@ -0,0 +1,9 @@
+#ifndef RLE_H
+#define	RLE_H
+
+#include <stddef.h>
+
+char		*rle_encode(const char *cells, size_t len);
+char		*rle_decode(const char *rle, size_t len);
+
+#endif /* !RLE_H */
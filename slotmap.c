@@ -0,0 +1,212 @@
+#include <assert.h>
+#include <err.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "slotmap.h"
+
+/*
+ * Maps IDs to pointers in constant time.  An ID consists of the slot index
+ * in the low bits and the generation of the slot above them.  Freeing
+ * a slot bumps its generation, so that stale IDs don't resolve to whatever
+ * reuses the slot later.  IDs are kept below INT_MAX, because they get
+ * printed with "%d", and are never zero.
+ *
+ * A slot map can be limited to a range of indices, so that several of them
+ * can hand out IDs that never collide; the slots are then numbered from
+ * the start of the range.
+ */
+
+#define	SLOTMAP_INDEX_BITS	20
+#define	SLOTMAP_INDEX_MASK	((1U << SLOTMAP_INDEX_BITS) - 1)
+#define	SLOTMAP_GEN_MASK	((1U << (31 - SLOTMAP_INDEX_BITS)) - 1)
+#define	SLOTMAP_NONE		UINT_MAX
+
+struct slot {
+	void		*s_ptr;
+	unsigned int	s_gen;
+	unsigned int	s_next_free;
+};
+
+struct slotmap {
+	struct slot	*sm_slots;
+	unsigned int	sm_nslots;
+	unsigned int	sm_base;
+	unsigned int	sm_limit;
+	unsigned int	sm_first_free;
+};
+
+static unsigned int
+slotmap_id(unsigned int index, unsigned int gen)
+{
+
+	return ((gen << SLOTMAP_INDEX_BITS) | index);
+}
+
+static unsigned int
+slotmap_gen(unsigned int id)
+{
+
+	return ((id >> SLOTMAP_INDEX_BITS) & SLOTMAP_GEN_MASK);
+}
+
+unsigned int
+slotmap_index(unsigned int id)
+{
+
+	return (id & SLOTMAP_INDEX_MASK);
+}
+
+/*
+ * IDs handed out will have indices from "first" to "first" + "count" - 1.
+ */
+struct slotmap *
+slotmap_new_range(unsigned int first, unsigned int count)
+{
+	struct slotmap *sm;
+
+	assert(count > 0 && first <= SLOTMAP_INDEX_MASK && count - 1 <= SLOTMAP_INDEX_MASK - first);
+
+	sm = calloc(1, sizeof(*sm));
+	if (sm == NULL)
+		err(1, "calloc");
+	sm->sm_first_free = SLOTMAP_NONE;
+	sm->sm_base = first;
+	sm->sm_limit = count;
+
+	return (sm);
+}
+
+struct slotmap *
+slotmap_new(void)
+{
+
+	return (slotmap_new_range(0, SLOTMAP_INDEX_MASK + 1));
+}
+
+void
+slotmap_delete(struct slotmap *sm)
+{
+
+	free(sm->sm_slots);
+	free(sm);
+}
+
+/*
+ * Make sure there are at least 'nslots' slots; new ones go on the free list.
+ */
+static void
+slotmap_grow(struct slotmap *sm, unsigned int nslots)
+{
+	unsigned int i, n;
+
+	if (nslots <= sm->sm_nslots)
+		return;
+	if (nslots > sm->sm_limit)
+		errx(1, "slotmap: out of slots");
+
+	n = sm->sm_nslots > 0 ? sm->sm_nslots : 64;
+	while (n < nslots)
+		n *= 2;
+	if (n > sm->sm_limit)
+		n = sm->sm_limit;
+
+	sm->sm_slots = realloc(sm->sm_slots, n * sizeof(*sm->sm_slots));
+	if (sm->sm_slots == NULL)
+		err(1, "realloc");
+
+	/*
+	 * Push them in reverse, so that lower indices get used first.
+	 */
+	for (i = n; i > sm->sm_nslots; i--) {
+		sm->sm_slots[i - 1].s_ptr = NULL;
+		sm->sm_slots[i - 1].s_gen = 1;
+		sm->sm_slots[i - 1].s_next_free = sm->sm_first_free;
+		sm->sm_first_free = i - 1;
+	}
+	sm->sm_nslots = n;
+}
+
+unsigned int
+slotmap_alloc(struct slotmap *sm, void *ptr)
+{
+	struct slot *s;
+	unsigned int index;
+
+	assert(ptr != NULL);
+
+	if (sm->sm_first_free == SLOTMAP_NONE)
+		slotmap_grow(sm, sm->sm_nslots + 1);
+
+	index = sm->sm_first_free;
+	s = &sm->sm_slots[index];
+	sm->sm_first_free = s->s_next_free;
+	s->s_ptr = ptr;
+
+	return (slotmap_id(sm->sm_base + index, s->s_gen));
+}
+
+/*
+ * Take a specific ID, e.g. when restoring the state from the journal.
+ * Returns false if it's already taken, or out of range.  Removing the slot
+ * from the middle of the free list is O(n), but it's only done at startup.
+ */
+bool
+slotmap_claim(struct slotmap *sm, unsigned int id, void *ptr)
+{
+	unsigned int index, *prevp;
+
+	assert(ptr != NULL);
+
+	index = slotmap_index(id);
+	if (index < sm->sm_base || index - sm->sm_base >= sm->sm_limit)
+		return (false);
+	index -= sm->sm_base;
+	slotmap_grow(sm, index + 1);
+	if (sm->sm_slots[index].s_ptr != NULL)
+		return (false);
+
+	for (prevp = &sm->sm_first_free; *prevp != index; prevp = &sm->sm_slots[*prevp].s_next_free)
+		assert(*prevp != SLOTMAP_NONE);
+	*prevp = sm->sm_slots[index].s_next_free;
+
+	sm->sm_slots[index].s_ptr = ptr;
+	sm->sm_slots[index].s_gen = slotmap_gen(id);
+
+	return (true);
+}
+
+void
+slotmap_free(struct slotmap *sm, unsigned int id)
+{
+	struct slot *s;
+
+	assert(slotmap_get(sm, id) != NULL);
+	s = &sm->sm_slots[slotmap_index(id) - sm->sm_base];
+
+	s->s_ptr = NULL;
+	s->s_gen = (s->s_gen + 1) & SLOTMAP_GEN_MASK;
+	if (s->s_gen == 0)
+		s->s_gen = 1;
+	s->s_next_free = sm->sm_first_free;
+	sm->sm_first_free = slotmap_index(id) - sm->sm_base;
+}
+
+/*
+ * Returns NULL for IDs that are stale, or were never allocated.
+ */
+void *
+slotmap_get(struct slotmap *sm, unsigned int id)
+{
+	struct slot *s;
+
+	if (slotmap_index(id) < sm->sm_base || slotmap_index(id) - sm->sm_base >= sm->sm_nslots)
+		return (NULL);
+
+	s = &sm->sm_slots[slotmap_index(id) - sm->sm_base];
+	if (s->s_gen != slotmap_gen(id))
+		return (NULL);
+
+	return (s->s_ptr);
+}
@@ -0,0 +1,17 @@
+#ifndef SLOTMAP_H
+#define	SLOTMAP_H
+
+#include <stdbool.h>
+
+struct slotmap;
+
+struct slotmap	*slotmap_new(void);
+struct slotmap	*slotmap_new_range(unsigned int first, unsigned int count);
+void		slotmap_delete(struct slotmap *sm);
+unsigned int	slotmap_alloc(struct slotmap *sm, void *ptr);
+bool		slotmap_claim(struct slotmap *sm, unsigned int id, void *ptr);
+void		slotmap_free(struct slotmap *sm, unsigned int id);
+void		*slotmap_get(struct slotmap *sm, unsigned int id);
+unsigned int	slotmap_index(unsigned int id);
+
+#endif /* !SLOTMAP_H */
@@ -0,0 +1,185 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snaptable.h"
+
+/*
+ * A table of fixed size records, indexed by small integers, which can
+ * be snapshotted cheaply.  Records are kept in chunks of SNAPTABLE_CHUNK;
+ * a snapshot - a view - just takes a reference to every chunk, and the table
+ * copies a chunk before changing it if a view still refers to it, the way
+ * maps do.  Views never change, so they can be read from any thread;
+ * everything else, including deleting views, is for the thread that changes
+ * the table, since that's what touches the reference counts.
+ */
+
+#define	SNAPTABLE_CHUNK		256
+
+struct snaptable_chunk {
+	unsigned int		sc_refcount;
+	unsigned char		sc_data[];
+};
+
+struct snaptable {
+	size_t			st_size;
+	unsigned int		st_nchunks;
+	struct snaptable_chunk	**st_chunks;
+};
+
+struct snaptable_view {
+	size_t			sv_size;
+	unsigned int		sv_nchunks;
+	struct snaptable_chunk	**sv_chunks;
+};
+
+struct snaptable *
+snaptable_new(size_t size)
+{
+	struct snaptable *st;
+
+	assert(size > 0);
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL)
+		err(1, "calloc");
+	st->st_size = size;
+
+	return (st);
+}
+
+static void
+snaptable_chunk_release(struct snaptable_chunk *sc)
+{
+
+	if (sc == NULL)
+		return;
+	assert(sc->sc_refcount > 0);
+	sc->sc_refcount--;
+	if (sc->sc_refcount == 0)
+		free(sc);
+}
+
+/*
+ * Views taken from the table remain valid.
+ */
+void
+snaptable_delete(struct snaptable *st)
+{
+	unsigned int i;
+
+	for (i = 0; i < st->st_nchunks; i++)
+		snaptable_chunk_release(st->st_chunks[i]);
+	free(st->st_chunks);
+	free(st);
+}
+
+/*
+ * Returns the record, for changing it; records never set are zero-filled.
+ * Valid until the next snaptable_snapshot().
+ */
+void *
+snaptable_set(struct snaptable *st, unsigned int index)
+{
+	struct snaptable_chunk **scp, *copy;
+	size_t chunk_size;
+	unsigned int n;
+
+	if (index / SNAPTABLE_CHUNK >= st->st_nchunks) {
+		n = st->st_nchunks > 0 ? st->st_nchunks : 16;
+		while (n <= index / SNAPTABLE_CHUNK)
+			n *= 2;
+		st->st_chunks = realloc(st->st_chunks, n * sizeof(*st->st_chunks));
+		if (st->st_chunks == NULL)
+			err(1, "realloc");
+		memset(st->st_chunks + st->st_nchunks, 0, (n - st->st_nchunks) * sizeof(*st->st_chunks));
+		st->st_nchunks = n;
+	}
+
+	chunk_size = sizeof(**scp) + st->st_size * SNAPTABLE_CHUNK;
+	scp = &st->st_chunks[index / SNAPTABLE_CHUNK];
+	if (*scp == NULL) {
+		*scp = calloc(1, chunk_size);
+		if (*scp == NULL)
+			err(1, "calloc");
+		(*scp)->sc_refcount = 1;
+	} else if ((*scp)->sc_refcount > 1) {
+		copy = malloc(chunk_size);
+		if (copy == NULL)
+			err(1, "malloc");
+		memcpy(copy, *scp, chunk_size);
+		copy->sc_refcount = 1;
+		snaptable_chunk_release(*scp);
+		*scp = copy;
+	}
+
+	return ((*scp)->sc_data + st->st_size * (index % SNAPTABLE_CHUNK));
+}
+
+/*
+ * Zero-fill the record.
+ */
+void
+snaptable_clear(struct snaptable *st, unsigned int index)
+{
+
+	if (index / SNAPTABLE_CHUNK >= st->st_nchunks || st->st_chunks[index / SNAPTABLE_CHUNK] == NULL)
+		return;
+
+	memset(snaptable_set(st, index), 0, st->st_size);
+}
+
+struct snaptable_view *
+snaptable_snapshot(struct snaptable *st)
+{
+	struct snaptable_view *sv;
+	unsigned int i;
+
+	sv = calloc(1, sizeof(*sv));
+	if (sv == NULL)
+		err(1, "calloc");
+	sv->sv_size = st->st_size;
+	sv->sv_nchunks = st->st_nchunks;
+	if (sv->sv_nchunks == 0)
+		return (sv);
+	sv->sv_chunks = malloc(sv->sv_nchunks * sizeof(*sv->sv_chunks));
+	if (sv->sv_chunks == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < st->st_nchunks; i++) {
+		sv->sv_chunks[i] = st->st_chunks[i];
+		if (sv->sv_chunks[i] != NULL)
+			sv->sv_chunks[i]->sc_refcount++;
+	}
+
+	return (sv);
+}
+
+void
+snaptable_view_delete(struct snaptable_view *sv)
+{
+	unsigned int i;
+
+	for (i = 0; i < sv->sv_nchunks; i++)
+		snaptable_chunk_release(sv->sv_chunks[i]);
+	free(sv->sv_chunks);
+	free(sv);
+}
+
+/*
+ * Returns NULL for records that were never set.
+ */
+const void *
+snaptable_view_get(const struct snaptable_view *sv, unsigned int index)
+{
+	const struct snaptable_chunk *sc;
+
+	if (index / SNAPTABLE_CHUNK >= sv->sv_nchunks)
+		return (NULL);
+	sc = sv->sv_chunks[index / SNAPTABLE_CHUNK];
+	if (sc == NULL)
+		return (NULL);
+
+	return (sc->sc_data + sv->sv_size * (index % SNAPTABLE_CHUNK));
+}
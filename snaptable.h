@@ -0,0 +1,17 @@
+#ifndef SNAPTABLE_H
+#define	SNAPTABLE_H
+
+#include <stddef.h>
+
+struct snaptable;
+struct snaptable_view;
+
+struct snaptable	*snaptable_new(size_t size);
+void			snaptable_delete(struct snaptable *st);
+void			*snaptable_set(struct snaptable *st, unsigned int index);
+void			snaptable_clear(struct snaptable *st, unsigned int index);
+struct snaptable_view	*snaptable_snapshot(struct snaptable *st);
+void			snaptable_view_delete(struct snaptable_view *sv);
+const void		*snaptable_view_get(const struct snaptable_view *sv, unsigned int index);
+
+#endif /* !SNAPTABLE_H */
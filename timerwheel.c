@@ -0,0 +1,302 @@
+#include <assert.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "timerwheel.h"
+
+/*
+ * Hierarchical timing wheel.  Times are in ticks of whatever unit the caller
+ * chooses.  There are four levels of 256 slots each; level 0 has a slot per
+ * tick, level 1 per 256 ticks, and so on.  A timer goes into the lowest
+ * level whose range covers it; whenever time crosses a slot boundary
+ * of a level above, the timers in that slot get spread over the levels
+ * below.  Timers further away than the whole wheel reaches get parked
+ * in the top level and cascaded down again later.
+ *
+ * Scheduling and cancelling are constant time.  There's a bitmap of
+ * non-empty slots for every level, so that running and figuring out
+ * the next deadline skips empty slots instead of visiting every tick.
+ * Timers due at the same tick fire in no particular order.
+ */
+
+#define	TW_LEVELS	4
+#define	TW_BITS		8
+#define	TW_SLOTS	(1 << TW_BITS)
+#define	TW_MASK		(TW_SLOTS - 1)
+#define	TW_WORDS	(TW_SLOTS / 64)
+#define	TW_REACH	(((uint64_t)1 << (TW_LEVELS * TW_BITS)) - 1)
+
+/*
+ * t_level for timers taken out of the wheel, about to fire.
+ */
+#define	TW_FIRING	TW_LEVELS
+
+struct timerwheel {
+	LIST_HEAD(, timer)	tw_slots[TW_LEVELS][TW_SLOTS];
+	uint64_t		tw_occupied[TW_LEVELS][TW_WORDS];
+	uint64_t		tw_tick;	/* first tick not run yet */
+	uint64_t		tw_now;
+	unsigned long		tw_count;
+};
+
+struct timerwheel *
+timerwheel_new(uint64_t now)
+{
+	struct timerwheel *tw;
+	unsigned int level, slot;
+
+	tw = calloc(1, sizeof(*tw));
+	if (tw == NULL)
+		err(1, "calloc");
+
+	for (level = 0; level < TW_LEVELS; level++) {
+		for (slot = 0; slot < TW_SLOTS; slot++)
+			LIST_INIT(&tw->tw_slots[level][slot]);
+	}
+	tw->tw_tick = now;
+	tw->tw_now = now;
+
+	return (tw);
+}
+
+/*
+ * Timers still pending are simply forgotten.
+ */
+void
+timerwheel_delete(struct timerwheel *tw)
+{
+
+	free(tw);
+}
+
+void
+timerwheel_init(struct timer *t, void (*fn)(void *arg), void *arg)
+{
+
+	t->t_fn = fn;
+	t->t_arg = arg;
+	t->t_pending = false;
+}
+
+static void
+timerwheel_place(struct timerwheel *tw, struct timer *t)
+{
+	uint64_t pos, delta;
+	unsigned int level;
+
+	pos = t->t_due < tw->tw_tick ? tw->tw_tick : t->t_due;
+	delta = pos - tw->tw_tick;
+	if (delta > TW_REACH) {
+		pos = tw->tw_tick + TW_REACH;
+		delta = TW_REACH;
+	}
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < (uint64_t)1 << (TW_BITS * (level + 1)))
+			break;
+	}
+
+	t->t_level = level;
+	t->t_slot = (pos >> (TW_BITS * level)) & TW_MASK;
+	LIST_INSERT_HEAD(&tw->tw_slots[level][t->t_slot], t, t_next);
+	tw->tw_occupied[level][t->t_slot / 64] |= (uint64_t)1 << (t->t_slot % 64);
+}
+
+static void
+timerwheel_unlink(struct timerwheel *tw, struct timer *t)
+{
+
+	LIST_REMOVE(t, t_next);
+	if (t->t_level != TW_FIRING && LIST_EMPTY(&tw->tw_slots[t->t_level][t->t_slot]))
+		tw->tw_occupied[t->t_level][t->t_slot / 64] &= ~((uint64_t)1 << (t->t_slot % 64));
+}
+
+/*
+ * Schedule the timer to fire once "due" is reached, rescheduling it
+ * if it's already pending.  Timers that are already due fire on the next
+ * timerwheel_run().
+ */
+void
+timerwheel_schedule(struct timerwheel *tw, struct timer *t, uint64_t due)
+{
+
+	if (t->t_pending)
+		timerwheel_cancel(tw, t);
+
+	t->t_due = due;
+	t->t_pending = true;
+	tw->tw_count++;
+	timerwheel_place(tw, t);
+}
+
+void
+timerwheel_cancel(struct timerwheel *tw, struct timer *t)
+{
+
+	if (!t->t_pending)
+		return;
+
+	timerwheel_unlink(tw, t);
+	t->t_pending = false;
+	tw->tw_count--;
+}
+
+bool
+timerwheel_pending(const struct timer *t)
+{
+
+	return (t->t_pending);
+}
+
+uint64_t
+timerwheel_due(const struct timer *t)
+{
+
+	return (t->t_due);
+}
+
+/*
+ * Returns the time passed to the latest timerwheel_run().
+ */
+uint64_t
+timerwheel_now(struct timerwheel *tw)
+{
+
+	return (tw->tw_now);
+}
+
+/*
+ * Returns the first non-empty slot at or after "start", wrapping around,
+ * or -1 if they are all empty.
+ */
+static int
+timerwheel_find(const uint64_t *occupied, unsigned int start)
+{
+	uint64_t word;
+	unsigned int i, w;
+
+	for (i = 0; i <= TW_WORDS; i++) {
+		w = (start / 64 + i) % TW_WORDS;
+		word = occupied[w];
+		if (i == 0)
+			word &= ~(uint64_t)0 << (start % 64);
+		else if (i == TW_WORDS)
+			word &= ~(~(uint64_t)0 << (start % 64));
+		if (word != 0)
+			return (w * 64 + ffsll(word) - 1);
+	}
+
+	return (-1);
+}
+
+/*
+ * Finds the first tick at which something needs doing: either timers
+ * firing, or a slot from one of the upper levels getting cascaded.
+ */
+static bool
+timerwheel_next_tick(struct timerwheel *tw, uint64_t *tickp)
+{
+	uint64_t base, tick;
+	unsigned int level, shift, cur;
+	bool found = false;
+	int slot;
+
+	for (level = 0; level < TW_LEVELS; level++) {
+		shift = TW_BITS * level;
+		/*
+		 * The first tick at which this level moves on to its next slot.
+		 */
+		base = ((tw->tw_tick + ((uint64_t)1 << shift) - 1) >> shift) << shift;
+		cur = (base >> shift) & TW_MASK;
+		slot = timerwheel_find(tw->tw_occupied[level], cur);
+		if (slot < 0)
+			continue;
+		tick = base + ((uint64_t)((slot - cur) & TW_MASK) << shift);
+		if (!found || tick < *tickp)
+			*tickp = tick;
+		found = true;
+	}
+
+	return (found);
+}
+
+static void
+timerwheel_cascade(struct timerwheel *tw, unsigned int level, unsigned int slot)
+{
+	struct timer *t;
+
+	while ((t = LIST_FIRST(&tw->tw_slots[level][slot])) != NULL) {
+		LIST_REMOVE(t, t_next);
+		timerwheel_place(tw, t);
+	}
+	tw->tw_occupied[level][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+}
+
+/*
+ * Fire every timer due at or before "now".  Callbacks are free to schedule
+ * and cancel timers, including their own.
+ */
+void
+timerwheel_run(struct timerwheel *tw, uint64_t now)
+{
+	LIST_HEAD(, timer) firing;
+	struct timer *t;
+	uint64_t tick;
+	unsigned int level, slot;
+
+	tw->tw_now = now;
+
+	while (tw->tw_count > 0 && timerwheel_next_tick(tw, &tick) && tick <= now) {
+		assert(tick >= tw->tw_tick);
+		tw->tw_tick = tick;
+
+		for (level = 1; level < TW_LEVELS; level++) {
+			if ((tick & (((uint64_t)1 << (TW_BITS * level)) - 1)) != 0)
+				break;
+			timerwheel_cascade(tw, level, (tick >> (TW_BITS * level)) & TW_MASK);
+		}
+
+		/*
+		 * Take the timers out of the slot before running any of them;
+		 * those scheduled from the callbacks could otherwise end up
+		 * in the very same slot, one revolution later.
+		 */
+		LIST_INIT(&firing);
+		slot = tick & TW_MASK;
+		while ((t = LIST_FIRST(&tw->tw_slots[0][slot])) != NULL) {
+			LIST_REMOVE(t, t_next);
+			t->t_level = TW_FIRING;
+			LIST_INSERT_HEAD(&firing, t, t_next);
+		}
+		tw->tw_occupied[0][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+		tw->tw_tick = tick + 1;
+
+		while ((t = LIST_FIRST(&firing)) != NULL) {
+			LIST_REMOVE(t, t_next);
+			t->t_pending = false;
+			tw->tw_count--;
+			t->t_fn(t->t_arg);
+		}
+	}
+
+	if (tw->tw_tick <= now)
+		tw->tw_tick = now + 1;
+}
+
+/*
+ * Returns false if there are no timers, otherwise sets "due" to when
+ * timerwheel_run() should be called next.  That might be a bit early,
+ * when there is nothing to fire, just timers to move down the levels.
+ */
+bool
+timerwheel_next(struct timerwheel *tw, uint64_t *due)
+{
+
+	if (tw->tw_count == 0)
+		return (false);
+
+	return (timerwheel_next_tick(tw, due));
+}
@@ -0,0 +1,35 @@
+#ifndef TIMERWHEEL_H
+#define	TIMERWHEEL_H
+
+#include <sys/queue.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct timerwheel;
+
+/*
+ * Meant to be embedded in whatever the timer is for, so that scheduling
+ * doesn't allocate anything.  The fields are private.
+ */
+struct timer {
+	LIST_ENTRY(timer)	t_next;
+	uint64_t		t_due;
+	void			(*t_fn)(void *arg);
+	void			*t_arg;
+	bool			t_pending;
+	unsigned char		t_level;
+	unsigned char		t_slot;
+};
+
+struct timerwheel	*timerwheel_new(uint64_t now);
+void			timerwheel_delete(struct timerwheel *tw);
+void			timerwheel_init(struct timer *t, void (*fn)(void *arg), void *arg);
+void			timerwheel_schedule(struct timerwheel *tw, struct timer *t, uint64_t due);
+void			timerwheel_cancel(struct timerwheel *tw, struct timer *t);
+bool			timerwheel_pending(const struct timer *t);
+uint64_t		timerwheel_due(const struct timer *t);
+uint64_t		timerwheel_now(struct timerwheel *tw);
+void			timerwheel_run(struct timerwheel *tw, uint64_t now);
+bool			timerwheel_next(struct timerwheel *tw, uint64_t *due);
+
+#endif /* !TIMERWHEEL_H */
@@ -98,7 +98,7 @@ window_new(struct window *parent)
 void
 window_delete(struct window *w)
 {
-	struct window *child, *tmpchild;
+	struct window *child, *tmpchild, *root;
 	struct w_binding *wb, *tmpwb;
 
 	TAILQ_FOREACH_SAFE(child, &w->w_windows, w_next, tmpchild)
@@ -106,6 +106,14 @@ window_delete(struct window *w)
 	TAILQ_FOREACH_SAFE(wb, &w->w_bindings, wb_next, tmpwb)
 		free(wb);
 
+	if (w->w_parent != NULL) {
+		TAILQ_REMOVE(&w->w_parent->w_windows, w, w_next);
+		root = window_get_root(w);
+		if (root->w_window_with_cursor == w)
+			root->w_window_with_cursor = NULL;
+	}
+
+	free(w->w_data);
 	free(w->w_frame_title);
 	free(w);
 }